@@ -6,14 +6,45 @@ uint8_t LDAP::MsgBuilder::id = 1;
 #include <SPI.h>
 #include <MFRC522.h>
 #include <FastLED.h>
+#include <LittleFS.h>
+
+// Request/response hex dumps are only compiled in with LOG_LEVEL_DEBUG
+#define LOG_LEVEL LOG_LEVEL_INFO
+#include "doorlock/log.hpp"
+
+// Per-phase latency histograms, send 'l' on the serial port to print the percentiles.
+// Comment out to compile the instrumentation out entirely.
+#define LATENCY_HISTOGRAMS
+#include "doorlock/latency.hpp"
+#include "doorlock/metrics.hpp"
+
+// Doors driven by this board. Readers share the SPI bus and the RST pin, each on its own SS pin,
+// and the LEDs are chained on LED_PIN in the same order. Add one initializer per door below.
+#define DOOR_COUNT 1
+#define MAX_DOORS DOOR_COUNT
+// LDAP servers, host/port plus backup_servers from server.h. Each one keeps its own TLS session
+// open, which costs heap, so a slow or dead server can be skipped right away.
+#define LDAP_SERVER_COUNT 1
+#define LDAP_MAX_SERVERS LDAP_SERVER_COUNT
+#include "doorlock/controller.hpp"
+#include "doorlock/arduino.hpp"
 
 #define RST_PIN D4
-#define SS_PIN D8
-#define RELAY_PIN D1
-MFRC522 mfrc522(SS_PIN, RST_PIN);
+#define LED_PIN D3
+MFRC522 mfrc522[DOOR_COUNT] = {MFRC522(D8, RST_PIN)};
+DoorLock::PinRelay relays[DOOR_COUNT] = {DoorLock::PinRelay(D1)};
+
+CRGB leds[DOOR_COUNT];
+
+// Give a reader its IRQ pin (e.g. DoorLock::Mfrc522Reader(mfrc522[0], D2)) to detect cards through the
+// interrupt instead of polling the SPI bus
+DoorLock::Mfrc522Reader readers[DOOR_COUNT] = {DoorLock::Mfrc522Reader(mfrc522[0])};
+DoorLock::FastLedLed doorLeds[DOOR_COUNT] = {DoorLock::FastLedLed(leds[0])};
+const DoorLock::Door doors[DOOR_COUNT] = {{readers[0], relays[0], doorLeds[0]}};
 
-#define NUM_LEDS 1
-CRGB leds[NUM_LEDS];
+DoorLock::ArduinoClock boardClock;
+DoorLock::SecureNetClient ldapClients[LDAP_SERVER_COUNT];
+DoorLock::NetClient *const ldapNets[LDAP_SERVER_COUNT] = {&ldapClients[0]};
 
 // This file is in .gitignore
 // It should contain the following values:
@@ -22,6 +53,8 @@ const char *ssid = "WIFI_SSID";
 const char *password = "WIFI_PSK";
 const char *host = "LDAP_HOST";
 const uint16_t port = LDAP_PORT;
+// Only with LDAP_SERVER_COUNT > 1
+const DoorLock::Endpoint backup_servers[LDAP_SERVER_COUNT - 1] = {{"LDAP_BACKUP_HOST", LDAP_PORT}};
 */
 #include "server.h"
 
@@ -35,205 +68,269 @@ const char* ldap_member_group = "ou=Members,dc=DoorLockDC";
 */
 #include "login.h"
 
-void setup() {
-  Serial.begin(115200);
+// Uncomment to only let in members of this group, checked in the same search as the badge
+// #define LDAP_ACTIVE_GROUP "cn=ptl-active,ou=Groups,dc=DoorLockDC"
 
-  Serial.println();
-  Serial.print("Connecting to ");
-  Serial.println(ssid);
+// Uncomment to look badges up with another RFC 4515 filter, {0} stands for the badge NUID
+// #define LDAP_LOOKUP_FILTER "(&(objectClass=ptlMember)(badgenuid={0}))"
 
-  // Wait a bit, can help when resetting or reflashing some times
-  delay(1000);
+// Local mirror of every badgenuid under ldap_member_group, refreshed in the background
+#define MEMBERS_PATH "/members.bin"
+#define MEMBERS_TMP_PATH "/members.tmp"
+#define MEMBER_SYNC_INTERVAL (15UL * 60 * 1000)
+#define MEMBER_SYNC_TIMEOUT 10000
+// Badges per page of the sync, keeps each answer small and under the size limit of the server
+#define MEMBER_SYNC_PAGE_SIZE 200
+// A mirror no sync could refresh for this long is dropped, revoked badges would otherwise open the door forever
+#define MEMBER_MIRROR_MAX_AGE (24UL * 60 * 60 * 1000)
 
-  FastLED.addLeds<WS2812, D3, GRB>(leds, NUM_LEDS);
-  leds[0] = CRGB::Purple;
-  FastLED.show();
+DoorLock::LittleFsStore memberStore(MEMBERS_PATH, MEMBERS_TMP_PATH);
 
-  // Init the SPI for the RFID reader
-  SPI.begin();
-	mfrc522.PCD_Init();
-  mfrc522.PCD_DumpVersionToSerial();
-  pinMode(RELAY_PIN, OUTPUT);
-
-  WiFi.mode(WIFI_STA);
-  WiFi.begin(ssid, password);
-
-  Serial.print("Connecting to WiFi...");
-  bool led_state = false;
-  while (WiFi.status() != WL_CONNECTED) {
-    if (led_state) {
-      leds[0] = CRGB::Purple;
-      FastLED.show();
-    } else {
-      leds[0] = CRGB::Black;
-      FastLED.show();
-    }
-    delay(500);
-    Serial.print(".");
-    led_state = !led_state;
+// Last access point (BSSID and channel) joined, so a boot or a reconnect skips the scan.
+// Uncomment WIFI_STATIC_IP to also reuse the last DHCP lease, only if the router keeps leases.
+#define WIFI_CACHE_PATH "/wifi.bin"
+#define WIFI_CACHE_TMP_PATH "/wifi.tmp"
+// #define WIFI_STATIC_IP
+
+DoorLock::LittleFsStore wifiStore(WIFI_CACHE_PATH, WIFI_CACHE_TMP_PATH);
+#ifdef WIFI_STATIC_IP
+DoorLock::WifiLink wifi(ssid, password, wifiStore, true);
+#else
+DoorLock::WifiLink wifi(ssid, password, wifiStore, false);
+#endif
+// millis() when the first LDAP session was bound, 0 until then
+uint32_t readyAt = 0;
+
+// Badges rejected by the LDAP are denied locally for this long
+#define NEGATIVE_CACHE_TTL (60UL * 1000)
+
+// Uncomment to also deny badges missing from a sync younger than this, without asking the LDAP.
+// New members then have to wait for the next sync once this window is over.
+// #define MEMBER_DENY_UNKNOWN_AGE (5UL * 60 * 1000)
+
+#define LDAP_TIMEOUT 5000
+#define LDAP_RETRY_MIN 5000
+#define LDAP_RETRY_MAX (60UL * 1000)
+// A search still unanswered after this, or twice the usual latency of its server, also goes to the next server
+#define LDAP_HEDGE_DELAY 200
+// An idle session quiet for this long gets a WhoAmI, so a dropped one is reopened before the next swipe. 0 disables.
+#define LDAP_KEEPALIVE (60UL * 1000)
+
+// Uncomment on a trusted network to look badges up over CLDAP: one UDP datagram per swipe, without TLS nor bind.
+// The member sync still uses a session.
+// #define LDAP_CLDAP
+// A CLDAP search unanswered after this is sent again to the next server
+#define CLDAP_RETRANSMIT 500
+
+// Scans older than SCAN_DEADLINE are dropped, the person is most likely gone
+#define SCAN_DEADLINE 10000
+// A card left on the reader is detected again every other poll
+#define SCAN_REPEAT_INTERVAL 3000
+
+DoorLock::Config makeConfig() {
+  DoorLock::Config config;
+  config.addServer(host, port);
+#if LDAP_SERVER_COUNT > 1
+  for (uint8_t i = 0; i < LDAP_SERVER_COUNT - 1; i++) {
+    config.addServer(backup_servers[i].host, backup_servers[i].port);
   }
-  Serial.println("");
+#endif
+  config.login = ldap_login;
+  config.password = ldap_passwd;
+  config.memberGroup = ldap_member_group;
+#ifdef LDAP_ACTIVE_GROUP
+  config.activeGroup = LDAP_ACTIVE_GROUP;
+#endif
+#ifdef LDAP_LOOKUP_FILTER
+  config.lookupFilter = LDAP_LOOKUP_FILTER;
+#endif
+  config.ldapTimeout = LDAP_TIMEOUT;
+  config.ldapRetryMin = LDAP_RETRY_MIN;
+  config.ldapRetryMax = LDAP_RETRY_MAX;
+  config.ldapHedgeDelay = LDAP_HEDGE_DELAY;
+  config.ldapKeepAlive = LDAP_KEEPALIVE;
+  config.cldapRetransmit = CLDAP_RETRANSMIT;
+  config.memberSyncInterval = MEMBER_SYNC_INTERVAL;
+  config.memberSyncTimeout = MEMBER_SYNC_TIMEOUT;
+  config.memberSyncPageSize = MEMBER_SYNC_PAGE_SIZE;
+  config.memberMirrorMaxAge = MEMBER_MIRROR_MAX_AGE;
+  config.negativeCacheTtl = NEGATIVE_CACHE_TTL;
+#ifdef MEMBER_DENY_UNKNOWN_AGE
+  config.memberDenyUnknownAge = MEMBER_DENY_UNKNOWN_AGE;
+#endif
+  config.scanDeadline = SCAN_DEADLINE;
+  config.scanRepeatInterval = SCAN_REPEAT_INTERVAL;
+  return config;
+}
+
+DoorLock::Controller controller(makeConfig(), boardClock, doors, DOOR_COUNT, ldapNets, memberStore);
+#ifdef LDAP_CLDAP
+DoorLock::UdpDatagramClient cldapClient;
+#endif
+
+// Prometheus text metrics on http://<door>:METRICS_PORT/, streamed between swipes
+#define METRICS_PORT 9100
+#define METRICS_TIMEOUT 5000
+
+DoorLock::Gauges gauges;
+DoorLock::Counters counters;
+#ifdef LATENCY_HISTOGRAMS
+DoorLock::MetricsWriter metricsWriter(counters, gauges, &DoorLock::latency());
+#else
+DoorLock::MetricsWriter metricsWriter(counters, gauges, nullptr);
+#endif
+WiFiServer metricsServer(METRICS_PORT);
 
-  Serial.print("WiFi connected, IP: ");
-  Serial.println(WiFi.localIP());
+struct MetricsConnection {
+  bool active = false;
+  WiFiClient client;
+  unsigned long startedAt = 0;
+  char line[160];
+  size_t length = 0;
+  size_t sent = 0;
+} metrics;
+
+void stopMetrics() {
+  metrics.client.stop();
+  metrics.active = false;
 }
 
-void loop() {
-  leds[0] = CRGB::Red;
-  FastLED.show();
-
-  // Reset the loop if no new card present on the sensor/reader. This saves the entire process when idle.
-	if (!mfrc522.PICC_IsNewCardPresent()) {
-    delay(100);
-		return;
-	}
-
-	// Read the cards, restart the loop on error
-	if (!mfrc522.PICC_ReadCardSerial()) {
-		return;
-	}
-
-  leds[0] = CRGB::Blue;
-  FastLED.show();
-
-  // Save the badge NUID into a string
-  Serial.print("Badge NUID: ");
-  string badgenuidstr;
-  ostringstream badgenuidss;
-  for (char i = 0; i < mfrc522.uid.size; i++) {
-    if (mfrc522.uid.uidByte[i] < 0x10) {
-      Serial.print('0');
+// Serves one scrape at a time, writing only what the socket takes without blocking
+void pumpMetrics() {
+  if (!metrics.active) {
+    metrics.client = metricsServer.accept();
+    if (!metrics.client) {
+      return;
     }
-    Serial.print(mfrc522.uid.uidByte[i], HEX);
-    badgenuidss << (char) mfrc522.uid.uidByte[i];
-	}
-  Serial.println();
-  badgenuidstr = badgenuidss.str();
-
-  // Connect to the LDAP server
-  Serial.print("connecting to ");
-  Serial.print(host);
-  Serial.print(':');
-  Serial.println(port);
-
-  // WiFiClient client;
-  BearSSL::WiFiClientSecure client;
-  client.setInsecure();
-  if (!client.connect(host, port)) {
-    Serial.println("connection failed");
-    delay(500);
-    return;
+    metrics.active = true;
+    metrics.startedAt = millis();
+
+    gauges.members = controller.members().size();
+    gauges.freeHeap = ESP.getFreeHeap();
+    gauges.uptimeSeconds = millis() / 1000;
+    gauges.ldapUp = controller.ldapReady();
+    gauges.wifiConnectMillis = wifi.connectMillis;
+    gauges.readyMillis = readyAt;
+    counters = controller.stats();
+    counters.wifiReconnects = wifi.reconnects;
+    metricsWriter.rewind();
+
+    // Whatever the request is, the answer is the same
+    metrics.length = snprintf(metrics.line, sizeof(metrics.line),
+                              "HTTP/1.0 200 OK\r\n"
+                              "Content-Type: text/plain; version=0.0.4\r\n"
+                              "Connection: close\r\n\r\n");
+    metrics.sent = 0;
   }
 
-  // This will send a string to the server
-  Serial.println("Connecting to LDAP");
-  if (client.connected()) {
-    auto req = LDAP::BindRequest(ldap_login, ldap_passwd).str();
-    Serial.println("> BindRequest");
-    for(int i = 0; i < req.length(); i++) {
-      if (req.c_str()[i] < 0x10) {
-        Serial.print('0');
-      }
-      Serial.print(req.c_str()[i], HEX);
-    }
-    Serial.println();
-    client.write((const uint8_t*)req.c_str(), req.length());
-  } else {
-    client.stop();
-    delay(2000);
+  if (millis() - metrics.startedAt > METRICS_TIMEOUT || !metrics.client.connected()) {
+    stopMetrics();
     return;
   }
 
-  // Wait for data to be available
-  unsigned long timeout = millis();
-  while (client.available() == 0) {
-    if (millis() - timeout > 5000) {
-      Serial.println(">>> Client Timeout !");
-      client.stop();
+  uint8_t discard[32];
+  while (metrics.client.available() > 0) {
+    metrics.client.read(discard, sizeof(discard));
+  }
+
+  while (true) {
+    if (metrics.sent == metrics.length) {
+      metrics.length = metricsWriter.next(metrics.line, sizeof(metrics.line));
+      metrics.sent = 0;
+      if (metrics.length == 0) {
+        stopMetrics();
+        return;
+      }
+    }
+    size_t room = metrics.client.availableForWrite();
+    if (room == 0) {
       return;
     }
+    size_t len = min(room, metrics.length - metrics.sent);
+    size_t written = metrics.client.write((const uint8_t*)metrics.line + metrics.sent, len);
+    if (written == 0) {
+      return;
+    }
+    metrics.sent += written;
   }
+}
 
-  // TODO: check if connection is accepted
-  Serial.println("<BindResponse");
-  while (client.available()) {
-    char ch = static_cast<char>(client.read());
-    if(ch < 0x10) {
-      Serial.print('0');
-    }
-    Serial.print(ch, HEX);
+void setLeds(DoorLock::Color color) {
+  for (uint8_t i = 0; i < DOOR_COUNT; i++) {
+    doorLeds[i].set(color);
   }
-  Serial.println();
-
-  // Search for a LDAP user with the scanned badge NUID
-  // TODO: add a filter for ptl-active group
-  Serial.println("sending data to server");
-  if (client.connected()) {
-    auto req = LDAP::SearchRequest(ldap_member_group,
-                                   "badgenuid", 
-                                   badgenuidstr,
-                                   "cn").str();
-    Serial.println(">SearchRequest");
-    for(int i = 0; i < req.length(); i++) {
-      if (req.c_str()[i] < 0x10) {
-        Serial.print('0');
-      }
-      Serial.print(req.c_str()[i], HEX);
-    }
-    Serial.println();
-    client.write((const uint8_t*)req.c_str(), req.length());
-  } else {
-    client.stop();
-    delay(2000);
-    Serial.println("Failed");
-    return;
+}
+
+void setup() {
+  Serial.begin(115200);
+
+  // Associate first, the rest of the setup runs while the radio works
+  if (!LittleFS.begin()) {
+    LOG_ERROR("Could not mount LittleFS");
   }
+  LOG_INFO("Connecting to %s", ssid);
+  wifi.begin();
 
-  timeout = millis();
-  while (client.available() == 0) {
-    if (millis() - timeout > 5000) {
-      Serial.println(">>> Client Timeout !");
-      client.stop();
-      return;
-    }
+  FastLED.addLeds<WS2812, LED_PIN, GRB>(leds, DOOR_COUNT);
+  setLeds(DoorLock::Color::Purple);
+
+  // Init the SPI for the RFID reader
+  SPI.begin();
+  for (uint8_t i = 0; i < DOOR_COUNT; i++) {
+    mfrc522[i].PCD_Init();
+    mfrc522[i].PCD_DumpVersionToSerial();
+    readers[i].begin();
+    relays[i].begin();
   }
 
-  // TODO: properly check if an user is found
-  string res;
-  Serial.println("<SearchResponse");
-  while (client.available()) {
-    char ch = static_cast<char>(client.read());
-    res += ch;
-    if(ch < 0x10) {
-      Serial.print('0');
-    }
-    Serial.print(ch, HEX);
+#ifdef LDAP_CLDAP
+  controller.useCldap(cldapClient);
+#endif
+  // The controller blinks the LEDs until the link is up, doors already open from the mirror meanwhile
+  controller.begin();
+
+  metricsServer.begin();
+}
+
+
+#ifdef LATENCY_HISTOGRAMS
+void printLatency() {
+  for (uint8_t i = 0; i < static_cast<uint8_t>(DoorLock::Latency::Phase::Count); i++) {
+    auto phase = static_cast<DoorLock::Latency::Phase>(i);
+    auto &histogram = DoorLock::latency()[phase];
+    LOG_INFO("%s (us): n %u, p50 %u, p95 %u, p99 %u, max %u",
+             DoorLock::Latency::name(phase),
+             (unsigned)histogram.count(),
+             (unsigned)histogram.percentile(50),
+             (unsigned)histogram.percentile(95),
+             (unsigned)histogram.percentile(99),
+             (unsigned)histogram.max());
   }
-  Serial.println();
-
-  // Close the connection
-  client.stop();
-
-  if (res.length() > 40) {
-    leds[0] = CRGB::Green;
-    FastLED.show();
-    Serial.println("Unlocking");
-    digitalWrite(RELAY_PIN, HIGH);
-    delay(2000);
-    digitalWrite(RELAY_PIN, LOW);
-    leds[0] = CRGB::Red;
-    FastLED.show();
-    Serial.println("Locking back");
-  } else {
-    for(int i = 0; i < 5; i++) {
-      leds[0] = CRGB::Red;
-      FastLED.show();
-      delay(200);
-      leds[0] = CRGB::Black;
-      FastLED.show();
-      delay(200);
-    }
+}
+#endif
+
+void loop() {
+  wifi.loop();
+  uint32_t sleep = controller.loop();
+
+  if (readyAt == 0 && controller.ldapReady()) {
+    readyAt = millis();
+    LOG_INFO("Ready %lu ms after boot, WiFi took %lu ms", (unsigned long)readyAt, (unsigned long)wifi.connectMillis);
+  }
+  DoorLock::logger().drain(Serial);
+#ifdef LATENCY_HISTOGRAMS
+  if (Serial.available() > 0 && Serial.read() == 'l') {
+    printLatency();
+  }
+#endif
+  if (sleep == 0) {
+    return;
+  }
+
+  // Scrapes only get the time nobody is waiting at the door
+  if (controller.idle()) {
+    pumpMetrics();
   }
 
-  delay(1000);
+  delay(sleep);
 }
@@ -0,0 +1,340 @@
+// ESP8266 implementations of doorlock/hal.hpp, only included by the sketch
+
+#ifndef DOORLOCK_ARDUINO_HPP
+#define DOORLOCK_ARDUINO_HPP
+
+#include <Arduino.h>
+#include <ESP8266WiFi.h>
+#include <MFRC522.h>
+#include <FastLED.h>
+#include <LittleFS.h>
+
+#include "hal.hpp"
+#include "log.hpp"
+#include "wifi_cache.hpp"
+
+namespace DoorLock
+{
+    class ArduinoClock : public Clock
+    {
+    public:
+        uint32_t millis() override { return ::millis(); }
+        uint32_t micros() override { return ::micros(); }
+        void delay(uint32_t ms) override { ::delay(ms); }
+    };
+
+    // Without an IRQ pin every check is a blocking REQA round trip, up to the 25 ms timeout of the chip
+    // when no card answers. With one, requestCard() only starts the REQA and the answer raises the IRQ.
+    class Mfrc522Reader : public CardReader
+    {
+        MFRC522 &mfrc522;
+        int8_t irqPin;
+        volatile bool signalled = false;
+
+        static void IRAM_ATTR onIrq(void *reader) { static_cast<Mfrc522Reader *>(reader)->signalled = true; }
+
+        void clearIrq() { this->mfrc522.PCD_WriteRegister(MFRC522::ComIrqReg, 0x7F); }
+
+    public:
+        explicit Mfrc522Reader(MFRC522 &mfrc522, int8_t irqPin = -1) : mfrc522(mfrc522), irqPin(irqPin) {}
+
+        // After PCD_Init()
+        void begin()
+        {
+            if (this->irqPin < 0) {
+                return;
+            }
+            pinMode(this->irqPin, INPUT_PULLUP);
+            // Active low IRQ, raised by received frames only
+            this->mfrc522.PCD_WriteRegister(MFRC522::ComIEnReg, 0xA0);
+            this->clearIrq();
+            attachInterruptArg(digitalPinToInterrupt(this->irqPin), onIrq, this, FALLING);
+        }
+
+        bool interruptDriven() const override { return this->irqPin >= 0; }
+
+        bool cardPresent() override
+        {
+            if (this->irqPin < 0) {
+                // Reset if no new card present on the sensor/reader. This saves the entire process when idle.
+                return this->mfrc522.PICC_IsNewCardPresent();
+            }
+            if (!this->signalled) {
+                return false;
+            }
+            this->signalled = false;
+            this->clearIrq();
+            return true;
+        }
+
+        // Sends a REQA without waiting for the answer
+        void requestCard() override
+        {
+            // A REQA nobody answered leaves the chip receiving
+            this->mfrc522.PCD_WriteRegister(MFRC522::CommandReg, MFRC522::PCD_Idle);
+            this->clearIrq();
+            this->mfrc522.PCD_WriteRegister(MFRC522::FIFOLevelReg, 0x80);
+            this->mfrc522.PCD_WriteRegister(MFRC522::FIFODataReg, MFRC522::PICC_CMD_REQA);
+            this->mfrc522.PCD_WriteRegister(MFRC522::CommandReg, MFRC522::PCD_Transceive);
+            // StartSend, 7 bit short frame
+            this->mfrc522.PCD_WriteRegister(MFRC522::BitFramingReg, 0x87);
+        }
+
+        // Read the cards, restart on error
+        bool readCard(Badge &badge) override
+        {
+            bool read = this->mfrc522.PICC_ReadCardSerial();
+            if (this->irqPin >= 0) {
+                // The frames of the anticollision raised the IRQ too
+                this->mfrc522.PCD_WriteRegister(MFRC522::CommandReg, MFRC522::PCD_Idle);
+                this->clearIrq();
+                this->signalled = false;
+            }
+            if (!read) {
+                return false;
+            }
+            badge = Badge(this->mfrc522.uid.uidByte, this->mfrc522.uid.size);
+            return true;
+        }
+    };
+
+    class PinRelay : public Relay
+    {
+        uint8_t pin;
+
+    public:
+        explicit PinRelay(uint8_t pin) : pin(pin) {}
+
+        void begin() { pinMode(this->pin, OUTPUT); }
+        void set(bool open) override { digitalWrite(this->pin, open ? HIGH : LOW); }
+    };
+
+    class FastLedLed : public Led
+    {
+        CRGB &led;
+
+    public:
+        explicit FastLedLed(CRGB &led) : led(led) {}
+
+        // Pushing the strip takes ~30 us per LED with interrupts off, only do it on a change
+        void set(Color color) override
+        {
+            CRGB next(static_cast<uint32_t>(color));
+            if (this->led == next) {
+                return;
+            }
+            this->led = next;
+            FastLED.show();
+        }
+    };
+
+    // LDAPS over BearSSL, the server certificate is not checked
+    class SecureNetClient : public NetClient
+    {
+        BearSSL::WiFiClientSecure client;
+
+    public:
+        bool linkUp() override { return WiFi.status() == WL_CONNECTED; }
+
+        bool connect(const char *host, uint16_t port) override
+        {
+            // The handshake blocks, let the pending records out first
+            logger().drain(Serial);
+            this->client.setInsecure();
+            return this->client.connect(host, port);
+        }
+
+        bool connected() override { return this->client.connected(); }
+        int available() override { return this->client.available(); }
+        int read(uint8_t *buf, size_t size) override { return this->client.read(buf, size); }
+        size_t write(const uint8_t *buf, size_t size) override { return this->client.write(buf, size); }
+        void stop() override { this->client.stop(); }
+    };
+
+    // CLDAP over the station link, the answers come back to localPort. By default a random port of the
+    // dynamic range, so a forged answer has to guess it as well as the message ID.
+    class UdpDatagramClient : public DatagramClient
+    {
+        WiFiUDP udp;
+        uint16_t localPort;
+        bool listening = false;
+
+    public:
+        explicit UdpDatagramClient(uint16_t localPort = 0) : localPort(localPort) {}
+
+        // The host name is resolved on every send, an address avoids the DNS round trip
+        bool send(const char *host, uint16_t port, const uint8_t *buf, size_t size, Peer &to) override
+        {
+            if (!this->listening) {
+                if (this->localPort == 0) {
+                    this->localPort = 49152 + ESP.random() % 16384;
+                }
+                this->listening = this->udp.begin(this->localPort) == 1;
+            }
+            IPAddress address;
+            if (!WiFi.hostByName(host, address)) {
+                return false;
+            }
+            to.address = address;
+            to.port = port;
+            return this->udp.beginPacket(address, port) == 1 && this->udp.write(buf, size) == size && this->udp.endPacket() == 1;
+        }
+
+        int receive(uint8_t *buf, size_t size, Peer &from) override
+        {
+            if (this->udp.parsePacket() <= 0) {
+                return 0;
+            }
+            from.address = this->udp.remoteIP();
+            from.port = this->udp.remotePort();
+            // What does not fit is dropped by the next parsePacket()
+            return this->udp.read(buf, size);
+        }
+    };
+
+    class LittleFsStore : public BlobStore
+    {
+        const char *path;
+        const char *tmpPath;
+
+    public:
+        LittleFsStore(const char *path, const char *tmpPath) : path(path), tmpPath(tmpPath) {}
+
+        bool load(std::string &data) override
+        {
+            File file = LittleFS.open(this->path, "r");
+            if (!file) {
+                return false;
+            }
+            data.assign(file.size(), '\0');
+            file.read((uint8_t *)&data[0], data.size());
+            file.close();
+            return true;
+        }
+
+        // Write the new file next to the old one then rename it over, so a reset never leaves half a file
+        bool save(nonstd::string_view data) override
+        {
+            File file = LittleFS.open(this->tmpPath, "w");
+            if (!file || file.write((const uint8_t *)data.data(), data.size()) != data.size()) {
+                file.close();
+                return false;
+            }
+            file.close();
+            return LittleFS.rename(this->tmpPath, this->path);
+        }
+    };
+
+    // Station link driven from the loop, never waits. Joins the last good access point on its channel
+    // (and with its DHCP lease when staticIp is set), falls back to a full scan when that fails,
+    // and reconnects as soon as the link drops.
+    class WifiLink
+    {
+        // A cached association normally takes a few hundred ms, a scan a few seconds
+        static const uint32_t CachedTimeout = 3000;
+        static const uint32_t ScanTimeout = 15000;
+
+        const char *ssid;
+        const char *password;
+        BlobStore &store;
+        bool staticIp;
+        WifiCache cache;
+        bool cached = false;
+        bool usingCache = false;
+        bool isUp = false;
+        uint32_t attemptAt = 0;
+
+    public:
+        uint32_t reconnects = 0;
+        uint32_t connectMillis = 0; // Last association, from WiFi.begin() to connected
+
+        WifiLink(const char *ssid, const char *password, BlobStore &store, bool staticIp)
+        : ssid(ssid), password(password), store(store), staticIp(staticIp) {}
+
+        void begin()
+        {
+            // The SDK would otherwise write the credentials to flash on every begin() and reconnect on its own
+            WiFi.persistent(false);
+            WiFi.setAutoReconnect(false);
+            WiFi.mode(WIFI_STA);
+
+            std::string data;
+            this->cached = this->store.load(data) && this->cache.deserialize(data);
+            this->connect();
+        }
+
+        bool up() const { return this->isUp; }
+
+        void loop()
+        {
+            bool connected = WiFi.status() == WL_CONNECTED;
+            if (this->isUp) {
+                if (!connected) {
+                    LOG_WARN("WiFi lost, reconnecting");
+                    this->isUp = false;
+                    this->reconnects++;
+                    this->connect();
+                }
+                return;
+            }
+
+            if (connected) {
+                this->isUp = true;
+                this->connectMillis = ::millis() - this->attemptAt;
+                LOG_INFO("WiFi connected in %lu ms (%s), IP: %s", (unsigned long)this->connectMillis,
+                         this->usingCache ? "cached" : "scan", WiFi.localIP().toString().c_str());
+                this->remember();
+                return;
+            }
+
+            if (::millis() - this->attemptAt > (this->usingCache ? CachedTimeout : ScanTimeout)) {
+                if (this->usingCache) {
+                    LOG_WARN("Cached access point not joined, scanning");
+                    this->cached = false;
+                }
+                this->connect();
+            }
+        }
+
+    private:
+        void connect()
+        {
+            this->usingCache = this->cached;
+            this->attemptAt = ::millis();
+            if (this->usingCache && this->staticIp && this->cache.hasAddress()) {
+                // Skips DHCP, a failed association goes back to it
+                WiFi.config(IPAddress(this->cache.ip), IPAddress(this->cache.gateway),
+                            IPAddress(this->cache.mask), IPAddress(this->cache.dns));
+            } else {
+                WiFi.config(IPAddress(0u), IPAddress(0u), IPAddress(0u));
+            }
+            if (this->usingCache) {
+                WiFi.begin(this->ssid, this->password, this->cache.channel, this->cache.bssid, true);
+            } else {
+                WiFi.begin(this->ssid, this->password);
+            }
+        }
+
+        // Flash is only written when the access point or the lease changed
+        void remember()
+        {
+            WifiCache current;
+            memcpy(current.bssid, WiFi.BSSID(), sizeof(current.bssid));
+            current.channel = WiFi.channel();
+            current.ip = WiFi.localIP();
+            current.gateway = WiFi.gatewayIP();
+            current.mask = WiFi.subnetMask();
+            current.dns = WiFi.dnsIP(0);
+            if (this->cached && current == this->cache) {
+                return;
+            }
+            this->cache = current;
+            this->cached = true;
+            if (!this->store.save(current.serialize())) {
+                LOG_WARN("Could not save the WiFi cache");
+            }
+        }
+    };
+}
+
+#endif //DOORLOCK_ARDUINO_HPP
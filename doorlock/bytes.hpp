@@ -0,0 +1,41 @@
+// Little endian integers and hashes of the tables kept in flash
+
+#ifndef DOORLOCK_BYTES_HPP
+#define DOORLOCK_BYTES_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+#include "../ptldap/string_view.hpp"
+
+namespace DoorLock
+{
+    inline void appendU32(std::string &data, uint32_t value)
+    {
+        for (int i = 0; i < 4; i++) {
+            data += (char)((value >> (i * 8)) & 0xff);
+        }
+    }
+
+    // The caller checks the 4 bytes are there
+    inline uint32_t readU32(nonstd::string_view data, size_t &offset)
+    {
+        uint32_t value = 0;
+        for (int i = 0; i < 4; i++) {
+            value |= (uint32_t)(uint8_t)data[offset++] << (i * 8);
+        }
+        return value;
+    }
+
+    // FNV-1a, chained by passing the previous hash
+    inline uint32_t fnv1a(nonstd::string_view data, uint32_t hash = 2166136261u)
+    {
+        for (char c : data) {
+            hash = (hash ^ (uint8_t)c) * 16777619u;
+        }
+        return hash;
+    }
+}
+
+#endif //DOORLOCK_BYTES_HPP
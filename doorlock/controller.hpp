@@ -0,0 +1,1435 @@
+// Door controller logic: badge scans, member mirror, LDAP session and feedback.
+// Everything runs as scheduler tasks that never wait. Only talks to the hardware through doorlock/hal.hpp so it also runs on the host.
+
+#ifndef DOORLOCK_CONTROLLER_HPP
+#define DOORLOCK_CONTROLLER_HPP
+
+#include <cstdint>
+#include <string>
+
+#include "../ptldap/ptldap.hpp"
+#include "bytes.hpp"
+#include "feedback.hpp"
+#include "hal.hpp"
+#include "latency.hpp"
+#include "log.hpp"
+#include "member_table.hpp"
+#include "metrics.hpp"
+#include "negative_cache.hpp"
+#include "poll_schedule.hpp"
+#include "rx_buffer.hpp"
+#include "scan_queue.hpp"
+#include "scheduler.hpp"
+
+// Badges rejected by the LDAP are denied locally for a while, this absorbs stray cards and swipe storms
+#ifndef NEGATIVE_CACHE_SIZE
+#define NEGATIVE_CACHE_SIZE 16
+#endif
+
+// Badges keep being read while a lookup is in flight, they wait here and are handled in order
+#ifndef SCAN_QUEUE_SIZE
+#define SCAN_QUEUE_SIZE 4
+#endif
+
+// Readers on the SPI bus, each with its own relay and LED
+#ifndef MAX_DOORS
+#define MAX_DOORS 1
+#endif
+
+// Must hold the largest single LDAPMessage, entries only carry cn or badgenuid
+#ifndef LDAP_RX_BUFFER_SIZE
+#define LDAP_RX_BUFFER_SIZE 1024
+#endif
+
+// Receive buffers decoded per loop pass at most
+#ifndef LDAP_RX_ROUNDS
+#define LDAP_RX_ROUNDS 4
+#endif
+
+// LDAP endpoints, each keeps its own session and receive buffer open. At most 8.
+#ifndef LDAP_MAX_SERVERS
+#define LDAP_MAX_SERVERS 1
+#endif
+
+namespace DoorLock
+{
+    struct Endpoint
+    {
+        const char *host;
+        uint16_t port;
+    };
+
+    struct Config
+    {
+        // In order of preference until their latency is known, beyond LDAP_MAX_SERVERS are ignored
+        Endpoint servers[LDAP_MAX_SERVERS] = {};
+        uint8_t serverCount = 0;
+        const char *login = "";
+        const char *password = "";
+        const char *memberGroup = "";
+        // Only members whose memberOf holds this DN get in, checked by the server in the same search. Empty lets
+        // every member under memberGroup in.
+        const char *activeGroup = "";
+        // RFC 4515 filter of the badge lookup, {0} is the badge NUID. Compiled once, a swipe only fills it in.
+        const char *lookupFilter = "(badgenuid={0})";
+
+        // All durations in milliseconds
+        uint32_t ldapTimeout = 5000;
+        uint32_t ldapRetryMin = 5000;
+        uint32_t ldapRetryMax = 60UL * 1000;
+        // A search unanswered after this, or twice the usual latency of its server if longer,
+        // is also sent to the next fastest server. 0 never hedges.
+        uint32_t ldapHedgeDelay = 200;
+        // A session quiet for this long gets a WhoAmI while the doors are idle. One left unanswered for
+        // ldapTimeout was dropped on the way (NAT, server idle timeout) and is opened again right away.
+        // 0 never probes.
+        uint32_t ldapKeepAlive = 60UL * 1000;
+        // CLDAP lookups, once the controller has a DatagramClient: the search goes out in one UDP datagram
+        // without any session, again to the next server every cldapRetransmit until ldapTimeout.
+        // Nothing is encrypted nor bound, only for trusted networks.
+        uint16_t cldapPort = LDAP::CldapPort;
+        uint32_t cldapRetransmit = 500;
+        uint32_t memberSyncInterval = 15UL * 60 * 1000; // 0 disables the member mirror
+        uint32_t memberSyncTimeout = 10000;
+        // Badges per page of the member sync (RFC 2696 paged results), so servers with a size limit send
+        // them all. 0 asks for every badge in one search.
+        uint32_t memberSyncPageSize = 0;
+        uint32_t negativeCacheTtl = 60UL * 1000;
+        // A mirror not synced for this long may hold revoked badges, it is dropped and every swipe goes online.
+        // The door has no clock, only the time it was on counts. 0 trusts it until the next sync.
+        uint32_t memberMirrorMaxAge = 24UL * 60 * 60 * 1000;
+        // Also deny badges missing from a sync younger than this without asking the LDAP,
+        // 0 keeps asking. New members then have to wait for the next sync once this window is over.
+        uint32_t memberDenyUnknownAge = 0;
+        // Scans older than this are dropped, the person is most likely gone
+        uint32_t scanDeadline = 10000;
+        // A card left on the reader is detected again every other poll
+        uint32_t scanRepeatInterval = 3000;
+        uint32_t unlockDuration = 2000;
+        uint32_t idlePollInterval = 100;
+        uint32_t busyPollInterval = 10;
+        // Polled readers block on the bus for each check: every readerPollFast for readerActiveWindow
+        // after a card, then backing off to readerPollSlow
+        uint32_t readerPollFast = 20;
+        uint32_t readerPollSlow = 100;
+        uint32_t readerActiveWindow = 10000;
+        // Readers with an IRQ line send a card request this often, the answer costs nothing to check
+        uint32_t readerRequestInterval = 20;
+
+        void addServer(const char *host, uint16_t port = 636)
+        {
+            if (this->serverCount < LDAP_MAX_SERVERS) {
+                this->servers[this->serverCount++] = Endpoint{host, port};
+            }
+        }
+    };
+
+    // One reader with the relay and LED of the door it opens
+    struct Door
+    {
+        CardReader &reader;
+        Relay &relay;
+        Led &led;
+    };
+
+    class Controller
+    {
+        struct Session
+        {
+            // Persistent, bound LDAP session to one server, shared by the swipe lookups and the member sync.
+            // It is opened while idle so a swipe only pays for the search round trip.
+            enum class State { Closed, Binding, Ready };
+            State state = State::Closed;
+            NetClient *net = nullptr;
+            Endpoint endpoint = {};
+            uint8_t index = 0;
+            RxBuffer<LDAP_RX_BUFFER_SIZE> buffer;
+            uint8_t bindId = 0;
+            uint32_t connectStartedAt = 0; // us
+            uint32_t bindSentAt = 0;
+            uint32_t retryAt = 0;
+            uint32_t retryDelay = 0;
+            bool bound = false; // Once, opening it again is a reconnect
+            // Moving averages in us, 0 until measured
+            uint32_t connectMicros = 0;
+            uint32_t searchMicros = 0;
+            // Lookup searches sent and not answered yet, also those another server already answered
+            uint8_t unanswered = 0;
+            uint32_t answeredAt = 0; // Or when the first one was sent
+            uint32_t receivedAt = 0;    // Last message of any kind
+            uint8_t keepAliveId = 0;    // WhoAmI in flight, 0 when none
+            uint32_t keepAliveSentAt = 0;
+            // Last searches abandoned, their answers may still cross the AbandonRequest
+            uint8_t abandoned[4] = {};
+            uint8_t abandonedNext = 0;
+        };
+
+        // Online search for the badge being handled, possibly sent to several servers
+        struct Lookup
+        {
+            enum class Phase { Idle, Session, Search, Done };
+            Phase phase = Phase::Idle;
+            Badge badge;
+            uint8_t ids[LDAP_MAX_SERVERS] = {};
+            uint32_t sentAt[LDAP_MAX_SERVERS] = {}; // us
+            uint8_t sent = 0;    // Bit per server asked
+            uint8_t pending = 0; // Bit per server still to answer
+            uint8_t primary = 0;
+            bool found = false;
+            bool failed = false;
+            uint32_t startedAt = 0;
+            // CLDAP request, sent as is until answered by one of the servers it went to
+            std::string datagram;
+            uint8_t datagramId = 0;
+            Peer peers[LDAP_MAX_SERVERS];
+            uint8_t transmissions = 0;
+            uint32_t transmittedAt = 0;
+        };
+
+        // Background refresh of the member mirror
+        struct MemberSync
+        {
+            bool running = false;
+            uint8_t server = 0;
+            uint8_t searchId = 0;
+            std::string cookie; // Of the page being received, empty for the first one
+            MemberTable pending;
+            bool attempted = false;
+            uint32_t lastAttempt = 0;
+            bool succeeded = false;
+            uint32_t lastSuccess = 0;
+            uint32_t lastActivity = 0;
+        };
+
+        // micros() at the end of each phase of the current swipe
+        struct SwipeTimes
+        {
+            uint32_t detect = 0;
+            uint32_t uid = 0;
+            uint32_t session = 0;
+            uint32_t search = 0;
+            uint32_t decision = 0;
+        };
+
+        // Everything a door does on its own, the session, mirror and caches are shared
+        struct DoorState
+        {
+            CardReader *reader = nullptr;
+            PollSchedule poll;
+            uint32_t pollAt = 0;
+            RelayPulse relay;
+            LedEffect led;
+            uint8_t index = 0;
+            ScanQueue<SCAN_QUEUE_SIZE> scans;
+            Badge lastBadge;
+            uint32_t repeatUntil = 0; // The same badge is ignored until then
+            Lookup lookup;
+            SwipeTimes swipeTimes;
+        };
+
+        // Session, member sync and the lookup messages
+        class NetTask : public Task
+        {
+            Controller &controller;
+
+        public:
+            explicit NetTask(Controller &controller) : controller(controller) {}
+            uint32_t run(uint32_t now) override { return this->controller.pumpNetwork(now); }
+        };
+
+        // Card readers and the lookup decisions
+        class DoorTask : public Task
+        {
+            Controller &controller;
+
+        public:
+            explicit DoorTask(Controller &controller) : controller(controller) {}
+            uint32_t run(uint32_t now) override { return this->controller.pumpDoors(now); }
+        };
+
+        Clock &clock;
+        BlobStore &store;
+        Config config;
+
+        DoorState doors[MAX_DOORS];
+        uint8_t doorCount = 0;
+        uint8_t nextDoor = 0; // First door polled on the next pass
+        MemberTable memberTable;
+        NegativeCache<NEGATIVE_CACHE_SIZE> rejectedBadges;
+        Session servers[LDAP_MAX_SERVERS];
+        uint8_t serverCount = 0;
+        DatagramClient *datagrams = nullptr;
+        std::string received; // Last datagram
+        MemberSync memberSync;
+        LDAP::FilterTemplate lookupFilter;
+        bool lookupFilterValid = false; // Every badge is refused otherwise
+        std::string memberFilter; // Of the member sync, empty when the lookup filter has no mirror
+        uint32_t memberTag = 0;   // Of the base and filter of the member sync, a mirror synced otherwise is stale
+        uint32_t mirrorSyncedAt = 0; // Before boot for a mirror loaded from flash
+        uint32_t mirrorSavedAt = 0;
+        Counters counters;
+        NetTask netTask;
+        DoorTask doorTask;
+        Scheduler<2 + 2 * MAX_DOORS> scheduler; // Plus a LED and a relay task per door
+
+    public:
+        // Doors beyond MAX_DOORS are ignored. nets holds one client per server of config.
+        Controller(const Config &config, Clock &clock, const Door *doors, uint8_t count,
+                   NetClient *const *nets, BlobStore &store)
+        : clock(clock), store(store), config(config), rejectedBadges(config.negativeCacheTtl),
+          netTask(*this), doorTask(*this)
+        {
+            this->compileLookupFilter();
+            for (uint8_t i = 0; i < count; i++) {
+                this->addDoor(doors[i]);
+            }
+            for (uint8_t i = 0; nets && i < config.serverCount; i++) {
+                this->addServer(*nets[i]);
+            }
+        }
+
+        // Only the first server of config is used
+        Controller(const Config &config, Clock &clock, const Door *doors, uint8_t count,
+                   NetClient &net, BlobStore &store)
+        : Controller(config, clock, doors, count, nullptr, store)
+        {
+            this->addServer(net);
+        }
+
+        Controller(const Config &config, Clock &clock, CardReader &reader, Relay &relay, Led &led,
+                   NetClient &net, BlobStore &store)
+        : Controller(config, clock, nullptr, 0, net, store)
+        {
+            this->addDoor(Door{reader, relay, led});
+        }
+
+        // Badges are then looked up over CLDAP, sessions are only opened for the member sync. Before begin().
+        void useCldap(DatagramClient &client)
+        {
+            this->datagrams = &client;
+            this->received.resize(LDAP_RX_BUFFER_SIZE);
+        }
+
+        void begin()
+        {
+            if (!this->lookupFilterValid) {
+                LOG_ERROR("Invalid LDAP lookup filter %s, refusing every badge", this->config.lookupFilter);
+            } else if (this->memberFilter.empty()) {
+                LOG_WARN("No member mirror for the LDAP lookup filter %s, every badge goes online", this->config.lookupFilter);
+            }
+            std::string data;
+            if (!this->mirrored()) {
+                // Never synced again, nor synced with the lookup filter when it has no mirror
+            } else if (!this->store.load(data)) {
+                LOG_INFO("No member mirror in flash");
+            } else if (!this->memberTable.deserialize(data)) {
+                LOG_WARN("Member mirror in flash is corrupted, ignoring it");
+            } else if (this->memberTable.tag != this->memberTag) {
+                LOG_WARN("Member mirror in flash was synced with another filter, ignoring it");
+                this->memberTable.clear();
+            } else {
+                LOG_INFO("Loaded member mirror: %u", (unsigned)this->memberTable.size());
+                this->mirrorSyncedAt = this->clock.millis() - this->memberTable.age;
+                this->mirrorSavedAt = this->clock.millis();
+            }
+            for (uint8_t i = 0; i < this->doorCount; i++) {
+                this->doors[i].relay.close();
+                this->showIdle(this->doors[i]);
+            }
+            auto now = this->clock.millis();
+            this->scheduler.schedule(this->netTask, now);
+            this->scheduler.schedule(this->doorTask, now);
+        }
+
+        // Runs the tasks that are due, returns how long to sleep before the next one
+        uint32_t loop()
+        {
+            this->scheduler.run(this->clock.millis());
+            return this->scheduler.idleFor(this->clock.millis(), this->config.idlePollInterval);
+        }
+
+        // Nobody is waiting at any door
+        bool idle() const
+        {
+            for (uint8_t i = 0; i < this->doorCount; i++) {
+                if (!this->doors[i].scans.empty()) {
+                    return false;
+                }
+            }
+            return this->lookupsIdle();
+        }
+        // At least one server is bound
+        bool ldapReady() const
+        {
+            for (uint8_t i = 0; i < this->serverCount; i++) {
+                if (this->servers[i].state == Session::State::Ready) {
+                    return true;
+                }
+            }
+            return false;
+        }
+        const MemberTable &members() const { return this->memberTable; }
+        const Counters &stats()
+        {
+            this->counters.scansDropped = 0;
+            for (uint8_t i = 0; i < this->doorCount; i++) {
+                this->counters.scansDropped += this->doors[i].scans.droppedScans();
+            }
+            return this->counters;
+        }
+
+    private:
+        void addDoor(const Door &hardware)
+        {
+            if (this->doorCount == MAX_DOORS) {
+                return;
+            }
+            auto &door = this->doors[this->doorCount];
+            door.reader = &hardware.reader;
+            door.poll = PollSchedule(this->config.readerPollFast, this->config.readerPollSlow, this->config.readerActiveWindow);
+            door.relay.attach(hardware.relay);
+            door.led.attach(hardware.led);
+            door.index = this->doorCount++;
+        }
+
+        void addServer(NetClient &net)
+        {
+            if (this->serverCount == this->config.serverCount || this->serverCount == LDAP_MAX_SERVERS) {
+                return;
+            }
+            auto &server = this->servers[this->serverCount];
+            server.net = &net;
+            server.endpoint = this->config.servers[this->serverCount];
+            server.retryDelay = this->config.ldapRetryMin;
+            server.index = this->serverCount++;
+        }
+
+        bool linkUp() { return this->serverCount != 0 && this->servers[0].net->linkUp(); }
+
+        // Bound server with the lowest search latency and no bit in skip, nullptr when none
+        Session *fastestServer(uint8_t skip = 0)
+        {
+            Session *best = nullptr;
+            for (uint8_t i = 0; i < this->serverCount; i++) {
+                auto &server = this->servers[i];
+                if (server.state != Session::State::Ready || (skip & (1 << i))) {
+                    continue;
+                }
+                if (!best || server.searchMicros < best->searchMicros) {
+                    best = &server;
+                }
+            }
+            return best;
+        }
+
+        bool serverOpen() const
+        {
+            for (uint8_t i = 0; i < this->serverCount; i++) {
+                if (this->servers[i].state != Session::State::Closed) {
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        // Moving average over about the last four samples
+        static void average(uint32_t &ewma, uint32_t sample)
+        {
+            ewma = ewma == 0 ? sample : ewma - ewma / 4 + sample / 4;
+        }
+
+        // Poll slowly when idle, keep the session responsive while a lookup or a sync is in flight
+        uint32_t pollInterval() const
+        {
+            bool busy = !this->lookupsIdle() || this->memberSync.running;
+            return busy ? this->config.busyPollInterval : this->config.idlePollInterval;
+        }
+
+        uint32_t pumpNetwork(uint32_t now)
+        {
+            if (this->lookupsIdle()) {
+                this->maintainLdap();
+            }
+            for (uint8_t i = 0; i < this->serverCount; i++) {
+                this->pumpLdap(this->servers[i]);
+                this->checkServer(this->servers[i]);
+            }
+            this->pumpDatagrams();
+            this->pumpMemberSync();
+            this->ageMirror();
+
+            // Decide on answered lookups right away rather than on the next reader poll
+            for (uint8_t i = 0; i < this->doorCount; i++) {
+                if (this->doors[i].lookup.phase == Lookup::Phase::Done) {
+                    this->scheduler.schedule(this->doorTask, now);
+                }
+            }
+            return this->pollInterval();
+        }
+
+        uint32_t pumpDoors(uint32_t now)
+        {
+            // Round-robin, so no reader always gets the first look
+            bool handled = false;
+            for (uint8_t n = 0; n < this->doorCount; n++) {
+                auto &door = this->doors[(this->nextDoor + n) % this->doorCount];
+                if (door.lookup.phase == Lookup::Phase::Idle) {
+                    this->showIdle(door);
+                }
+                this->pumpLookup(door);
+                if ((int32_t)(now - door.pollAt) >= 0) {
+                    this->pollReader(door);
+                    door.pollAt = now + this->readerInterval(door, now);
+                }
+
+                Scan scan;
+                if (door.lookup.phase == Lookup::Phase::Idle && door.scans.pop(this->clock.millis(), this->config.scanDeadline, scan)) {
+                    this->handleScan(door, scan);
+                    handled = true;
+                }
+            }
+            this->nextDoor = this->doorCount ? (this->nextDoor + 1) % this->doorCount : 0;
+            if (handled) {
+                return 0;
+            }
+
+            // Lookups in flight are checked for timeouts and hedging, the readers when they are due
+            uint32_t sleep = this->lookupsIdle() ? this->config.idlePollInterval : this->config.busyPollInterval;
+            for (uint8_t i = 0; i < this->doorCount; i++) {
+                int32_t due = (int32_t)(this->doors[i].pollAt - now);
+                due = due > 0 ? due : 0;
+                sleep = (uint32_t)due < sleep ? due : sleep;
+            }
+            return sleep;
+        }
+
+        uint32_t readerInterval(DoorState &door, uint32_t now)
+        {
+            if (door.reader->interruptDriven()) {
+                return this->config.readerRequestInterval;
+            }
+            return door.poll.next(now);
+        }
+
+        // Red, or blinking purple while the network is down. Feedback still playing is left alone.
+        void showIdle(DoorState &door)
+        {
+            bool offline = !this->linkUp();
+            if (door.led.playing() && !door.led.repeating()) {
+                return;
+            }
+            if (offline && !door.led.repeating()) {
+                static const LedStep connecting[] = {{Color::Purple, 500}, {Color::Black, 500}};
+                this->playLed(door, connecting, 2, Color::Red, true);
+            } else if (!offline) {
+                this->showLed(door, Color::Red);
+            }
+        }
+
+        void showLed(DoorState &door, Color color)
+        {
+            this->scheduler.cancel(door.led);
+            door.led.solid(color);
+        }
+
+        void playLed(DoorState &door, const LedStep *steps, uint8_t count, Color after, bool repeat = false)
+        {
+            door.led.play(steps, count, after, repeat);
+            // The first step shows now, not on the next pass
+            door.led.run(this->clock.millis());
+            this->scheduler.schedule(door.led, this->clock.millis(), steps[0].duration);
+        }
+
+        bool lookupsIdle() const
+        {
+            for (uint8_t i = 0; i < this->doorCount; i++) {
+                if (this->doors[i].lookup.phase != Lookup::Phase::Idle) {
+                    return false;
+                }
+            }
+            return true;
+        }
+
+        void stopMemberSync(const char *reason)
+        {
+            if (reason) {
+                LOG_WARN("Member sync failed: %s", reason);
+            }
+            this->memberSync.pending.clear();
+            this->memberSync.cookie.clear();
+            this->memberSync.running = false;
+        }
+
+        void commitMemberSync()
+        {
+            this->memberSync.pending.seal();
+            this->memberTable.swap(this->memberSync.pending);
+            this->mirrorSyncedAt = this->clock.millis();
+            if (!this->saveMirror()) {
+                LOG_ERROR("Could not write the member mirror, keeping it in RAM only");
+            }
+
+            this->memberSync.succeeded = true;
+            this->memberSync.lastSuccess = this->clock.millis();
+            LOG_INFO("Member sync done: %u", (unsigned)this->memberTable.size());
+            this->stopMemberSync(nullptr);
+        }
+
+        bool saveMirror()
+        {
+            this->memberTable.tag = this->memberTag;
+            this->memberTable.age = this->clock.millis() - this->mirrorSyncedAt;
+            this->mirrorSavedAt = this->clock.millis();
+            return this->store.save(this->memberTable.serialize());
+        }
+
+        // Synced with the lookup filter, recently enough
+        bool mirrorTrusted() const
+        {
+            return this->mirrored() && (this->config.memberMirrorMaxAge == 0 ||
+                                        this->clock.millis() - this->mirrorSyncedAt <= this->config.memberMirrorMaxAge);
+        }
+
+        // While the syncs fail the age of the mirror is written back as often as a sync would write it,
+        // so a reboot doesn't make it young again. Once too old it is saved empty.
+        void ageMirror()
+        {
+            if (!this->mirrored() || this->memberTable.empty() || this->config.memberMirrorMaxAge == 0) {
+                return;
+            }
+            if (!this->mirrorTrusted()) {
+                LOG_WARN("Member mirror not synced for too long, dropping it");
+                this->memberTable.clear();
+            } else if (this->clock.millis() - this->mirrorSavedAt < this->config.memberSyncInterval) {
+                return;
+            }
+            if (!this->saveMirror()) {
+                LOG_ERROR("Could not write the member mirror age");
+            }
+        }
+
+        // The server is unhealthy until it binds again, later and later
+        void scheduleLdapRetry(Session &server)
+        {
+            server.retryAt = this->clock.millis() + server.retryDelay;
+            server.retryDelay = server.retryDelay * 2 < this->config.ldapRetryMax ? server.retryDelay * 2 : this->config.ldapRetryMax;
+        }
+
+        void ldapClose(Session &server, const char *reason)
+        {
+            if (server.state == Session::State::Closed) {
+                return;
+            }
+            LOG_WARN("LDAP session to %s closed: %s", server.endpoint.host, reason);
+
+            // Lets the server free the session now rather than when the connection times out
+            if (server.net->connected()) {
+                this->send(server, LDAP::UnbindRequest().str());
+            }
+            server.net->stop();
+            server.buffer.clear();
+            server.state = Session::State::Closed;
+            server.unanswered = 0;
+            server.keepAliveId = 0;
+            this->scheduleLdapRetry(server);
+
+            // Lookups fail once no server is left to answer them
+            uint8_t bit = 1 << server.index;
+            bool open = this->serverOpen();
+            for (uint8_t i = 0; i < this->doorCount; i++) {
+                auto &lookup = this->doors[i].lookup;
+                lookup.pending &= ~bit;
+                if ((lookup.phase == Lookup::Phase::Session && !open) ||
+                    (lookup.phase == Lookup::Phase::Search && lookup.pending == 0)) {
+                    lookup.failed = true;
+                    lookup.phase = Lookup::Phase::Done;
+                }
+            }
+            if (this->memberSync.running && this->memberSync.server == server.index) {
+                this->stopMemberSync(reason);
+            }
+        }
+
+        // A server still sitting on a search the door gave up on, or got from another server, is down
+        void checkServer(Session &server)
+        {
+            if (server.unanswered != 0 && this->clock.millis() - server.answeredAt > this->config.ldapTimeout) {
+                this->counters.timeouts++;
+                this->ldapClose(server, "search timeout");
+            } else if (server.keepAliveId != 0 && this->clock.millis() - server.keepAliveSentAt > this->config.ldapTimeout) {
+                // Nothing wrong with the server itself, no need to wait for the backoff
+                this->counters.timeouts++;
+                this->ldapClose(server, "keepalive timeout");
+                server.retryAt = this->clock.millis();
+            }
+        }
+
+        // A WhoAmI on a quiet session, so a dead one is found before the next swipe needs it
+        void keepAlive(Session &server)
+        {
+            auto now = this->clock.millis();
+            if (this->config.ldapKeepAlive == 0 || server.state != Session::State::Ready || server.keepAliveId != 0 ||
+                now - server.receivedAt < this->config.ldapKeepAlive) {
+                return;
+            }
+            LDAP::WhoAmIRequest req;
+            this->send(server, req.str());
+            server.keepAliveId = (uint8_t)req.messageId();
+            server.keepAliveSentAt = now;
+            this->counters.keepAlives++;
+        }
+
+        void send(Session &server, const std::string &req) { server.net->write((const uint8_t *)req.c_str(), req.length()); }
+
+        // Drops a search whose answer is no longer needed, the server stops working on it and may send nothing more
+        void abandon(Session &server, uint8_t id)
+        {
+            this->send(server, LDAP::AbandonRequest(id).str());
+            this->counters.abandons++;
+            server.abandoned[server.abandonedNext] = id;
+            server.abandonedNext = (server.abandonedNext + 1) % sizeof(server.abandoned);
+        }
+
+        // A root DSE read answered with a bare SearchResultDone, takes the place of an abandoned lookup search
+        // in unanswered so checkServer() still notices a server gone silent
+        void probe(Session &server)
+        {
+            auto req = LDAP::SearchRequest("", new BER::Present("objectClass"), LDAP::NoAttributes,
+                                           LDAP::Protocol::SearchRequest::Scope::BaseObject);
+            this->send(server, req.str());
+        }
+
+        bool wasAbandoned(Session &server, uint8_t id)
+        {
+            for (auto &abandoned : server.abandoned) {
+                if (abandoned == id) {
+                    abandoned = 0;
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        // The TLS handshake blocks, the bind response is handled by pumpLdap()
+        bool ldapOpen(Session &server)
+        {
+            if (server.bound) {
+                this->counters.reconnects++;
+            }
+            LOG_INFO("connecting to %s:%u", server.endpoint.host, (unsigned)server.endpoint.port);
+
+            server.connectStartedAt = this->clock.micros();
+            bool connected = server.net->connect(server.endpoint.host, server.endpoint.port);
+            LATENCY_SINCE(Connect, server.connectStartedAt, this->clock.micros());
+            if (!connected) {
+                LOG_ERROR("connection failed");
+                this->counters.ldapErrors++;
+                server.net->stop();
+                this->scheduleLdapRetry(server);
+                return false;
+            }
+
+            auto req = LDAP::BindRequest(this->config.login, this->config.password);
+            auto req_str = req.str();
+            LOG_DEBUG_HEX("> BindRequest", req_str.c_str(), req_str.length());
+            this->send(server, req_str);
+            server.bindId = req.messageId();
+            server.bindSentAt = this->clock.micros();
+            server.state = Session::State::Binding;
+            return true;
+        }
+
+        // For a swipe: the first server that connects, quickest to connect first. Ignores the backoff.
+        bool ldapOpenAny()
+        {
+            uint8_t tried = 0;
+            for (uint8_t n = 0; n < this->serverCount; n++) {
+                Session *next = nullptr;
+                for (uint8_t i = 0; i < this->serverCount; i++) {
+                    auto &server = this->servers[i];
+                    if (!(tried & (1 << i)) && (!next || server.connectMicros < next->connectMicros)) {
+                        next = &server;
+                    }
+                }
+                tried |= 1 << next->index;
+                if (this->ldapOpen(*next)) {
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        void handleMemberSyncResponse(const LDAP::Response &response)
+        {
+            this->memberSync.lastActivity = this->clock.millis();
+            switch (response.type) {
+                case LDAP::Protocol::Type::SearchResultEntry: {
+                    auto entry = LDAP::SearchResultEntry::parse(response.op);
+                    if (entry.second) {
+                        auto &pending = this->memberSync.pending;
+                        entry.first.values("badgenuid", [&pending](nonstd::string_view value) {
+                            pending.add(Badge(value));
+                        });
+                    }
+                    break;
+                }
+                case LDAP::Protocol::Type::SearchResultDone: {
+                    auto result = LDAP::Result::parse(response.op);
+                    if (!result.second || !result.first.success()) {
+                        this->counters.ldapErrors++;
+                        this->stopMemberSync("search rejected");
+                        return;
+                    }
+                    // A server without paging answers everything at once and no control
+                    auto paged = LDAP::PagedResults::parse(response.controls);
+                    if (this->config.memberSyncPageSize != 0 && paged.second && !paged.first.cookie.empty()) {
+                        this->memberSync.cookie.assign(paged.first.cookie.data(), paged.first.cookie.size());
+                        this->sendMemberSyncPage(this->servers[this->memberSync.server]);
+                        return;
+                    }
+                    this->commitMemberSync();
+                    break;
+                }
+                default:
+                    break;
+            }
+        }
+
+        void handleLdapResponse(Session &server, const LDAP::Response &response)
+        {
+            server.receivedAt = this->clock.millis();
+            if (server.state == Session::State::Binding && response.id == server.bindId) {
+                auto result = LDAP::Result::parse(response.op);
+                if (response.type != LDAP::Protocol::Type::BindResponse || !result.second || !result.first.success()) {
+                    this->counters.ldapErrors++;
+                    this->ldapClose(server, "bind rejected");
+                    return;
+                }
+                LOG_INFO("< BindResponse from %s", server.endpoint.host);
+                LATENCY_SINCE(Bind, server.bindSentAt, this->clock.micros());
+                average(server.connectMicros, this->clock.micros() - server.connectStartedAt);
+                server.state = Session::State::Ready;
+                server.bound = true;
+                server.retryDelay = this->config.ldapRetryMin;
+            } else if (this->memberSync.running && server.index == this->memberSync.server && response.id == this->memberSync.searchId) {
+                this->handleMemberSyncResponse(response);
+            } else if (server.keepAliveId != 0 && response.id == server.keepAliveId) {
+                // Even an error says the session is alive
+                server.keepAliveId = 0;
+            } else {
+                uint8_t bit = 1 << server.index;
+                for (uint8_t i = 0; i < this->doorCount; i++) {
+                    auto &lookup = this->doors[i].lookup;
+                    if ((lookup.pending & bit) && response.id == lookup.ids[server.index]) {
+                        this->handleLookupResponse(server, lookup, response);
+                        return;
+                    }
+                }
+                // Late answer to a lookup that moved on, the server is alive all the same.
+                // An abandoned search is counted by the probe sent in its place.
+                if (response.type == LDAP::Protocol::Type::SearchResultDone && !this->wasAbandoned(server, (uint8_t)response.id) &&
+                    server.unanswered != 0) {
+                    server.unanswered--;
+                    server.answeredAt = this->clock.millis();
+                }
+            }
+        }
+
+        void handleLookupResponse(Session &server, Lookup &lookup, const LDAP::Response &response)
+        {
+            uint8_t bit = 1 << server.index;
+            if (!(lookup.pending & bit)) {
+                return;
+            }
+            if (response.type == LDAP::Protocol::Type::SearchResultEntry) {
+                if (lookup.phase == Lookup::Phase::Search) {
+                    lookup.found = true;
+                }
+            } else if (response.type == LDAP::Protocol::Type::SearchResultDone) {
+                lookup.pending &= ~bit;
+                server.unanswered--;
+                server.answeredAt = this->clock.millis();
+                uint32_t now = this->clock.micros();
+                average(server.searchMicros, now - lookup.sentAt[server.index]);
+                if (lookup.phase != Lookup::Phase::Search) {
+                    return;
+                }
+                // A refused search says nothing about the badge, wait for the other servers or don't deny and cache it.
+                // Hitting the size limit of 1 still means an entry came back.
+                auto result = LDAP::Result::parse(response.op);
+                bool truncated = result.second && result.first.code == LDAP::Protocol::ResultCode::SizeLimitExceeded && lookup.found;
+                if (!truncated && (!result.second || !result.first.success())) {
+                    LOG_WARN("Search refused by %s: %d", server.endpoint.host, result.second ? (int)result.first.code : -1);
+                    this->counters.ldapErrors++;
+                    if (lookup.pending == 0) {
+                        lookup.failed = true;
+                        lookup.phase = Lookup::Phase::Done;
+                    }
+                    return;
+                }
+                // The servers still working on it are at least this slow, and can stop
+                for (uint8_t i = 0; i < this->serverCount; i++) {
+                    if (lookup.pending & (1 << i)) {
+                        auto &loser = this->servers[i];
+                        average(loser.searchMicros, now - lookup.sentAt[i]);
+                        this->abandon(loser, lookup.ids[i]);
+                        this->probe(loser);
+                    }
+                }
+                lookup.pending = 0;
+                lookup.phase = Lookup::Phase::Done;
+            }
+        }
+
+        // Dispatch whatever the server sent so far, never waits
+        void pumpLdap(Session &server)
+        {
+            if (server.state == Session::State::Closed) {
+                return;
+            }
+
+            auto &net = *server.net;
+            int available = net.available();
+            if (available <= 0) {
+                if (!net.connected()) {
+                    this->ldapClose(server, "connection lost");
+                }
+                return;
+            }
+
+            // Read straight into the receive buffer and decode the messages in place, a few buffers
+            // per call so a member sync keeps up without starving the reader
+            auto &buffer = server.buffer;
+            for (uint8_t round = 0; round < LDAP_RX_ROUNDS && available > 0; round++) {
+                while (available > 0 && !buffer.full()) {
+                    size_t want = (size_t)available < buffer.space() ? (size_t)available : buffer.space();
+                    int len = net.read(buffer.tail(), want);
+                    if (len <= 0) {
+                        break;
+                    }
+                    buffer.commit(len);
+                    available = net.available();
+                }
+
+                LATENCY_START(decodeStart, this->clock.micros());
+                size_t offset = 0;
+                while (server.state != Session::State::Closed) {
+                    auto response = LDAP::Response::parse(buffer.view().substr(offset));
+                    if (!response.valid()) {
+                        break;
+                    }
+                    offset += response.size;
+                    this->handleLdapResponse(server, response);
+                }
+                LATENCY_SINCE(Decode, decodeStart, this->clock.micros());
+                if (server.state == Session::State::Closed) {
+                    return;
+                }
+                if (offset == 0 && buffer.full()) {
+                    this->counters.ldapErrors++;
+                    this->ldapClose(server, "response too large");
+                    return;
+                }
+                buffer.consume(offset);
+                available = net.available();
+            }
+        }
+
+        // Reopen dropped sessions while nobody is waiting at a door, each after its backoff, and probe quiet ones.
+        // CLDAP lookups need none, only the member sync does.
+        void maintainLdap()
+        {
+            if (!this->linkUp() || (this->datagrams && !this->mirrored())) {
+                return;
+            }
+            for (uint8_t i = 0; i < this->serverCount; i++) {
+                auto &server = this->servers[i];
+                if (server.state == Session::State::Closed && (int32_t)(this->clock.millis() - server.retryAt) >= 0) {
+                    this->ldapOpen(server);
+                } else {
+                    this->keepAlive(server);
+                }
+            }
+        }
+
+        void pumpMemberSync()
+        {
+            auto now = this->clock.millis();
+            if (this->memberSync.running) {
+                if (now - this->memberSync.lastActivity > this->config.memberSyncTimeout) {
+                    this->counters.timeouts++;
+                    auto &server = this->servers[this->memberSync.server];
+                    if (server.state == Session::State::Ready) {
+                        this->abandon(server, this->memberSync.searchId);
+                    }
+                    this->stopMemberSync("timeout");
+                }
+                return;
+            }
+            auto server = this->fastestServer();
+            if (!server || !this->mirrored()) {
+                return;
+            }
+            if (this->memberSync.attempted && now - this->memberSync.lastAttempt < this->config.memberSyncInterval) {
+                return;
+            }
+            this->memberSync.attempted = true;
+            this->memberSync.lastAttempt = now;
+            this->memberSync.lastActivity = now;
+
+            LOG_INFO("Starting member sync from %s", server->endpoint.host);
+            this->memberSync.server = server->index;
+            this->memberSync.cookie.clear();
+            this->memberSync.running = true;
+            this->sendMemberSyncPage(*server);
+        }
+
+        void sendMemberSyncPage(Session &server)
+        {
+            auto req = LDAP::SearchRequest(this->config.memberGroup, new BER::Raw(this->memberFilter), "badgenuid");
+            if (this->config.memberSyncPageSize != 0) {
+                req.addControl(LDAP::PagedResults::encode(this->config.memberSyncPageSize, this->memberSync.cookie));
+            }
+            this->send(server, req.str());
+            this->memberSync.searchId = req.messageId();
+        }
+
+        void recordSwipeTimes(DoorState &door)
+        {
+            auto &times = door.swipeTimes;
+            LATENCY_RECORD(Swipe, times.decision - times.detect);
+            if (times.search != 0 && times.session != 0) {
+                LATENCY_RECORD(Search, times.search - times.session);
+            }
+            LOG_INFO("Door %u swipe timings (us): uid %lu, session %lu, search %lu, total %lu",
+                     (unsigned)door.index,
+                     (unsigned long)(times.uid - times.detect),
+                     (unsigned long)(times.session ? times.session - times.uid : 0),
+                     (unsigned long)(times.search ? times.search - times.session : 0),
+                     (unsigned long)(times.decision - times.detect));
+        }
+
+        // The repeat window starts once the feedback is over
+        void holdRepeat(DoorState &door)
+        {
+            door.repeatUntil = this->clock.millis() + door.led.duration() + this->config.scanRepeatInterval;
+        }
+
+        // The relay and LED go on by themselves, the door can take the next badge meanwhile
+        void unlock(DoorState &door)
+        {
+            this->counters.grants++;
+            LOG_INFO("Unlocking door %u", (unsigned)door.index);
+            door.relay.open();
+            LATENCY_RECORD(Relay, this->clock.micros() - door.swipeTimes.decision);
+            this->scheduler.schedule(door.relay, this->clock.millis(), this->config.unlockDuration);
+            const LedStep granted[] = {{Color::Green, this->config.unlockDuration}};
+            this->playLed(door, granted, 1, Color::Red);
+            this->holdRepeat(door);
+        }
+
+        void deny(DoorState &door)
+        {
+            this->counters.denies++;
+            static const LedStep denied[] = {
+                {Color::Red, 200}, {Color::Black, 200}, {Color::Red, 200}, {Color::Black, 200},
+                {Color::Red, 200}, {Color::Black, 200}, {Color::Red, 200}, {Color::Black, 200},
+                {Color::Red, 200}, {Color::Black, 200},
+            };
+            this->playLed(door, denied, sizeof(denied) / sizeof(denied[0]), Color::Red);
+            this->holdRepeat(door);
+        }
+
+        void startLookup(DoorState &door, const Badge &badge)
+        {
+            door.lookup = Lookup();
+            door.lookup.badge = badge;
+            door.lookup.startedAt = this->clock.millis();
+            if (this->datagrams) {
+                this->startDatagramLookup(door);
+                return;
+            }
+            door.lookup.phase = Lookup::Phase::Session;
+            if (!this->serverOpen() && !this->ldapOpenAny()) {
+                door.lookup.failed = true;
+                door.lookup.phase = Lookup::Phase::Done;
+                return;
+            }
+            // The session may be on the idle schedule, the answer is wanted sooner
+            this->scheduler.schedule(this->netTask, this->clock.millis(), this->config.busyPollInterval);
+        }
+
+        bool mirrored() const { return this->config.memberSyncInterval != 0 && !this->memberFilter.empty(); }
+
+        // With an active group (&(lookupFilter)(memberOf={1})), the group is a parameter so its DN needs no escaping.
+        // The member sync searches the same filter for every badge.
+        void compileLookupFilter()
+        {
+            auto active = [this](const std::string &filter) {
+                return *this->config.activeGroup ? "(&" + filter + "(memberOf={1}))" : filter;
+            };
+            auto compiled = LDAP::FilterTemplate::parse(active(this->config.lookupFilter));
+            this->lookupFilter = std::move(compiled.first);
+            this->lookupFilterValid = compiled.second;
+            auto every = everyBadge(this->config.lookupFilter);
+            if (this->lookupFilterValid && !every.empty()) {
+                this->memberFilter = LDAP::FilterTemplate::parse(active(every)).first.render({"", this->config.activeGroup});
+                auto base = fnv1a(nonstd::string_view("", 1), fnv1a(this->config.memberGroup));
+                this->memberTag = fnv1a(this->memberFilter, base);
+            }
+        }
+
+        // The filter with each (badgenuid={0}) made (badgenuid=*), empty when {0} stands anywhere else or the
+        // filter has an Or or a Not, a list of badges can't hold what those match. Parentheses in values are
+        // escaped so the text is enough.
+        static std::string everyBadge(std::string filter)
+        {
+            const std::string item = "(badgenuid={0})";
+            if (filter.find("(|") != std::string::npos || filter.find("(!") != std::string::npos) {
+                return "";
+            }
+            for (size_t at = filter.find(item); at != std::string::npos; at = filter.find(item, at)) {
+                filter.replace(at + item.size() - 4, 3, "*");
+            }
+            return filter.find("{0}") == std::string::npos ? filter : "";
+        }
+
+        // Search for an active LDAP user with the scanned badge NUID, only whether one exists matters
+        std::string lookupRequest(DoorState &door, uint8_t &id)
+        {
+            auto filter = this->lookupFilter.render({door.lookup.badge.view(), this->config.activeGroup});
+            auto req = LDAP::SearchRequest(this->config.memberGroup, new BER::Raw(std::move(filter)), LDAP::NoAttributes);
+            req.limit(1, (this->config.ldapTimeout + 999) / 1000);
+            id = req.messageId();
+            auto req_str = req.str();
+            LOG_DEBUG_HEX(">SearchRequest", req_str.c_str(), req_str.length());
+            return req_str;
+        }
+
+        void sendLookupSearch(DoorState &door, Session &server)
+        {
+            auto &lookup = door.lookup;
+            this->send(server, this->lookupRequest(door, lookup.ids[server.index]));
+            lookup.sentAt[server.index] = this->clock.micros();
+            lookup.sent |= 1 << server.index;
+            lookup.pending |= 1 << server.index;
+            if (server.unanswered++ == 0) {
+                server.answeredAt = this->clock.millis();
+            }
+        }
+
+        void startLookupSearch(DoorState &door, Session &server)
+        {
+            door.swipeTimes.session = this->clock.micros();
+            this->sendLookupSearch(door, server);
+            door.lookup.primary = server.index;
+            door.lookup.startedAt = this->clock.millis();
+            door.lookup.phase = Lookup::Phase::Search;
+        }
+
+        // First to the server with the lowest search latency, session or not
+        void startDatagramLookup(DoorState &door)
+        {
+            auto &lookup = door.lookup;
+            if (this->serverCount == 0) {
+                lookup.failed = true;
+                lookup.phase = Lookup::Phase::Done;
+                return;
+            }
+            for (uint8_t i = 1; i < this->serverCount; i++) {
+                if (this->servers[i].searchMicros < this->servers[lookup.primary].searchMicros) {
+                    lookup.primary = i;
+                }
+            }
+            door.swipeTimes.session = this->clock.micros();
+            lookup.datagram = this->lookupRequest(door, lookup.datagramId);
+            lookup.sentAt[lookup.primary] = this->clock.micros();
+            lookup.phase = Lookup::Phase::Search;
+            this->transmitLookup(door);
+            this->scheduler.schedule(this->netTask, this->clock.millis(), this->config.busyPollInterval);
+        }
+
+        // The same request each time, to the next server
+        void transmitLookup(DoorState &door)
+        {
+            auto &lookup = door.lookup;
+            auto &server = this->servers[(lookup.primary + lookup.transmissions) % this->serverCount];
+            Peer to;
+            if (this->datagrams->send(server.endpoint.host, this->config.cldapPort, (const uint8_t *)lookup.datagram.data(),
+                                      lookup.datagram.size(), to)) {
+                lookup.peers[server.index] = to;
+                lookup.sent |= 1 << server.index;
+            }
+            lookup.transmissions++;
+            lookup.transmittedAt = this->clock.millis();
+        }
+
+        void pumpDatagramLookup(DoorState &door)
+        {
+            auto &lookup = door.lookup;
+            auto now = this->clock.millis();
+            if (now - lookup.startedAt > this->config.ldapTimeout) {
+                LOG_ERROR(">>> Client Timeout !");
+                this->counters.timeouts++;
+                lookup.failed = true;
+                lookup.phase = Lookup::Phase::Done;
+            } else if (now - lookup.transmittedAt >= this->config.cldapRetransmit) {
+                this->counters.retransmits++;
+                this->transmitLookup(door);
+            }
+        }
+
+        // Answers to the CLDAP lookups, each whole in one datagram. Only taken from a server the lookup went to,
+        // anyone on the network can send a datagram with the right message ID.
+        void pumpDatagrams()
+        {
+            if (!this->datagrams) {
+                return;
+            }
+            int len;
+            Peer from;
+            while ((len = this->datagrams->receive((uint8_t *)&this->received[0], this->received.size(), from)) > 0) {
+                nonstd::string_view datagram(this->received.data(), len);
+                auto first = LDAP::Response::parse(datagram);
+                for (uint8_t i = 0; first.valid() && i < this->doorCount; i++) {
+                    auto &lookup = this->doors[i].lookup;
+                    if (lookup.phase == Lookup::Phase::Search && !lookup.datagram.empty() && first.id == lookup.datagramId &&
+                        this->sentTo(lookup, from)) {
+                        this->handleDatagram(lookup, datagram);
+                    }
+                }
+            }
+        }
+
+        bool sentTo(const Lookup &lookup, const Peer &from) const
+        {
+            for (uint8_t i = 0; i < this->serverCount; i++) {
+                if ((lookup.sent & (1 << i)) && lookup.peers[i] == from) {
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        // Entries only count with the SearchResultDone of the same datagram
+        void handleDatagram(Lookup &lookup, nonstd::string_view datagram)
+        {
+            lookup.found = false;
+            for (size_t offset = 0; offset < datagram.size() && lookup.phase == Lookup::Phase::Search;) {
+                auto response = LDAP::Response::parse(datagram.substr(offset));
+                if (!response.valid() || response.id != lookup.datagramId) {
+                    break;
+                }
+                offset += response.size;
+                this->handleDatagramResponse(lookup, response);
+            }
+        }
+
+        void handleDatagramResponse(Lookup &lookup, const LDAP::Response &response)
+        {
+            if (response.type == LDAP::Protocol::Type::SearchResultEntry) {
+                lookup.found = true;
+                return;
+            }
+            if (response.type != LDAP::Protocol::Type::SearchResultDone) {
+                return;
+            }
+            auto result = LDAP::Result::parse(response.op);
+            bool truncated = result.second && result.first.code == LDAP::Protocol::ResultCode::SizeLimitExceeded && lookup.found;
+            if (!truncated && (!result.second || !result.first.success())) {
+                LOG_WARN("CLDAP search refused: %d", result.second ? (int)result.first.code : -1);
+                this->counters.ldapErrors++;
+                lookup.failed = true;
+            } else if (lookup.transmissions == 1) {
+                // Only then is it known which server answered
+                average(this->servers[lookup.primary].searchMicros, this->clock.micros() - lookup.sentAt[lookup.primary]);
+            }
+            lookup.phase = Lookup::Phase::Done;
+        }
+
+        // Asks the next fastest server too when the first one is slower than usual
+        void hedgeLookup(DoorState &door)
+        {
+            auto &lookup = door.lookup;
+            if (this->config.ldapHedgeDelay == 0 || lookup.sent != (1 << lookup.primary)) {
+                return;
+            }
+            uint32_t usual = 2 * this->servers[lookup.primary].searchMicros / 1000;
+            uint32_t delay = usual > this->config.ldapHedgeDelay ? usual : this->config.ldapHedgeDelay;
+            if (this->clock.millis() - lookup.startedAt < delay) {
+                return;
+            }
+            auto backup = this->fastestServer(lookup.sent);
+            if (!backup) {
+                return;
+            }
+            LOG_INFO("Search slow on %s, also asking %s", this->servers[lookup.primary].endpoint.host, backup->endpoint.host);
+            this->counters.hedges++;
+            this->sendLookupSearch(door, *backup);
+        }
+
+        void finishLookup(DoorState &door)
+        {
+            door.swipeTimes.search = this->clock.micros();
+            door.swipeTimes.decision = door.swipeTimes.search;
+            this->recordSwipeTimes(door);
+            door.lookup.phase = Lookup::Phase::Idle;
+            if (door.lookup.failed) {
+                return;
+            }
+
+            if (door.lookup.found) {
+                this->rejectedBadges.remove(door.lookup.badge);
+                this->unlock(door);
+            } else {
+                this->rejectedBadges.insert(door.lookup.badge, this->clock.millis());
+                this->deny(door);
+            }
+        }
+
+        // Moves the lookup forward with whatever pumpLdap() received, never waits
+        void pumpLookup(DoorState &door)
+        {
+            switch (door.lookup.phase) {
+                case Lookup::Phase::Idle:
+                    return;
+                case Lookup::Phase::Session:
+                    if (auto server = this->fastestServer()) {
+                        this->startLookupSearch(door, *server);
+                    } else if (this->clock.millis() - door.lookup.startedAt > this->config.ldapTimeout) {
+                        this->counters.timeouts++;
+                        for (uint8_t i = 0; i < this->serverCount; i++) {
+                            if (this->servers[i].state == Session::State::Binding) {
+                                this->ldapClose(this->servers[i], "bind timeout");
+                            }
+                        }
+                    }
+                    return;
+                case Lookup::Phase::Search:
+                    if (!door.lookup.datagram.empty()) {
+                        this->pumpDatagramLookup(door);
+                        return;
+                    }
+                    if (this->clock.millis() - door.lookup.startedAt > this->config.ldapTimeout) {
+                        LOG_ERROR(">>> Client Timeout !");
+                        this->counters.timeouts++;
+                        // Every server still silent is marked down, which fails the lookup
+                        for (uint8_t i = 0; i < this->serverCount; i++) {
+                            if (door.lookup.pending & (1 << i)) {
+                                this->ldapClose(this->servers[i], "search timeout");
+                            }
+                        }
+                        return;
+                    }
+                    this->hedgeLookup(door);
+                    return;
+                case Lookup::Phase::Done:
+                    this->finishLookup(door);
+                    return;
+            }
+        }
+
+        // Reads a presented card into the scan queue
+        void pollReader(DoorState &door)
+        {
+            LATENCY_START(detectStart, this->clock.micros());
+            if (!door.reader->cardPresent()) {
+                // The answer, if a card is there, is picked up by the next poll
+                if (door.reader->interruptDriven()) {
+                    door.reader->requestCard();
+                }
+                return;
+            }
+            Scan scan;
+            scan.detectedAt = this->clock.micros();
+            LATENCY_SINCE(Detect, detectStart, scan.detectedAt);
+
+            // Notice a session dropped while idle before reading the UID. Without a mirror every swipe
+            // goes online, so reconnect right away instead of after the UID is read.
+            if (this->lookupsIdle()) {
+                for (uint8_t i = 0; i < this->serverCount; i++) {
+                    this->pumpLdap(this->servers[i]);
+                }
+                if (this->memberTable.empty()) {
+                    this->maintainLdap();
+                }
+            }
+
+            if (!door.reader->readCard(scan.badge)) {
+                return;
+            }
+            scan.readAt = this->clock.micros();
+            LATENCY_RECORD(UidRead, scan.readAt - scan.detectedAt);
+            scan.arrivedAt = this->clock.millis();
+            door.poll.activity(scan.arrivedAt);
+
+            if (scan.badge == door.lastBadge && (int32_t)(scan.arrivedAt - door.repeatUntil) < 0) {
+                return;
+            }
+            door.lastBadge = scan.badge;
+            door.repeatUntil = scan.arrivedAt + this->config.scanRepeatInterval;
+
+            LOG_INFO_HEX("Badge NUID:", scan.badge.bytes, scan.badge.size);
+
+            if (!door.scans.push(scan)) {
+                LOG_WARN("Badge already waiting or scan queue full");
+            }
+        }
+
+        // Decides locally when possible, otherwise starts the online lookup
+        void handleScan(DoorState &door, const Scan &scan)
+        {
+            door.swipeTimes = SwipeTimes();
+            door.swipeTimes.detect = scan.detectedAt;
+            door.swipeTimes.uid = scan.readAt;
+
+            this->counters.swipes++;
+            this->showLed(door, Color::Blue);
+
+            // Falling back to a looser filter would let in badges the admin meant to keep out
+            if (!this->lookupFilterValid) {
+                door.swipeTimes.decision = this->clock.micros();
+                this->recordSwipeTimes(door);
+                this->deny(door);
+                return;
+            }
+
+            // Members known from the last sync are let in without touching the network,
+            // unknown badges still ask the LDAP so new members don't have to wait for the next sync
+            if (this->mirrorTrusted() && this->memberTable.contains(scan.badge)) {
+                LOG_INFO("Badge found in the member mirror");
+                this->counters.mirrorHits++;
+                door.swipeTimes.decision = this->clock.micros();
+                this->recordSwipeTimes(door);
+                this->unlock(door);
+                return;
+            }
+
+            auto now = this->clock.millis();
+            if (this->rejectedBadges.contains(scan.badge, now)) {
+                LOG_INFO("Badge was rejected recently");
+                this->counters.negativeHits++;
+                door.swipeTimes.decision = this->clock.micros();
+                this->recordSwipeTimes(door);
+                this->deny(door);
+                return;
+            }
+
+            if (this->config.memberDenyUnknownAge != 0 && this->memberSync.succeeded &&
+                now - this->memberSync.lastSuccess < this->config.memberDenyUnknownAge) {
+                LOG_INFO("Badge not found in a recent member sync");
+                this->counters.mirrorHits++;
+                door.swipeTimes.decision = this->clock.micros();
+                this->recordSwipeTimes(door);
+                this->rejectedBadges.insert(scan.badge, now);
+                this->deny(door);
+                return;
+            }
+
+            this->counters.cacheMisses++;
+            this->startLookup(door, scan.badge);
+        }
+    };
+}
+
+#endif //DOORLOCK_CONTROLLER_HPP
@@ -0,0 +1,132 @@
+// Door feedback run as scheduler tasks: LED patterns and relay pulses
+
+#ifndef DOORLOCK_FEEDBACK_HPP
+#define DOORLOCK_FEEDBACK_HPP
+
+#include <cstdint>
+
+#include "hal.hpp"
+#include "scheduler.hpp"
+
+// Longest LED pattern, in steps
+#ifndef LED_PATTERN_STEPS
+#define LED_PATTERN_STEPS 10
+#endif
+
+namespace DoorLock
+{
+    struct LedStep
+    {
+        Color color;
+        uint32_t duration; // ms
+    };
+
+    // Plays a sequence of colours, the LED is only written when its colour changes
+    class LedEffect : public Task
+    {
+        Led *led = nullptr;
+        Color shown = Color::Black;
+        bool written = false;
+        LedStep steps[LED_PATTERN_STEPS];
+        uint8_t count = 0;
+        uint8_t step = 0;
+        bool repeat = false;
+        Color after = Color::Black;
+
+    public:
+        void attach(Led &led) { this->led = &led; }
+
+        // Shows color until told otherwise, the caller cancels the task
+        void solid(Color color)
+        {
+            this->count = 0;
+            this->show(color);
+        }
+
+        // Loads a pattern, ending on after unless it repeats. The caller schedules the task.
+        void play(const LedStep *steps, uint8_t count, Color after, bool repeat = false)
+        {
+            this->count = count < LED_PATTERN_STEPS ? count : LED_PATTERN_STEPS;
+            for (uint8_t i = 0; i < this->count; i++) {
+                this->steps[i] = steps[i];
+            }
+            this->step = 0;
+            this->after = after;
+            this->repeat = repeat;
+        }
+
+        bool playing() const { return this->count != 0; }
+        bool repeating() const { return this->playing() && this->repeat; }
+
+        // Length of one round of the pattern
+        uint32_t duration() const
+        {
+            uint32_t total = 0;
+            for (uint8_t i = 0; i < this->count; i++) {
+                total += this->steps[i].duration;
+            }
+            return total;
+        }
+
+        uint32_t run(uint32_t) override
+        {
+            if (this->step == this->count && this->repeat) {
+                this->step = 0;
+            }
+            if (this->step == this->count) {
+                this->count = 0;
+                this->show(this->after);
+                return Task::Done;
+            }
+            auto &step = this->steps[this->step++];
+            this->show(step.color);
+            return step.duration;
+        }
+
+    private:
+        void show(Color color)
+        {
+            if (this->written && color == this->shown) {
+                return;
+            }
+            this->led->set(color);
+            this->shown = color;
+            this->written = true;
+        }
+    };
+
+    // Holds the relay open, then closes it. Pulsing again while open extends the pulse.
+    class RelayPulse : public Task
+    {
+        Relay *relay = nullptr;
+        bool isOpen = false;
+
+    public:
+        void attach(Relay &relay) { this->relay = &relay; }
+
+        // Opens the relay, the caller runs the task once the pulse is over
+        void open()
+        {
+            if (!this->isOpen) {
+                this->relay->set(true);
+                this->isOpen = true;
+            }
+        }
+
+        void close()
+        {
+            this->relay->set(false);
+            this->isOpen = false;
+        }
+
+        bool opened() const { return this->isOpen; }
+
+        uint32_t run(uint32_t) override
+        {
+            this->close();
+            return Task::Done;
+        }
+    };
+}
+
+#endif //DOORLOCK_FEEDBACK_HPP
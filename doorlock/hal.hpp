@@ -0,0 +1,109 @@
+// Devices the controller is driven through, implemented by doorlock/arduino.hpp on the
+// board and by doorlock/tests/fakes.hpp on the host
+
+#ifndef DOORLOCK_HAL_HPP
+#define DOORLOCK_HAL_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+#include "../ptldap/string_view.hpp"
+#include "member_table.hpp"
+
+namespace DoorLock
+{
+    enum class Color : uint32_t
+    {
+        Black = 0x000000,
+        Red = 0xFF0000,
+        Green = 0x008000,
+        Blue = 0x0000FF,
+        Purple = 0x800080,
+    };
+
+    class Clock
+    {
+    public:
+        virtual ~Clock() = default;
+        virtual uint32_t millis() = 0;
+        virtual uint32_t micros() = 0;
+        virtual void delay(uint32_t ms) = 0;
+    };
+
+    class CardReader
+    {
+    public:
+        virtual ~CardReader() = default;
+        // Presence check, only true once per newly presented card
+        virtual bool cardPresent() = 0;
+        virtual bool readCard(Badge &badge) = 0;
+
+        // Readers wired to an IRQ line answer requestCard() through the interrupt, cardPresent()
+        // then only looks at what the interrupt left and costs no bus traffic
+        virtual bool interruptDriven() const { return false; }
+        virtual void requestCard() {}
+    };
+
+    class Relay
+    {
+    public:
+        virtual ~Relay() = default;
+        virtual void set(bool open) = 0;
+    };
+
+    class Led
+    {
+    public:
+        virtual ~Led() = default;
+        virtual void set(Color color) = 0;
+    };
+
+    // Stream to the LDAP server, modelled after the Arduino Client
+    class NetClient
+    {
+    public:
+        virtual ~NetClient() = default;
+        // Whether the link below (WiFi) is up at all, nothing is attempted otherwise
+        virtual bool linkUp() { return true; }
+        virtual bool connect(const char *host, uint16_t port) = 0;
+        virtual bool connected() = 0;
+        virtual int available() = 0;
+        virtual int read(uint8_t *buf, size_t size) = 0;
+        virtual size_t write(const uint8_t *buf, size_t size) = 0;
+        virtual void stop() = 0;
+    };
+
+    // IPv4 address, as lwIP stores it, and port at the other end of a datagram
+    struct Peer
+    {
+        uint32_t address = 0;
+        uint16_t port = 0;
+
+        bool operator==(const Peer &other) const { return this->address == other.address && this->port == other.port; }
+        bool operator!=(const Peer &other) const { return !(*this == other); }
+    };
+
+    // Datagrams to the LDAP servers for CLDAP lookups, modelled after the Arduino UDP
+    class DatagramClient
+    {
+    public:
+        virtual ~DatagramClient() = default;
+        // Fills in to with the address host resolved to
+        virtual bool send(const char *host, uint16_t port, const uint8_t *buf, size_t size, Peer &to) = 0;
+        // Copies the next datagram received into buf, 0 when there is none. The rest of a longer one is lost.
+        virtual int receive(uint8_t *buf, size_t size, Peer &from) = 0;
+    };
+
+    // One blob kept across reboots: the member mirror, the WiFi cache
+    class BlobStore
+    {
+    public:
+        virtual ~BlobStore() = default;
+        virtual bool load(std::string &data) = 0;
+        // Must never leave a partially written blob behind
+        virtual bool save(nonstd::string_view data) = 0;
+    };
+}
+
+#endif //DOORLOCK_HAL_HPP
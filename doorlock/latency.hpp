@@ -0,0 +1,144 @@
+// Per-phase swipe latency, kept in fixed log-scale histograms.
+//
+// Only compiled in when LATENCY_HISTOGRAMS is defined, otherwise the macros below
+// expand to nothing and no histogram is allocated.
+
+#ifndef DOORLOCK_LATENCY_HPP
+#define DOORLOCK_LATENCY_HPP
+
+#include <cstddef>
+#include <cstdint>
+
+namespace DoorLock
+{
+    namespace Latency
+    {
+        enum class Phase : uint8_t
+        {
+            Detect,  // PICC_IsNewCardPresent() that saw the card
+            UidRead, // PICC_ReadCardSerial()
+            Connect, // DNS, TCP and TLS handshake, BearSSL does them in one call
+            Bind,    // BindRequest sent to BindResponse decoded
+            Search,  // SearchRequest sent to SearchResultDone decoded
+            Decode,  // Decoding and dispatching received messages
+            Relay,   // Decision to relay actuation
+            Swipe,   // Card detected to decision
+            Count
+        };
+
+        inline const char *name(Phase phase)
+        {
+            static const char *names[] = {"detect", "uid_read", "connect", "bind", "search", "decode", "relay", "swipe"};
+            return names[static_cast<uint8_t>(phase)];
+        }
+    }
+
+    // Two buckets per power of two, from 1 us to about 33 s, anything above lands in the last one
+    class LatencyHistogram
+    {
+    public:
+        static const uint8_t Buckets = 50;
+
+    private:
+        uint32_t counts[Buckets] = {};
+        uint32_t total = 0;
+        uint32_t maximum = 0;
+        uint64_t sum = 0;
+
+    public:
+        static uint8_t bucket(uint32_t us)
+        {
+            if (us < 2) {
+                return us;
+            }
+            uint8_t octave = 31 - __builtin_clz(us);
+            uint8_t index = octave * 2 + ((us >> (octave - 1)) & 1);
+            return index < Buckets ? index : Buckets - 1;
+        }
+        static uint32_t upperBound(uint8_t bucket)
+        {
+            if (bucket < 2) {
+                return bucket;
+            }
+            uint8_t octave = bucket / 2;
+            uint32_t half = 1UL << (octave - 1);
+            return (1UL << octave) + (bucket % 2) * half + half - 1;
+        }
+
+        void record(uint32_t us)
+        {
+            this->counts[bucket(us)]++;
+            this->total++;
+            this->sum += us;
+            if (us > this->maximum) {
+                this->maximum = us;
+            }
+        }
+
+        uint32_t count() const { return this->total; }
+        uint32_t max() const { return this->maximum; }
+        uint64_t totalMicros() const { return this->sum; }
+        uint32_t bucketCount(uint8_t bucket) const { return this->counts[bucket]; }
+
+        // Upper bound of the bucket holding the percentile, never above the largest sample
+        uint32_t percentile(uint8_t percent) const
+        {
+            if (this->total == 0) {
+                return 0;
+            }
+            uint32_t target = ((uint64_t)this->total * percent + 99) / 100;
+            uint32_t seen = 0;
+            for (uint8_t i = 0; i < Buckets; i++) {
+                seen += this->counts[i];
+                if (seen >= target && seen != 0) {
+                    uint32_t bound = upperBound(i);
+                    return bound < this->maximum ? bound : this->maximum;
+                }
+            }
+            return this->maximum;
+        }
+
+        void reset() { *this = LatencyHistogram(); }
+    };
+
+    class LatencyStats
+    {
+        LatencyHistogram histograms[static_cast<uint8_t>(Latency::Phase::Count)];
+
+    public:
+        void record(Latency::Phase phase, uint32_t us) { this->histograms[static_cast<uint8_t>(phase)].record(us); }
+        const LatencyHistogram &operator[](Latency::Phase phase) const { return this->histograms[static_cast<uint8_t>(phase)]; }
+        void reset()
+        {
+            for (auto &histogram : this->histograms) {
+                histogram.reset();
+            }
+        }
+    };
+}
+
+#ifdef LATENCY_HISTOGRAMS
+
+namespace DoorLock
+{
+    inline LatencyStats &latency()
+    {
+        static LatencyStats stats;
+        return stats;
+    }
+}
+
+// now is the current time in microseconds, from whatever clock the caller uses
+#define LATENCY_START(name, now) uint32_t name = (now)
+#define LATENCY_SINCE(phase, start, now) DoorLock::latency().record(DoorLock::Latency::Phase::phase, (uint32_t)((now) - (start)))
+#define LATENCY_RECORD(phase, us) DoorLock::latency().record(DoorLock::Latency::Phase::phase, (uint32_t)(us))
+
+#else
+
+#define LATENCY_START(name, now) do {} while (0)
+#define LATENCY_SINCE(phase, start, now) do {} while (0)
+#define LATENCY_RECORD(phase, us) do {} while (0)
+
+#endif
+
+#endif //DOORLOCK_LATENCY_HPP
@@ -0,0 +1,186 @@
+// Log records are formatted into a RAM ring buffer and written to the serial port
+// in the background, so logging never waits on the UART.
+//
+// LOG_LEVEL selects what is compiled in, anything above it compiles to nothing:
+//   LOG_LEVEL_NONE, LOG_LEVEL_ERROR, LOG_LEVEL_WARN, LOG_LEVEL_INFO, LOG_LEVEL_DEBUG
+
+#ifndef DOORLOCK_LOG_HPP
+#define DOORLOCK_LOG_HPP
+
+#include <cstdarg>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+
+#define LOG_LEVEL_NONE 0
+#define LOG_LEVEL_ERROR 1
+#define LOG_LEVEL_WARN 2
+#define LOG_LEVEL_INFO 3
+#define LOG_LEVEL_DEBUG 4
+
+#ifndef LOG_LEVEL
+#define LOG_LEVEL LOG_LEVEL_INFO
+#endif
+
+#ifndef LOG_BUFFER_SIZE
+#define LOG_BUFFER_SIZE 2048
+#endif
+
+// Longest formatted record, longer ones are truncated
+#ifndef LOG_LINE_SIZE
+#define LOG_LINE_SIZE 128
+#endif
+
+namespace DoorLock
+{
+    template <size_t Capacity>
+    class LogRing
+    {
+        char data[Capacity];
+        size_t head = 0;
+        size_t count = 0;
+        uint32_t dropped = 0;
+
+    public:
+        size_t size() const { return this->count; }
+        size_t space() const { return Capacity - this->count; }
+        uint32_t droppedRecords() const { return this->dropped; }
+
+        void printf(char level, const char *format, ...)
+        {
+            char line[LOG_LINE_SIZE];
+            line[0] = level;
+            line[1] = ' ';
+            va_list args;
+            va_start(args, format);
+            int len = vsnprintf(line + 2, sizeof(line) - 3, format, args);
+            va_end(args);
+            if (len < 0) {
+                return;
+            }
+            len = 2 + (len < (int)sizeof(line) - 3 ? len : (int)sizeof(line) - 4);
+            line[len++] = '\n';
+
+            // Whole records or nothing, a half written line is worse than a missing one
+            if (!this->reserve(len)) {
+                return;
+            }
+            this->put(line, len);
+        }
+
+        void hex(char level, const char *label, const uint8_t *bytes, size_t len)
+        {
+            static const char digits[] = "0123456789ABCDEF";
+
+            size_t labelLen = strlen(label);
+            if (!this->reserve(2 + labelLen + 1 + len * 2 + 1)) {
+                return;
+            }
+            char prefix[2] = {level, ' '};
+            this->put(prefix, 2);
+            this->put(label, labelLen);
+            this->put(" ", 1);
+            for (size_t i = 0; i < len; i++) {
+                char pair[2] = {digits[bytes[i] >> 4], digits[bytes[i] & 0x0f]};
+                this->put(pair, 2);
+            }
+            this->put("\n", 1);
+        }
+
+        // Hands over at most what the sink accepts without blocking, Sink needs
+        // availableForWrite() and write(const uint8_t*, size_t) like HardwareSerial
+        template <typename Sink>
+        void drain(Sink &sink)
+        {
+            this->reportDropped();
+            while (this->count != 0) {
+                size_t room = sink.availableForWrite();
+                if (room == 0) {
+                    return;
+                }
+                size_t chunk = this->count;
+                if (chunk > Capacity - this->head) {
+                    chunk = Capacity - this->head;
+                }
+                if (chunk > room) {
+                    chunk = room;
+                }
+                sink.write((const uint8_t *)this->data + this->head, chunk);
+                this->head = (this->head + chunk) % Capacity;
+                this->count -= chunk;
+            }
+            this->reportDropped();
+        }
+
+        // Blocks until everything is written, for fatal paths and restarts
+        template <typename Sink>
+        void flush(Sink &sink)
+        {
+            while (this->count != 0) {
+                this->drain(sink);
+            }
+        }
+
+    private:
+        void reportDropped()
+        {
+            if (this->dropped != 0 && this->space() > 32) {
+                uint32_t dropped = this->dropped;
+                this->dropped = 0;
+                this->printf('W', "%u log records dropped", (unsigned)dropped);
+            }
+        }
+        bool reserve(size_t len)
+        {
+            if (len > this->space()) {
+                this->dropped++;
+                return false;
+            }
+            return true;
+        }
+        void put(const char *bytes, size_t len)
+        {
+            for (size_t i = 0; i < len; i++) {
+                this->data[(this->head + this->count) % Capacity] = bytes[i];
+                this->count++;
+            }
+        }
+    };
+
+    inline LogRing<LOG_BUFFER_SIZE> &logger()
+    {
+        static LogRing<LOG_BUFFER_SIZE> ring;
+        return ring;
+    }
+}
+
+#if LOG_LEVEL >= LOG_LEVEL_ERROR
+#define LOG_ERROR(...) DoorLock::logger().printf('E', __VA_ARGS__)
+#else
+#define LOG_ERROR(...) do {} while (0)
+#endif
+
+#if LOG_LEVEL >= LOG_LEVEL_WARN
+#define LOG_WARN(...) DoorLock::logger().printf('W', __VA_ARGS__)
+#else
+#define LOG_WARN(...) do {} while (0)
+#endif
+
+#if LOG_LEVEL >= LOG_LEVEL_INFO
+#define LOG_INFO(...) DoorLock::logger().printf('I', __VA_ARGS__)
+#define LOG_INFO_HEX(label, bytes, len) DoorLock::logger().hex('I', label, (const uint8_t *)(bytes), len)
+#else
+#define LOG_INFO(...) do {} while (0)
+#define LOG_INFO_HEX(label, bytes, len) do {} while (0)
+#endif
+
+#if LOG_LEVEL >= LOG_LEVEL_DEBUG
+#define LOG_DEBUG(...) DoorLock::logger().printf('D', __VA_ARGS__)
+#define LOG_DEBUG_HEX(label, bytes, len) DoorLock::logger().hex('D', label, (const uint8_t *)(bytes), len)
+#else
+#define LOG_DEBUG(...) do {} while (0)
+#define LOG_DEBUG_HEX(label, bytes, len) do {} while (0)
+#endif
+
+#endif //DOORLOCK_LOG_HPP
@@ -0,0 +1,148 @@
+// Local mirror of the badge NUIDs allowed to open the door
+
+#ifndef DOORLOCK_MEMBER_TABLE_HPP
+#define DOORLOCK_MEMBER_TABLE_HPP
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "../ptldap/string_view.hpp"
+#include "bytes.hpp"
+
+namespace DoorLock
+{
+    // A badge NUID as read by the MFRC522, 4, 7 or 10 bytes long
+    struct Badge
+    {
+        static const uint8_t MaxSize = 10;
+
+        uint8_t size = 0;
+        uint8_t bytes[MaxSize] = {};
+
+        Badge() = default;
+        Badge(const uint8_t *data, size_t len)
+        {
+            this->size = len < MaxSize ? len : MaxSize;
+            memcpy(this->bytes, data, this->size);
+        }
+        explicit Badge(nonstd::string_view data) : Badge((const uint8_t *)data.data(), data.size()) {}
+
+        nonstd::string_view view() const { return nonstd::string_view((const char *)this->bytes, this->size); }
+
+        bool operator<(const Badge &other) const
+        {
+            if (this->size != other.size) {
+                return this->size < other.size;
+            }
+            return memcmp(this->bytes, other.bytes, this->size) < 0;
+        }
+        bool operator==(const Badge &other) const
+        {
+            return this->size == other.size && memcmp(this->bytes, other.bytes, this->size) == 0;
+        }
+        bool operator!=(const Badge &other) const { return !(*this == other); }
+    };
+
+    // Sorted table of member badges, looked up with a binary search
+    //
+    // Serialized layout (little endian):
+    //   magic (4) | version (1) | tag (4) | age (4) | count (4) | count * (size (1) | bytes (size))
+    class MemberTable
+    {
+        std::vector<Badge> badges;
+
+    public:
+        static const uint32_t Magic = 0x4d424c44; // "DLBM"
+        static const uint8_t Version = 3;
+
+        // Set by the owner, tells which search the badges come from and how long ago in ms
+        uint32_t tag = 0;
+        uint32_t age = 0;
+
+        void clear() { this->badges.clear(); }
+        size_t size() const { return this->badges.size(); }
+        bool empty() const { return this->badges.empty(); }
+        void swap(MemberTable &other)
+        {
+            this->badges.swap(other.badges);
+            std::swap(this->tag, other.tag);
+            std::swap(this->age, other.age);
+        }
+        const std::vector<Badge> &all() const { return this->badges; }
+
+        // Badges can be added in any order, seal() must be called before lookups
+        void add(const Badge &badge)
+        {
+            if (badge.size != 0) {
+                this->badges.push_back(badge);
+            }
+        }
+        void seal()
+        {
+            std::sort(this->badges.begin(), this->badges.end());
+            this->badges.erase(std::unique(this->badges.begin(), this->badges.end()), this->badges.end());
+            this->badges.shrink_to_fit();
+        }
+
+        bool contains(const Badge &badge) const
+        {
+            return std::binary_search(this->badges.begin(), this->badges.end(), badge);
+        }
+
+        std::string serialize() const
+        {
+            std::string data;
+            data.reserve(17 + this->badges.size() * 5);
+            appendU32(data, Magic);
+            data += (char)Version;
+            appendU32(data, this->tag);
+            appendU32(data, this->age);
+            appendU32(data, this->badges.size());
+            for (auto &badge : this->badges) {
+                data += (char)badge.size;
+                data.append((const char *)badge.bytes, badge.size);
+            }
+            return data;
+        }
+
+        // Leaves the table untouched if the data is truncated, unsorted or from another version
+        bool deserialize(nonstd::string_view data)
+        {
+            size_t offset = 0;
+            if (data.size() < 17 || readU32(data, offset) != Magic || (uint8_t)data[offset++] != Version) {
+                return false;
+            }
+            uint32_t tag = readU32(data, offset);
+            uint32_t age = readU32(data, offset);
+
+            uint32_t count = readU32(data, offset);
+            std::vector<Badge> loaded;
+            loaded.reserve(count);
+            for (uint32_t i = 0; i < count; i++) {
+                if (offset >= data.size()) {
+                    return false;
+                }
+                uint8_t size = data[offset++];
+                if (size == 0 || size > Badge::MaxSize || data.size() - offset < size) {
+                    return false;
+                }
+                Badge badge((const uint8_t *)data.data() + offset, size);
+                offset += size;
+                if (!loaded.empty() && !(loaded.back() < badge)) {
+                    return false;
+                }
+                loaded.push_back(badge);
+            }
+
+            this->badges.swap(loaded);
+            this->tag = tag;
+            this->age = age;
+            return true;
+        }
+    };
+}
+
+#endif //DOORLOCK_MEMBER_TABLE_HPP
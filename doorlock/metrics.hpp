@@ -0,0 +1,200 @@
+// Door health counters and their Prometheus text exposition
+
+#ifndef DOORLOCK_METRICS_HPP
+#define DOORLOCK_METRICS_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+
+#include "latency.hpp"
+
+namespace DoorLock
+{
+    struct Counters
+    {
+        uint32_t swipes = 0;
+        uint32_t grants = 0;
+        uint32_t denies = 0;
+        uint32_t ldapErrors = 0;
+        uint32_t timeouts = 0;
+        uint32_t reconnects = 0;   // Sessions opened again after they were once bound
+        uint32_t mirrorHits = 0;   // Decided by the member mirror
+        uint32_t negativeHits = 0; // Denied from the negative cache
+        uint32_t cacheMisses = 0;  // Had to ask the LDAP
+        uint32_t hedges = 0;       // Searches also sent to a second server
+        uint32_t abandons = 0;     // Searches dropped once another server answered, or too slow
+        uint32_t retransmits = 0;  // CLDAP lookups sent again
+        uint32_t keepAlives = 0;   // WhoAmI sent on quiet sessions
+        uint32_t scansDropped = 0;
+        uint32_t wifiReconnects = 0; // Filled in by the sketch
+    };
+
+    // Sampled when a scrape starts
+    struct Gauges
+    {
+        uint32_t members = 0;
+        uint32_t freeHeap = 0;
+        uint32_t uptimeSeconds = 0;
+        bool ldapUp = false;
+        uint32_t wifiConnectMillis = 0; // Last association
+        uint32_t readyMillis = 0;       // Boot to the first bound LDAP session, 0 until then
+    };
+
+    // Produces the exposition one piece at a time into a caller buffer, so a scrape
+    // can be streamed over several loop iterations without allocating
+    class MetricsWriter
+    {
+        struct Metric
+        {
+            const char *name;
+            uint32_t Counters::*counter;
+        };
+
+        enum class Section : uint8_t { Counters, Gauges, Histograms, Done };
+
+        // Histograms expose one bucket per power of two from 2^FirstOctave us
+        static const uint8_t FirstOctave = 8;
+        static const uint8_t LastOctave = 24;
+
+        const Counters &counters;
+        const Gauges &gauges;
+        const LatencyStats *latency;
+        Section section = Section::Counters;
+        uint8_t item = 0;
+        uint8_t step = 0;
+
+    public:
+        MetricsWriter(const Counters &counters, const Gauges &gauges, const LatencyStats *latency)
+        : counters(counters), gauges(gauges), latency(latency) {}
+
+        void rewind()
+        {
+            this->section = Section::Counters;
+            this->item = this->step = 0;
+        }
+
+        // Returns the length written, 0 once the exposition is complete. size should be at least 128.
+        size_t next(char *buf, size_t size)
+        {
+            while (this->section != Section::Done) {
+                int len = 0;
+                switch (this->section) {
+                    case Section::Counters:
+                        len = this->nextCounter(buf, size);
+                        break;
+                    case Section::Gauges:
+                        len = this->nextGauge(buf, size);
+                        break;
+                    case Section::Histograms:
+                        len = this->nextHistogram(buf, size);
+                        break;
+                    case Section::Done:
+                        break;
+                }
+                if (len > 0) {
+                    return (size_t)len < size ? len : size - 1;
+                }
+            }
+            return 0;
+        }
+
+    private:
+        int nextCounter(char *buf, size_t size)
+        {
+            static const Metric metrics[] = {
+                {"doorlock_swipes_total", &Counters::swipes},
+                {"doorlock_grants_total", &Counters::grants},
+                {"doorlock_denies_total", &Counters::denies},
+                {"doorlock_ldap_errors_total", &Counters::ldapErrors},
+                {"doorlock_ldap_timeouts_total", &Counters::timeouts},
+                {"doorlock_ldap_reconnects_total", &Counters::reconnects},
+                {"doorlock_mirror_hits_total", &Counters::mirrorHits},
+                {"doorlock_negative_cache_hits_total", &Counters::negativeHits},
+                {"doorlock_cache_misses_total", &Counters::cacheMisses},
+                {"doorlock_ldap_hedged_searches_total", &Counters::hedges},
+                {"doorlock_ldap_abandoned_searches_total", &Counters::abandons},
+                {"doorlock_cldap_retransmits_total", &Counters::retransmits},
+                {"doorlock_ldap_keepalives_total", &Counters::keepAlives},
+                {"doorlock_scans_dropped_total", &Counters::scansDropped},
+                {"doorlock_wifi_reconnects_total", &Counters::wifiReconnects},
+            };
+            if (this->item >= sizeof(metrics) / sizeof(metrics[0])) {
+                this->advance(Section::Gauges);
+                return 0;
+            }
+            auto &metric = metrics[this->item++];
+            return snprintf(buf, size, "# TYPE %s counter\n%s %u\n",
+                            metric.name, metric.name, (unsigned)(this->counters.*metric.counter));
+        }
+
+        int nextGauge(char *buf, size_t size)
+        {
+            const char *name;
+            uint32_t value;
+            switch (this->item++) {
+                case 0: name = "doorlock_members"; value = this->gauges.members; break;
+                case 1: name = "doorlock_free_heap_bytes"; value = this->gauges.freeHeap; break;
+                case 2: name = "doorlock_uptime_seconds"; value = this->gauges.uptimeSeconds; break;
+                case 3: name = "doorlock_ldap_up"; value = this->gauges.ldapUp; break;
+                case 4: name = "doorlock_wifi_connect_milliseconds"; value = this->gauges.wifiConnectMillis; break;
+                case 5: name = "doorlock_ready_milliseconds"; value = this->gauges.readyMillis; break;
+                default:
+                    this->advance(this->latency ? Section::Histograms : Section::Done);
+                    return 0;
+            }
+            return snprintf(buf, size, "# TYPE %s gauge\n%s %u\n", name, name, (unsigned)value);
+        }
+
+        int nextHistogram(char *buf, size_t size)
+        {
+            if (this->item >= static_cast<uint8_t>(Latency::Phase::Count)) {
+                this->advance(Section::Done);
+                return 0;
+            }
+
+            auto phase = static_cast<Latency::Phase>(this->item);
+            auto &histogram = (*this->latency)[phase];
+            auto name = Latency::name(phase);
+            const uint8_t buckets = LastOctave - FirstOctave + 1;
+            uint8_t step = this->step++;
+
+            if (step == 0) {
+                return snprintf(buf, size, "%s", "# TYPE doorlock_latency_seconds histogram\n");
+            }
+            if (step <= buckets) {
+                // Values below 2^(octave + 1) us, that is every bucket up to the odd one of the octave
+                uint8_t octave = FirstOctave + step - 1;
+                uint32_t cumulative = 0;
+                for (uint8_t i = 0; i <= octave * 2 + 1 && i < LatencyHistogram::Buckets; i++) {
+                    cumulative += histogram.bucketCount(i);
+                }
+                uint32_t le = 1UL << (octave + 1);
+                return snprintf(buf, size, "doorlock_latency_seconds_bucket{phase=\"%s\",le=\"%u.%06u\"} %u\n",
+                                name, (unsigned)(le / 1000000), (unsigned)(le % 1000000), (unsigned)cumulative);
+            }
+            if (step == buckets + 1) {
+                return snprintf(buf, size, "doorlock_latency_seconds_bucket{phase=\"%s\",le=\"+Inf\"} %u\n",
+                                name, (unsigned)histogram.count());
+            }
+            if (step == buckets + 2) {
+                uint64_t sum = histogram.totalMicros();
+                return snprintf(buf, size, "doorlock_latency_seconds_sum{phase=\"%s\"} %u.%06u\n",
+                                name, (unsigned)(sum / 1000000), (unsigned)(sum % 1000000));
+            }
+
+            this->item++;
+            this->step = 1; // The TYPE line is only written once
+            return snprintf(buf, size, "doorlock_latency_seconds_count{phase=\"%s\"} %u\n",
+                            name, (unsigned)histogram.count());
+        }
+
+        void advance(Section section)
+        {
+            this->section = section;
+            this->item = this->step = 0;
+        }
+    };
+}
+
+#endif //DOORLOCK_METRICS_HPP
@@ -0,0 +1,80 @@
+// Bounded cache of recently rejected badges, so stray cards don't hit the LDAP on every swipe
+
+#ifndef DOORLOCK_NEGATIVE_CACHE_HPP
+#define DOORLOCK_NEGATIVE_CACHE_HPP
+
+#include <cstddef>
+#include <cstdint>
+
+#include "member_table.hpp"
+
+namespace DoorLock
+{
+    template <size_t Capacity>
+    class NegativeCache
+    {
+        struct Entry
+        {
+            Badge badge;
+            uint32_t rejectedAt = 0;
+        };
+
+        Entry entries[Capacity];
+        uint32_t ttl;
+
+    public:
+        // Times are in milliseconds, compared with wrap-around safe arithmetic like millis()
+        explicit NegativeCache(uint32_t ttl) : ttl(ttl) {}
+
+        bool contains(const Badge &badge, uint32_t now) const
+        {
+            for (auto &entry : this->entries) {
+                if (entry.badge == badge && !this->expired(entry, now)) {
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        // Refreshes the badge if it is already there, otherwise evicts the oldest entry
+        void insert(const Badge &badge, uint32_t now)
+        {
+            Entry *slot = &this->entries[0];
+            for (auto &entry : this->entries) {
+                if (entry.badge == badge) {
+                    slot = &entry;
+                    break;
+                }
+                if (slot->badge.size == 0) {
+                    continue;
+                }
+                if (entry.badge.size == 0 || now - entry.rejectedAt > now - slot->rejectedAt) {
+                    slot = &entry;
+                }
+            }
+            slot->badge = badge;
+            slot->rejectedAt = now;
+        }
+
+        void remove(const Badge &badge)
+        {
+            for (auto &entry : this->entries) {
+                if (entry.badge == badge) {
+                    entry = Entry();
+                }
+            }
+        }
+
+        void clear()
+        {
+            for (auto &entry : this->entries) {
+                entry = Entry();
+            }
+        }
+
+    private:
+        bool expired(const Entry &entry, uint32_t now) const { return now - entry.rejectedAt >= this->ttl; }
+    };
+}
+
+#endif //DOORLOCK_NEGATIVE_CACHE_HPP
@@ -0,0 +1,46 @@
+// When to look at a card reader next: fast right after a card was seen, backing off when nothing happens
+
+#ifndef DOORLOCK_POLL_SCHEDULE_HPP
+#define DOORLOCK_POLL_SCHEDULE_HPP
+
+#include <cstdint>
+
+namespace DoorLock
+{
+    class PollSchedule
+    {
+        uint32_t fastInterval = 0;
+        uint32_t slowInterval = 0;
+        uint32_t activeWindow = 0;
+        uint32_t lastActivity = 0;
+        bool active = false;
+        uint32_t interval = 0;
+
+    public:
+        PollSchedule() = default;
+        // All in ms. Polls every fast for window after activity, then doubles up to slow.
+        PollSchedule(uint32_t fast, uint32_t slow, uint32_t window)
+        : fastInterval(fast), slowInterval(slow), activeWindow(window), interval(slow) {}
+
+        void activity(uint32_t now)
+        {
+            this->lastActivity = now;
+            this->active = true;
+            this->interval = this->fastInterval;
+        }
+
+        // Interval until the next poll, called once per poll
+        uint32_t next(uint32_t now)
+        {
+            if (this->active && now - this->lastActivity < this->activeWindow) {
+                return this->fastInterval;
+            }
+            this->active = false;
+            uint32_t current = this->interval;
+            this->interval = current * 2 < this->slowInterval ? current * 2 : this->slowInterval;
+            return current;
+        }
+    };
+}
+
+#endif //DOORLOCK_POLL_SCHEDULE_HPP
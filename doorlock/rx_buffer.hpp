@@ -0,0 +1,47 @@
+// Fixed receive buffer, filled straight from the socket and decoded in place
+
+#ifndef DOORLOCK_RX_BUFFER_HPP
+#define DOORLOCK_RX_BUFFER_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#include "../ptldap/string_view.hpp"
+
+namespace DoorLock
+{
+    // Capacity must hold the largest PDU the server can send, a full buffer without
+    // a complete message in it means the message will never fit
+    template <size_t Capacity>
+    class RxBuffer
+    {
+        uint8_t data[Capacity];
+        size_t length = 0;
+
+    public:
+        // Free space to read into, followed by commit() with the number of bytes read
+        uint8_t *tail() { return this->data + this->length; }
+        size_t space() const { return Capacity - this->length; }
+        void commit(size_t count) { this->length += count < this->space() ? count : this->space(); }
+
+        nonstd::string_view view() const { return nonstd::string_view((const char *)this->data, this->length); }
+        size_t size() const { return this->length; }
+        bool empty() const { return this->length == 0; }
+        bool full() const { return this->length == Capacity; }
+
+        // Drop the decoded messages and move the partial one to the front
+        void consume(size_t count)
+        {
+            if (count >= this->length) {
+                this->length = 0;
+                return;
+            }
+            memmove(this->data, this->data + count, this->length - count);
+            this->length -= count;
+        }
+        void clear() { this->length = 0; }
+    };
+}
+
+#endif //DOORLOCK_RX_BUFFER_HPP
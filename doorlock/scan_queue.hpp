@@ -0,0 +1,84 @@
+// Badges read while an earlier swipe is still being handled
+
+#ifndef DOORLOCK_SCAN_QUEUE_HPP
+#define DOORLOCK_SCAN_QUEUE_HPP
+
+#include <cstddef>
+#include <cstdint>
+
+#include "member_table.hpp"
+
+namespace DoorLock
+{
+    struct Scan
+    {
+        Badge badge;
+        uint32_t arrivedAt = 0;  // millis(), used for the deadline
+        uint32_t detectedAt = 0; // micros() when the reader saw the card
+        uint32_t readAt = 0;     // micros() once the UID was read
+    };
+
+    // Fixed-capacity FIFO, a badge already waiting is merged instead of queued twice
+    template <size_t Capacity>
+    class ScanQueue
+    {
+        Scan scans[Capacity];
+        size_t head = 0;
+        size_t count = 0;
+        uint32_t dropped = 0;
+
+    public:
+        size_t size() const { return this->count; }
+        bool empty() const { return this->count == 0; }
+        bool full() const { return this->count == Capacity; }
+        // Scans lost to a full queue or the deadline
+        uint32_t droppedScans() const { return this->dropped; }
+
+        bool contains(const Badge &badge) const
+        {
+            for (size_t i = 0; i < this->count; i++) {
+                if (this->at(i).badge == badge) {
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        // Returns false if the scan was merged with a waiting one or the queue is full
+        bool push(const Scan &scan)
+        {
+            if (this->contains(scan.badge)) {
+                return false;
+            }
+            if (this->full()) {
+                this->dropped++;
+                return false;
+            }
+            this->scans[(this->head + this->count) % Capacity] = scan;
+            this->count++;
+            return true;
+        }
+
+        // Pops the oldest scan still within the deadline, older ones are thrown away
+        bool pop(uint32_t now, uint32_t deadline, Scan &scan)
+        {
+            while (this->count != 0) {
+                scan = this->scans[this->head];
+                this->head = (this->head + 1) % Capacity;
+                this->count--;
+                if (now - scan.arrivedAt <= deadline) {
+                    return true;
+                }
+                this->dropped++;
+            }
+            return false;
+        }
+
+        void clear() { this->head = this->count = 0; }
+
+    private:
+        const Scan &at(size_t i) const { return this->scans[(this->head + i) % Capacity]; }
+    };
+}
+
+#endif //DOORLOCK_SCAN_QUEUE_HPP
@@ -0,0 +1,117 @@
+// Cooperative timer tasks run from the main loop, nothing here ever waits
+
+#ifndef DOORLOCK_SCHEDULER_HPP
+#define DOORLOCK_SCHEDULER_HPP
+
+#include <cstddef>
+#include <cstdint>
+
+namespace DoorLock
+{
+    class Task
+    {
+    public:
+        // Returned by run() to leave the schedule
+        static const uint32_t Done = 0xFFFFFFFF;
+
+        virtual ~Task() = default;
+        // Does one step of work, returns the ms until the next run
+        virtual uint32_t run(uint32_t now) = 0;
+    };
+
+    // Fixed set of tasks, each scheduled at most once
+    template <size_t Capacity>
+    class Scheduler
+    {
+        struct Slot
+        {
+            Task *task = nullptr;
+            uint32_t due = 0;
+        };
+
+        Slot slots[Capacity];
+
+    public:
+        // Schedules the task, or moves it if it already is. Returns false when full.
+        bool schedule(Task &task, uint32_t now, uint32_t delay = 0)
+        {
+            Slot *free = nullptr;
+            for (auto &slot : this->slots) {
+                if (slot.task == &task) {
+                    slot.due = now + delay;
+                    return true;
+                }
+                if (!slot.task && !free) {
+                    free = &slot;
+                }
+            }
+            if (!free) {
+                return false;
+            }
+            free->task = &task;
+            free->due = now + delay;
+            return true;
+        }
+
+        void cancel(Task &task)
+        {
+            for (auto &slot : this->slots) {
+                if (slot.task == &task) {
+                    slot.task = nullptr;
+                }
+            }
+        }
+
+        bool scheduled(const Task &task) const
+        {
+            for (auto &slot : this->slots) {
+                if (slot.task == &task) {
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        // Runs every task due at now once
+        void run(uint32_t now)
+        {
+            for (auto &slot : this->slots) {
+                if (!slot.task || (int32_t)(now - slot.due) < 0) {
+                    continue;
+                }
+                auto task = slot.task;
+                uint32_t delay = task->run(now);
+                // The task may have been cancelled or moved by what it did
+                if (slot.task != task) {
+                    continue;
+                }
+                if (delay == Task::Done) {
+                    slot.task = nullptr;
+                } else if ((int32_t)(slot.due - now) <= 0) {
+                    slot.due = now + delay;
+                }
+            }
+        }
+
+        // How long the loop may sleep before the next task is due, at most limit
+        uint32_t idleFor(uint32_t now, uint32_t limit) const
+        {
+            uint32_t sleep = limit;
+            for (auto &slot : this->slots) {
+                if (!slot.task) {
+                    continue;
+                }
+                int32_t left = (int32_t)(slot.due - now);
+                if (left <= 0) {
+                    return 0;
+                }
+                if ((uint32_t)left < sleep) {
+                    sleep = left;
+                }
+            }
+            return sleep;
+        }
+    };
+}
+
+#endif //DOORLOCK_SCHEDULER_HPP
@@ -0,0 +1,899 @@
+#define CATCH_CONFIG_FAST_COMPILE
+
+#include "catch.hpp"
+
+#include "fakes.hpp"
+#include "../wifi_cache.hpp"
+
+using namespace DoorLock;
+
+static Badge badge(uint8_t last)
+{
+    const uint8_t bytes[] = {0x04, 0xa1, 0x5c, last};
+    return Badge(bytes, sizeof(bytes));
+}
+
+// Bound and synced once, with whatever members the fake directory had
+static void boot(Rig &rig)
+{
+    rig.controller.begin();
+    rig.run(1000);
+    REQUIRE( rig.controller.ldapReady() );
+}
+
+TEST_CASE( "MemberTable round trip", "[MemberTable]" ) {
+    MemberTable table;
+    table.add(badge(3));
+    table.add(badge(1));
+    table.add(badge(3));
+    table.seal();
+
+    REQUIRE( table.size() == 2 );
+    REQUIRE( table.contains(badge(1)) );
+    REQUIRE( !table.contains(badge(2)) );
+
+    table.tag = 0x12345678;
+    MemberTable loaded;
+    REQUIRE( loaded.deserialize(table.serialize()) );
+    REQUIRE( loaded.size() == 2 );
+    REQUIRE( loaded.contains(badge(3)) );
+    REQUIRE( loaded.tag == 0x12345678 );
+
+    auto data = table.serialize();
+    REQUIRE( !loaded.deserialize(nonstd::string_view(data).substr(0, data.size() - 1)) );
+    REQUIRE( !loaded.deserialize("garbage") );
+}
+
+TEST_CASE( "WifiCache round trip", "[WifiCache]" ) {
+    WifiCache cache;
+    const uint8_t bssid[] = {0x24, 0x0a, 0xc4, 0x01, 0x02, 0x03};
+    memcpy(cache.bssid, bssid, sizeof(bssid));
+    cache.channel = 11;
+    cache.ip = 0x2a01a8c0;
+    cache.mask = 0x00ffffff;
+    auto data = cache.serialize();
+    REQUIRE( data.size() == size_t(WifiCache::Size) );
+
+    WifiCache loaded;
+    REQUIRE( loaded.deserialize(data) );
+    REQUIRE( loaded == cache );
+    REQUIRE( loaded.hasAddress() );
+
+    REQUIRE( !loaded.deserialize(data.substr(1)) );
+    data[11] = 0; // channel
+    REQUIRE( !loaded.deserialize(data) );
+    REQUIRE( !loaded.deserialize("") );
+}
+
+TEST_CASE( "NegativeCache expires and evicts", "[NegativeCache]" ) {
+    NegativeCache<2> cache(1000);
+    cache.insert(badge(1), 0);
+    REQUIRE( cache.contains(badge(1), 999) );
+    REQUIRE( !cache.contains(badge(1), 1000) );
+
+    cache.insert(badge(1), 100);
+    cache.insert(badge(2), 200);
+    cache.insert(badge(3), 300);
+    REQUIRE( !cache.contains(badge(1), 300) );
+    REQUIRE( cache.contains(badge(2), 300) );
+    REQUIRE( cache.contains(badge(3), 300) );
+
+    cache.remove(badge(2));
+    REQUIRE( !cache.contains(badge(2), 300) );
+}
+
+TEST_CASE( "ScanQueue merges, drops and expires", "[ScanQueue]" ) {
+    ScanQueue<2> queue;
+    Scan scan;
+    scan.badge = badge(1);
+    scan.arrivedAt = 0;
+    REQUIRE( queue.push(scan) );
+    REQUIRE( !queue.push(scan) );
+    scan.badge = badge(2);
+    scan.arrivedAt = 500;
+    REQUIRE( queue.push(scan) );
+    scan.badge = badge(3);
+    REQUIRE( !queue.push(scan) );
+    REQUIRE( queue.droppedScans() == 1 );
+
+    Scan popped;
+    REQUIRE( queue.pop(1200, 1000, popped) );
+    REQUIRE( popped.badge == badge(2) );
+    REQUIRE( queue.droppedScans() == 2 );
+    REQUIRE( !queue.pop(1200, 1000, popped) );
+}
+
+TEST_CASE( "RxBuffer keeps the unconsumed tail", "[RxBuffer]" ) {
+    RxBuffer<8> buffer;
+    memcpy(buffer.tail(), "abcdefgh", 8);
+    buffer.commit(10);
+    REQUIRE( buffer.full() );
+    buffer.consume(5);
+    REQUIRE( buffer.view() == "fgh" );
+    REQUIRE( buffer.space() == 5 );
+}
+
+TEST_CASE( "LatencyHistogram percentiles", "[LatencyHistogram]" ) {
+    LatencyHistogram histogram;
+    for (uint32_t i = 0; i < 99; i++) {
+        histogram.record(1000);
+    }
+    histogram.record(100000);
+
+    REQUIRE( histogram.count() == 100 );
+    REQUIRE( histogram.max() == 100000 );
+    REQUIRE( histogram.percentile(50) >= 1000 );
+    REQUIRE( histogram.percentile(50) < 1500 );
+    REQUIRE( histogram.percentile(100) == 100000 );
+    REQUIRE( histogram.totalMicros() == 99 * 1000 + 100000 );
+}
+
+TEST_CASE( "MetricsWriter exposition", "[MetricsWriter]" ) {
+    Counters counters;
+    counters.grants = 7;
+    Gauges gauges;
+    gauges.ldapUp = true;
+    LatencyStats latency;
+    latency.record(Latency::Phase::Swipe, 3000);
+    MetricsWriter writer(counters, gauges, &latency);
+
+    std::string text;
+    char buf[160];
+    while (size_t len = writer.next(buf, sizeof(buf))) {
+        text.append(buf, len);
+    }
+
+    REQUIRE( text.find("doorlock_grants_total 7\n") != std::string::npos );
+    REQUIRE( text.find("doorlock_ldap_up 1\n") != std::string::npos );
+    REQUIRE( text.find("doorlock_latency_seconds_bucket{phase=\"swipe\",le=\"0.004096\"} 1\n") != std::string::npos );
+    REQUIRE( text.find("doorlock_latency_seconds_count{phase=\"swipe\"} 1\n") != std::string::npos );
+    REQUIRE( text.find("# TYPE doorlock_latency_seconds histogram") == text.rfind("# TYPE doorlock_latency_seconds histogram") );
+}
+
+TEST_CASE( "Scheduler runs tasks when they are due", "[Scheduler]" ) {
+    struct Ticker : public Task
+    {
+        uint32_t runs = 0;
+        uint32_t period = 10;
+        uint32_t run(uint32_t) override { return ++this->runs == 3 ? Task::Done : this->period; }
+    };
+    Scheduler<2> scheduler;
+    Ticker a, b, c;
+
+    REQUIRE( scheduler.schedule(a, 0) );
+    REQUIRE( scheduler.schedule(b, 0, 25) );
+    REQUIRE( !scheduler.schedule(c, 0) );
+    REQUIRE( scheduler.idleFor(0, 100) == 0 );
+
+    scheduler.run(0);
+    REQUIRE( a.runs == 1 );
+    REQUIRE( b.runs == 0 );
+    REQUIRE( scheduler.idleFor(4, 100) == 6 );
+
+    scheduler.run(10);
+    scheduler.run(25);
+    REQUIRE( a.runs == 3 );
+    REQUIRE( b.runs == 1 );
+    REQUIRE( !scheduler.scheduled(a) );
+    REQUIRE( scheduler.idleFor(25, 100) == 10 );
+
+    scheduler.cancel(b);
+    REQUIRE( scheduler.idleFor(25, 100) == 100 );
+}
+
+TEST_CASE( "PollSchedule speeds up after activity", "[PollSchedule]" ) {
+    PollSchedule poll(20, 100, 1000);
+    REQUIRE( poll.next(0) == 100 );
+
+    poll.activity(500);
+    REQUIRE( poll.next(520) == 20 );
+    REQUIRE( poll.next(1400) == 20 );
+    // Then backs off
+    REQUIRE( poll.next(1520) == 20 );
+    REQUIRE( poll.next(1540) == 40 );
+    REQUIRE( poll.next(1580) == 80 );
+    REQUIRE( poll.next(1660) == 100 );
+    REQUIRE( poll.next(1760) == 100 );
+}
+
+TEST_CASE( "Controller grants a member found online", "[Controller]" ) {
+    Rig rig;
+    rig.ldap.responseMicros = 20000;
+    boot(rig);
+
+    rig.ldap.addMember(badge(1));
+    rig.reader.present(badge(1));
+    rig.run(3000);
+
+    auto &stats = rig.controller.stats();
+    REQUIRE( rig.relay.opened == 1 );
+    REQUIRE( !rig.relay.open );
+    REQUIRE( stats.grants == 1 );
+    REQUIRE( stats.cacheMisses == 1 );
+    REQUIRE( rig.ldap.connects == 1 );
+    REQUIRE( rig.ldap.binds == 1 );
+}
+
+TEST_CASE( "Controller denies unknown badges and remembers them", "[Controller]" ) {
+    Rig rig;
+    boot(rig);
+    auto searches = rig.ldap.searches;
+
+    rig.reader.present(badge(9));
+    rig.run(6000);
+    rig.reader.present(badge(9));
+    rig.run(6000);
+
+    auto &stats = rig.controller.stats();
+    REQUIRE( rig.relay.opened == 0 );
+    REQUIRE( stats.denies == 2 );
+    REQUIRE( stats.negativeHits == 1 );
+    REQUIRE( rig.ldap.searches == searches + 1 );
+}
+
+TEST_CASE( "Controller decides from the member mirror offline", "[Controller]" ) {
+    Rig rig;
+    rig.ldap.addMember(badge(1));
+    rig.ldap.addMember(badge(2));
+    boot(rig);
+
+    REQUIRE( rig.controller.members().size() == 2 );
+    REQUIRE( rig.store.saves == 1 );
+
+    rig.ldap.link = false;
+    rig.ldap.drop();
+    rig.reader.present(badge(2));
+    rig.run(3000);
+    REQUIRE( rig.relay.opened == 1 );
+    REQUIRE( rig.controller.stats().mirrorHits == 1 );
+
+    // The mirror survives a reboot without the network
+    Rig rebooted;
+    rebooted.store = rig.store;
+    rebooted.ldap.link = false;
+    rebooted.controller.begin();
+    REQUIRE( rebooted.controller.members().size() == 2 );
+    rebooted.reader.present(badge(1));
+    rebooted.run(3000);
+    REQUIRE( rebooted.relay.opened == 1 );
+    REQUIRE( rebooted.ldap.connects == 0 );
+
+    // Nor is it used once the sync is off, it would never be refreshed
+    auto config = Rig::defaultConfig();
+    config.memberSyncInterval = 0;
+    Rig unsynced(config);
+    unsynced.store = rig.store;
+    unsynced.ldap.link = false;
+    unsynced.controller.begin();
+    REQUIRE( unsynced.controller.members().empty() );
+    unsynced.reader.present(badge(1));
+    unsynced.run(3000);
+    REQUIRE( unsynced.relay.opened == 0 );
+}
+
+TEST_CASE( "Controller stops trusting a mirror the sync can't refresh", "[Controller]" ) {
+    auto config = Rig::defaultConfig();
+    config.memberSyncInterval = 20000;
+    config.memberMirrorMaxAge = 60000;
+    Rig rig(config);
+    rig.ldap.addMember(badge(1));
+    boot(rig);
+    REQUIRE( rig.controller.members().size() == 1 );
+
+    // Every sync and lookup from now on is refused
+    rig.ldap.refuseSearches = true;
+    rig.run(30000);
+    rig.reader.present(badge(1));
+    rig.run(3000);
+    REQUIRE( rig.controller.stats().mirrorHits == 1 );
+
+    // The age written back survives a reboot
+    rig.run(15000);
+    Rig rebooted(config);
+    rebooted.store = rig.store;
+    rebooted.ldap.link = false;
+    rebooted.controller.begin();
+    REQUIRE( rebooted.controller.members().size() == 1 );
+    rebooted.run(30000);
+    REQUIRE( rebooted.controller.members().empty() );
+    rebooted.reader.present(badge(1));
+    rebooted.run(3000);
+    REQUIRE( rebooted.relay.opened == 0 );
+
+    rig.run(15000);
+    REQUIRE( rig.controller.members().empty() );
+    rig.reader.present(badge(1));
+    rig.run(3000);
+    REQUIRE( rig.controller.stats().mirrorHits == 1 );
+    REQUIRE( rig.controller.stats().grants == 1 );
+
+    // Nor does the dropped mirror come back after a reboot
+    Rig again(config);
+    again.store = rig.store;
+    again.controller.begin();
+    REQUIRE( again.controller.members().empty() );
+}
+
+TEST_CASE( "Controller only lets in members of the active group", "[Controller]" ) {
+    auto config = Rig::defaultConfig();
+    config.activeGroup = "cn=active,ou=Groups";
+    Rig rig(config);
+    rig.ldap.addMember(badge(1), {"cn=active,ou=Groups"});
+    rig.ldap.addMember(badge(2));
+    boot(rig);
+
+    // The mirror only holds active members
+    REQUIRE( rig.controller.members().size() == 1 );
+    REQUIRE( rig.controller.members().contains(badge(1)) );
+
+    rig.ldap.addMember(badge(3), {"cn=active,ou=Groups"});
+    rig.ldap.addMember(badge(4));
+    auto searches = rig.ldap.searches;
+    rig.reader.present(badge(3));
+    rig.run(3000);
+    rig.reader.present(badge(4));
+    rig.run(6000);
+
+    auto &stats = rig.controller.stats();
+    REQUIRE( rig.relay.opened == 1 );
+    REQUIRE( stats.grants == 1 );
+    REQUIRE( stats.denies == 1 );
+    // One search per decision
+    REQUIRE( rig.ldap.searches == searches + 2 );
+
+    // The mirror of the old group is dropped after a reboot with another one
+    config.activeGroup = "cn=board,ou=Groups";
+    Rig board(config);
+    board.store = rig.store;
+    board.ldap.addMember(badge(1), {"cn=active,ou=Groups"});
+    board.controller.begin();
+    REQUIRE( board.controller.members().empty() );
+    board.reader.present(badge(1));
+    board.run(3000);
+    REQUIRE( board.controller.stats().grants == 0 );
+    REQUIRE( board.controller.stats().denies == 1 );
+}
+
+TEST_CASE( "Controller looks badges up with the filter of the config", "[Controller]" ) {
+    struct Outcome
+    {
+        uint32_t grants;
+        uint32_t mirrorHits;
+        size_t members;
+    };
+    auto swipe = [](const char *filter, bool sync) {
+        auto config = Rig::defaultConfig();
+        if (!sync) {
+            config.memberSyncInterval = 0;
+        }
+        config.lookupFilter = filter;
+        Rig rig(config);
+        rig.ldap.addMember(badge(1));
+        boot(rig);
+        rig.reader.present(badge(1));
+        rig.run(3000);
+        auto &stats = rig.controller.stats();
+        return Outcome{stats.grants, stats.mirrorHits, rig.controller.members().size()};
+    };
+
+    for (bool sync : {false, true}) {
+        CAPTURE( sync );
+        REQUIRE( swipe("(&(cn=member)(badgenuid={0}))", sync).grants == 1 );
+        REQUIRE( swipe("(&(cn=staff)(badgenuid={0}))", sync).grants == 0 );
+        // Fails closed rather than falling back to a looser filter
+        REQUIRE( swipe("(&(cn=staff)(badgenuid={0})", sync).grants == 0 );
+    }
+
+    // The member sync searches the same filter for every badge
+    auto member = swipe("(&(cn=member)(badgenuid={0}))", true);
+    REQUIRE( member.members == 1 );
+    REQUIRE( member.mirrorHits == 1 );
+    REQUIRE( swipe("(&(cn=staff)(badgenuid={0}))", true).members == 0 );
+    // No list of badges matches an Or, every badge goes online
+    auto either = swipe("(|(cn=staff)(badgenuid={0}))", true);
+    REQUIRE( either.members == 0 );
+    REQUIRE( either.grants == 1 );
+    REQUIRE( either.mirrorHits == 0 );
+
+    // A mirror synced with a looser filter is dropped after a reboot
+    Rig loose;
+    loose.ldap.addMember(badge(1));
+    boot(loose);
+    REQUIRE( loose.controller.members().size() == 1 );
+    auto config = Rig::defaultConfig();
+    config.lookupFilter = "(&(cn=staff)(badgenuid={0}))";
+    Rig strict(config);
+    strict.store = loose.store;
+    strict.ldap.addMember(badge(1));
+    strict.controller.begin();
+    REQUIRE( strict.controller.members().empty() );
+    strict.reader.present(badge(1));
+    strict.run(3000);
+    REQUIRE( strict.controller.stats().grants == 0 );
+    REQUIRE( strict.controller.stats().denies == 1 );
+}
+
+TEST_CASE( "Controller syncs more members than the receive buffer holds", "[Controller]" ) {
+    Rig rig;
+    for (uint32_t i = 0; i < 200; i++) {
+        rig.ldap.addMember(badge(i));
+    }
+    boot(rig);
+    REQUIRE( rig.controller.members().size() == 200 );
+    REQUIRE( rig.controller.stats().ldapErrors == 0 );
+}
+
+TEST_CASE( "Controller syncs the members in pages", "[Controller]" ) {
+    auto config = Rig::defaultConfig();
+    config.memberSyncPageSize = 64;
+    Rig rig(config);
+    for (uint32_t i = 0; i < 200; i++) {
+        rig.ldap.addMember(badge(i));
+    }
+    boot(rig);
+    REQUIRE( rig.controller.members().size() == 200 );
+    REQUIRE( rig.controller.members().contains(badge(199)) );
+    REQUIRE( rig.ldap.searches == 4 );
+    REQUIRE( rig.controller.stats().ldapErrors == 0 );
+}
+
+TEST_CASE( "Controller ignores a corrupted mirror", "[Controller]" ) {
+    Rig rig;
+    rig.store.present = true;
+    rig.store.data = "garbage";
+    rig.controller.begin();
+    REQUIRE( rig.controller.members().empty() );
+}
+
+TEST_CASE( "Controller queues scans during a lookup", "[Controller]" ) {
+    Rig rig;
+    rig.ldap.responseMicros = 100000;
+    boot(rig);
+
+    // Badge 2 is still waiting when it is presented again
+    rig.reader.present(badge(1));
+    rig.run(20);
+    rig.reader.present(badge(2));
+    rig.run(20);
+    rig.reader.present(badge(3));
+    rig.run(20);
+    rig.reader.present(badge(2));
+    rig.run(10000);
+
+    auto &stats = rig.controller.stats();
+    REQUIRE( stats.swipes == 3 );
+    REQUIRE( stats.denies == 3 );
+    REQUIRE( stats.scansDropped == 0 );
+}
+
+TEST_CASE( "Controller suppresses a card left on the reader", "[Controller]" ) {
+    Rig rig;
+    rig.ldap.addMember(badge(1));
+    boot(rig);
+
+    rig.reader.present(badge(1));
+    rig.reader.present(badge(1));
+    rig.run(1000);
+    REQUIRE( rig.controller.stats().swipes == 1 );
+}
+
+TEST_CASE( "Controller recovers from LDAP failures", "[Controller]" ) {
+    Rig rig;
+    boot(rig);
+
+    SECTION( "search timeout" ) {
+        rig.ldap.answerSearches = false;
+        rig.reader.present(badge(1));
+        rig.run(6000);
+        REQUIRE( rig.controller.stats().timeouts == 1 );
+        REQUIRE( !rig.controller.ldapReady() );
+        REQUIRE( rig.relay.opened == 0 );
+        REQUIRE( rig.led.color == Color::Red );
+
+        rig.ldap.answerSearches = true;
+        rig.run(6000);
+        REQUIRE( rig.controller.ldapReady() );
+        REQUIRE( rig.ldap.connects == 2 );
+    }
+
+    SECTION( "refused search is not a denial" ) {
+        rig.ldap.refuseSearches = true;
+        rig.reader.present(badge(1));
+        rig.run(3000);
+        REQUIRE( rig.controller.stats().denies == 0 );
+        REQUIRE( rig.controller.stats().ldapErrors == 1 );
+
+        rig.ldap.refuseSearches = false;
+        rig.ldap.addMember(badge(1));
+        rig.reader.present(badge(1));
+        rig.run(6000);
+        REQUIRE( rig.relay.opened == 1 );
+    }
+
+    SECTION( "dropped session is reopened for the next swipe" ) {
+        REQUIRE( rig.controller.stats().reconnects == 0 );
+        rig.ldap.drop();
+        rig.run(100);
+        REQUIRE( !rig.controller.ldapReady() );
+
+        rig.ldap.addMember(badge(1));
+        rig.reader.present(badge(1));
+        rig.run(3000);
+        REQUIRE( rig.relay.opened == 1 );
+        REQUIRE( rig.ldap.connects == 2 );
+        REQUIRE( rig.controller.stats().reconnects == 1 );
+    }
+
+    SECTION( "silent session is found idle and reopened" ) {
+        auto keepAlive = Config().ldapKeepAlive;
+        rig.run(keepAlive + 1000);
+        REQUIRE( rig.ldap.whoAmIs == 1 );
+        REQUIRE( rig.controller.stats().keepAlives == 1 );
+        REQUIRE( rig.controller.ldapReady() );
+
+        // Dropped by a NAT on the way, the controller only learns it from the unanswered probe
+        // and reconnects without waiting for the backoff
+        rig.ldap.silent = true;
+        rig.run(keepAlive + Config().ldapTimeout);
+        REQUIRE( rig.ldap.whoAmIs == 2 );
+        REQUIRE( rig.controller.stats().timeouts == 1 );
+        REQUIRE( rig.ldap.connects == 2 );
+        REQUIRE( rig.controller.ldapReady() );
+
+        rig.ldap.addMember(badge(1));
+        rig.reader.present(badge(1));
+        rig.run(3000);
+        REQUIRE( rig.relay.opened == 1 );
+    }
+
+    SECTION( "bind rejected" ) {
+        rig.ldap.drop();
+        rig.ldap.acceptBind = false;
+        rig.run(6000);
+        REQUIRE( !rig.controller.ldapReady() );
+        REQUIRE( rig.controller.stats().ldapErrors >= 1 );
+    }
+}
+
+TEST_CASE( "Controller swipe latency", "[Controller][latency]" ) {
+    Rig rig;
+    rig.reader.readMicros = 5000;
+    rig.ldap.responseMicros = 30000;
+    rig.ldap.addMember(badge(1));
+    boot(rig);
+
+    latency().reset();
+    rig.reader.present(badge(1));
+    rig.run(3000);
+    REQUIRE( latency()[Latency::Phase::Swipe].count() == 1 );
+    REQUIRE( latency()[Latency::Phase::Swipe].max() == 5000 );
+
+    latency().reset();
+    rig.ldap.addMember(badge(2));
+    rig.reader.present(badge(2));
+    rig.run(3000);
+    auto &swipe = latency()[Latency::Phase::Swipe];
+    REQUIRE( swipe.count() == 1 );
+    REQUIRE( swipe.max() >= 35000 );
+    REQUIRE( swipe.max() <= 35000 + 2 * Rig::defaultConfig().busyPollInterval * 1000 );
+}
+
+TEST_CASE( "Controller serves several doors from one session", "[Controller][doors]" ) {
+    FakeClock clock;
+    FakeReader readers[] = {FakeReader(clock), FakeReader(clock)};
+    FakeRelay relays[2];
+    FakeLed leds[2];
+    FakeLdap ldap(clock);
+    FakeStore store;
+    const Door doors[] = {{readers[0], relays[0], leds[0]}, {readers[1], relays[1], leds[1]}};
+    Controller controller(Rig::defaultConfig(), clock, doors, 2, ldap, store);
+
+    ldap.addMember(badge(1));
+    ldap.responseMicros = 200000;
+    controller.begin();
+    for (int i = 0; i < 100; i++) {
+        clock.advanceMicros(controller.loop() * 1000 + 1);
+    }
+    REQUIRE( controller.members().size() == 1 );
+
+    auto runFor = [&](uint32_t ms) {
+        uint64_t end = clock.now + (uint64_t)ms * 1000;
+        while (clock.now < end) {
+            clock.advanceMicros(controller.loop() * 1000 + 1);
+        }
+    };
+
+    SECTION( "a mirror hit does not wait for another door's lookup" ) {
+        ldap.addMember(badge(2));
+        ldap.responseMicros = 500000;
+        readers[0].present(badge(2));
+        runFor(100);
+        readers[1].present(badge(1));
+        runFor(100);
+        REQUIRE( relays[1].opened == 1 );
+        REQUIRE( relays[0].opened == 0 );
+        runFor(3000);
+        REQUIRE( relays[0].opened == 1 );
+    }
+
+    SECTION( "lookups of both doors are in flight together" ) {
+        ldap.addMember(badge(2));
+        readers[0].present(badge(2));
+        readers[1].present(badge(3));
+        runFor(150);
+        REQUIRE( ldap.searches == 3 );
+        runFor(3000);
+        REQUIRE( relays[0].opened == 1 );
+        REQUIRE( relays[1].opened == 0 );
+        REQUIRE( controller.stats().denies == 1 );
+        REQUIRE( ldap.connects == 1 );
+    }
+}
+
+TEST_CASE( "Controller feedback runs alongside the next swipe", "[Controller][feedback]" ) {
+    Rig rig;
+    rig.ldap.responseMicros = 20000;
+    boot(rig);
+    REQUIRE( rig.led.color == Color::Red );
+    auto changes = rig.led.changes;
+    rig.run(10000);
+    REQUIRE( rig.led.changes == changes );
+
+    rig.ldap.addMember(badge(2));
+    rig.reader.present(badge(9));
+    rig.run(500);
+    REQUIRE( rig.controller.stats().denies == 1 );
+    auto searches = rig.ldap.searches;
+
+    // The deny blink is still going while the next badge is looked up and let in
+    rig.reader.present(badge(2));
+    rig.run(100);
+    REQUIRE( rig.ldap.searches == searches + 1 );
+    REQUIRE( rig.relay.open );
+    REQUIRE( rig.led.color == Color::Green );
+    rig.run(3000);
+    REQUIRE( !rig.relay.open );
+    REQUIRE( rig.led.color == Color::Red );
+}
+
+TEST_CASE( "Controller blinks while the network is down", "[Controller][feedback]" ) {
+    Rig rig;
+    rig.ldap.link = false;
+    rig.controller.begin();
+    rig.run(2000);
+    REQUIRE( rig.led.changes >= 4 );
+    REQUIRE( rig.led.changes <= 5 );
+
+    rig.ldap.link = true;
+    rig.run(1000);
+    REQUIRE( rig.led.color == Color::Red );
+    REQUIRE( rig.controller.ldapReady() );
+}
+
+TEST_CASE( "Controller prefers the fastest LDAP server and fails over", "[Controller][servers]" ) {
+    FakeClock clock;
+    FakeReader reader(clock);
+    FakeRelay relay;
+    FakeLed led;
+    FakeLdap slow(clock), fast(clock);
+    FakeStore store;
+    NetClient *const nets[] = {&slow, &fast};
+    const Door door = {reader, relay, led};
+    auto config = Rig::defaultConfig();
+    config.serverCount = 0;
+    config.addServer("slow.test");
+    config.addServer("fast.test");
+    config.memberSyncInterval = 0;
+    Controller controller(config, clock, &door, 1, nets, store);
+
+    slow.responseMicros = 50000;
+    fast.responseMicros = 5000;
+    for (uint8_t i = 1; i <= 8; i++) {
+        slow.addMember(badge(i));
+        fast.addMember(badge(i));
+    }
+    auto runFor = [&](uint32_t ms) {
+        uint64_t end = clock.now + (uint64_t)ms * 1000;
+        while (clock.now < end) {
+            clock.advanceMicros(controller.loop() * 1000 + 1);
+        }
+    };
+    controller.begin();
+    runFor(1000);
+    REQUIRE( slow.connects == 1 );
+    REQUIRE( fast.connects == 1 );
+
+    SECTION( "searches go to the fastest server once measured" ) {
+        for (uint8_t i = 1; i <= 4; i++) {
+            reader.present(badge(i));
+            runFor(3000);
+        }
+        REQUIRE( controller.stats().grants == 4 );
+        REQUIRE( slow.searches == 1 );
+        REQUIRE( fast.searches == 3 );
+    }
+
+    SECTION( "a slow search is hedged to the other server" ) {
+        slow.responseMicros = 2000000;
+        reader.present(badge(1));
+        runFor(400);
+        REQUIRE( relay.open );
+        REQUIRE( controller.stats().hedges == 1 );
+        REQUIRE( fast.searches == 1 );
+
+        // The losing search is abandoned and a root DSE read checks the server still answers
+        REQUIRE( controller.stats().abandons == 1 );
+        REQUIRE( slow.abandons == 1 );
+        REQUIRE( slow.searches == 2 );
+
+        // The late answer is ignored and the slow server is no longer first
+        runFor(3000);
+        reader.present(badge(2));
+        runFor(3000);
+        REQUIRE( controller.stats().grants == 2 );
+        REQUIRE( controller.stats().hedges == 1 );
+        REQUIRE( fast.searches == 2 );
+    }
+
+    SECTION( "a silent server is marked down and retried later" ) {
+        slow.answerSearches = false;
+        reader.present(badge(1));
+        runFor(400);
+        REQUIRE( relay.open );
+        REQUIRE( controller.stats().hedges == 1 );
+
+        // Given up on after the LDAP timeout, then reconnected after the backoff
+        runFor(config.ldapTimeout);
+        REQUIRE( controller.stats().timeouts == 1 );
+        REQUIRE( slow.unbinds == 1 );
+        REQUIRE( slow.connects == 1 );
+        runFor(config.ldapRetryMin + 1000);
+        REQUIRE( slow.connects == 2 );
+
+        // Measured as slow meanwhile, the next search goes straight to the other server
+        reader.present(badge(2));
+        runFor(3000);
+        REQUIRE( controller.stats().grants == 2 );
+        REQUIRE( controller.stats().hedges == 1 );
+        REQUIRE( fast.searches == 2 );
+    }
+
+    SECTION( "a late answer keeps the server up" ) {
+        slow.responseMicros = 1000000;
+        reader.present(badge(1));
+        runFor(3000);
+        reader.present(badge(2));
+        runFor(3000);
+        runFor(config.ldapTimeout * 2);
+        REQUIRE( controller.stats().grants == 2 );
+        REQUIRE( controller.stats().timeouts == 0 );
+        REQUIRE( controller.stats().abandons == 1 );
+        REQUIRE( slow.connects == 1 );
+    }
+}
+
+TEST_CASE( "Controller looks badges up over CLDAP", "[Controller][cldap]" ) {
+    FakeClock clock;
+    FakeReader reader(clock);
+    FakeRelay relay;
+    FakeLed led;
+    FakeLdap main(clock), backup(clock);
+    FakeStore store;
+    NetClient *const nets[] = {&main, &backup};
+    const Door door = {reader, relay, led};
+    auto config = Rig::defaultConfig();
+    config.addServer("backup.test");
+    config.memberSyncInterval = 0;
+    Controller controller(config, clock, &door, 1, nets, store);
+    FakeDatagrams udp(clock);
+    udp.responseMicros = 2000;
+    udp.addMember(badge(1));
+    controller.useCldap(udp);
+    auto runFor = [&](uint32_t ms) {
+        uint64_t end = clock.now + (uint64_t)ms * 1000;
+        while (clock.now < end) {
+            clock.advanceMicros(controller.loop() * 1000 + 1);
+        }
+    };
+    controller.begin();
+    runFor(1000);
+
+    SECTION( "one datagram per swipe and no session" ) {
+        reader.present(badge(1));
+        runFor(3000);
+        reader.present(badge(2));
+        runFor(3000);
+        REQUIRE( controller.stats().grants == 1 );
+        REQUIRE( controller.stats().denies == 1 );
+        REQUIRE( udp.hosts.size() == 2 );
+        REQUIRE( udp.port == 389 );
+        REQUIRE( main.connects == 0 );
+        REQUIRE( backup.connects == 0 );
+    }
+
+    SECTION( "a lost datagram is sent again to the next server" ) {
+        udp.lose = 1;
+        reader.present(badge(1));
+        runFor(3000);
+        REQUIRE( controller.stats().grants == 1 );
+        REQUIRE( controller.stats().retransmits == 1 );
+        REQUIRE( udp.hosts.size() == 2 );
+        REQUIRE( udp.hosts[0] != udp.hosts[1] );
+    }
+
+    SECTION( "forged answers are ignored" ) {
+        auto entry = [](uint8_t id) {
+            return LDAP::Response::encode(id, LDAP::Protocol::Type::SearchResultEntry,
+                                          BER::View::encode(0x04, "cn=member") + BER::View::encode(0x30, ""));
+        };
+        auto done = [](uint8_t id) {
+            return LDAP::Response::encode(id, LDAP::Protocol::Type::SearchResultDone,
+                                          LDAP::Result::encode(LDAP::Protocol::ResultCode::Success));
+        };
+        udp.responseMicros = 300000;
+        reader.present(badge(2));
+        runFor(100);
+        REQUIRE( udp.hosts.size() == 1 );
+        auto server = udp.peer(udp.hosts[0], 389);
+        auto otherPort = server;
+        otherPort.port = 3890;
+        for (uint32_t id = 1; id < 256; id++) {
+            udp.inject(udp.peer("attacker", 389), entry(id) + done(id));
+            udp.inject(otherPort, entry(id) + done(id));
+            // The entries don't add up with the real answer
+            udp.inject(server, entry(id));
+        }
+        runFor(1000);
+        REQUIRE( controller.stats().grants == 0 );
+        REQUIRE( controller.stats().denies == 1 );
+    }
+
+    SECTION( "nothing is decided without an answer" ) {
+        udp.lose = 100;
+        reader.present(badge(1));
+        runFor(config.ldapTimeout + 1000);
+        REQUIRE( controller.stats().timeouts == 1 );
+        REQUIRE( controller.stats().grants == 0 );
+        REQUIRE( controller.stats().denies == 0 );
+        REQUIRE( controller.stats().retransmits == config.ldapTimeout / config.cldapRetransmit );
+    }
+}
+
+TEST_CASE( "Controller schedules reader polls", "[Controller][reader]" ) {
+    Rig rig;
+    boot(rig);
+
+    SECTION( "polled readers speed up after a card and slow down when idle" ) {
+        auto checks = rig.reader.checks;
+        rig.run(1000);
+        REQUIRE( rig.reader.checks - checks <= 11 );
+
+        rig.reader.present(badge(9));
+        rig.run(1000);
+        checks = rig.reader.checks;
+        rig.run(1000);
+        REQUIRE( rig.reader.checks - checks >= 45 );
+
+        rig.run(20000);
+        checks = rig.reader.checks;
+        rig.run(1000);
+        REQUIRE( rig.reader.checks - checks <= 11 );
+        REQUIRE( rig.reader.requests == 0 );
+    }
+
+    SECTION( "IRQ readers request a card and only read once it answered" ) {
+        rig.reader.interrupt = true;
+        rig.run(1000);
+        auto requests = rig.reader.requests;
+        rig.run(1000);
+        REQUIRE( rig.reader.requests - requests >= 45 );
+        REQUIRE( rig.controller.stats().swipes == 0 );
+
+        auto start = rig.clock.now;
+        rig.reader.present(badge(9));
+        while (rig.controller.stats().swipes == 0) {
+            rig.run(1);
+        }
+        REQUIRE( rig.clock.now - start <= 2 * Rig::defaultConfig().readerRequestInterval * 1000 + 1000 );
+    }
+}
@@ -0,0 +1,87 @@
+// Host benchmark of the decision path: CPU cost per swipe with zero-latency fakes,
+// and the memory taken by the controller and the member mirror
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+
+#include "fakes.hpp"
+
+using namespace DoorLock;
+
+static Badge badge(uint32_t n)
+{
+    const uint8_t bytes[] = {0x04, (uint8_t)(n >> 16), (uint8_t)(n >> 8), (uint8_t)n};
+    return Badge(bytes, sizeof(bytes));
+}
+
+// Swipes badge(i % population) n times, returns the host time per swipe in ns
+static double swipes(const char *name, Rig &rig, uint32_t population, uint32_t n)
+{
+    auto start = std::chrono::steady_clock::now();
+    for (uint32_t i = 0; i < n; i++) {
+        auto before = rig.controller.stats().swipes;
+        rig.reader.present(badge(i % population));
+        // Leave the feedback, 2 s either way, and the repeat window behind
+        rig.clock.delay(2000 + Rig::defaultConfig().scanRepeatInterval);
+        while (rig.controller.stats().swipes == before || !rig.controller.idle()) {
+            rig.clock.advanceMicros(rig.controller.loop() * 1000 + 1);
+        }
+    }
+    auto elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+
+    auto &stats = rig.controller.stats();
+    double perSwipe = (double)elapsed / n;
+    printf("%-20s %6u swipes %10.0f ns/swipe %10.0f swipes/s (grants %u, denies %u, lookups %u)\n",
+           name, (unsigned)n, perSwipe, 1e9 / perSwipe,
+           (unsigned)stats.grants, (unsigned)stats.denies, (unsigned)stats.cacheMisses);
+    return perSwipe;
+}
+
+int main()
+{
+    const uint32_t members = 2000;
+    const uint32_t n = 20000;
+
+    // The fake clock runs for hours, keep the cache and the sync schedule out of the way
+    auto config = Rig::defaultConfig();
+    config.negativeCacheTtl = UINT32_MAX;
+    config.memberSyncInterval = UINT32_MAX;
+
+    {
+        Rig rig(config);
+        for (uint32_t i = 0; i < members; i++) {
+            rig.ldap.addMember(badge(i));
+        }
+        rig.controller.begin();
+        rig.run(1000);
+        swipes("mirror hit", rig, members, n);
+    }
+    {
+        Rig rig(config);
+        rig.controller.begin();
+        rig.run(1000);
+        swipes("negative cache hit", rig, 1, n);
+    }
+    {
+        // Members added after the sync are only known online
+        Rig rig(config);
+        rig.controller.begin();
+        rig.run(1000);
+        for (uint32_t i = 0; i < members; i++) {
+            rig.ldap.addMember(badge(i));
+        }
+        swipes("online lookup", rig, members, n);
+    }
+
+    MemberTable table;
+    for (uint32_t i = 0; i < members; i++) {
+        table.add(badge(i));
+    }
+    table.seal();
+    printf("sizeof(Controller) %u bytes, mirror of %u members %u bytes in RAM, %u bytes serialized\n",
+           (unsigned)sizeof(Controller), (unsigned)members,
+           (unsigned)(sizeof(MemberTable) + table.size() * sizeof(Badge)),
+           (unsigned)table.serialize().size());
+    return 0;
+}
@@ -0,0 +1,399 @@
+// Host stand-ins for the devices of doorlock/hal.hpp
+
+#ifndef DOORLOCK_TESTS_FAKES_HPP
+#define DOORLOCK_TESTS_FAKES_HPP
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <string>
+#include <vector>
+
+#include "../../ptldap/ptldap.hpp"
+#include "../../ptldap/server/directory.hpp"
+#include "../controller.hpp"
+#include "../hal.hpp"
+
+namespace DoorLock
+{
+    // Time only moves when the test or the controller asks it to
+    class FakeClock : public Clock
+    {
+    public:
+        uint64_t now = 0; // us
+
+        uint32_t millis() override { return (uint32_t)(this->now / 1000); }
+        uint32_t micros() override { return (uint32_t)this->now; }
+        void delay(uint32_t ms) override { this->now += (uint64_t)ms * 1000; }
+        void advanceMicros(uint32_t us) { this->now += us; }
+    };
+
+    // Polled, or with an IRQ line that answers requestCard() when a card is there
+    class FakeReader : public CardReader
+    {
+        FakeClock &clock;
+        std::deque<Badge> cards;
+        bool signalled = false;
+
+    public:
+        uint32_t readMicros = 0; // Cost of reading a UID
+        bool interrupt = false;
+        uint32_t checks = 0;   // cardPresent() calls
+        uint32_t requests = 0; // requestCard() calls
+
+        explicit FakeReader(FakeClock &clock) : clock(clock) {}
+
+        void present(const Badge &badge) { this->cards.push_back(badge); }
+        bool cardPresent() override
+        {
+            this->checks++;
+            if (!this->interrupt) {
+                return !this->cards.empty();
+            }
+            bool signalled = this->signalled;
+            this->signalled = false;
+            return signalled;
+        }
+        bool interruptDriven() const override { return this->interrupt; }
+        void requestCard() override
+        {
+            this->requests++;
+            this->signalled = !this->cards.empty();
+        }
+        bool readCard(Badge &badge) override
+        {
+            if (this->cards.empty()) {
+                return false;
+            }
+            this->clock.advanceMicros(this->readMicros);
+            badge = this->cards.front();
+            this->cards.pop_front();
+            return true;
+        }
+    };
+
+    class FakeRelay : public Relay
+    {
+    public:
+        bool open = false;
+        uint32_t opened = 0;
+
+        void set(bool open) override
+        {
+            if (open && !this->open) {
+                this->opened++;
+            }
+            this->open = open;
+        }
+    };
+
+    class FakeLed : public Led
+    {
+    public:
+        Color color = Color::Black;
+        uint32_t changes = 0;
+
+        void set(Color color) override
+        {
+            this->color = color;
+            this->changes++;
+        }
+    };
+
+    class FakeStore : public BlobStore
+    {
+    public:
+        std::string data;
+        bool present = false;
+        bool failWrites = false;
+        uint32_t saves = 0;
+
+        bool load(std::string &data) override
+        {
+            data = this->data;
+            return this->present;
+        }
+        bool save(nonstd::string_view data) override
+        {
+            if (this->failWrites) {
+                return false;
+            }
+            this->data.assign(data.data(), data.size());
+            this->present = true;
+            this->saves++;
+            return true;
+        }
+    };
+
+    // LDAP::Directory behind a socket that answers after a configurable delay
+    class FakeLdap : public NetClient
+    {
+        struct Pending
+        {
+            uint64_t readyAt;
+            std::string data;
+        };
+
+        FakeClock &clock;
+        bool isConnected = false;
+        std::string inbox;
+        std::deque<Pending> outbox;
+
+    public:
+        LDAP::Directory directory;
+        bool link = true;
+        bool acceptConnections = true;
+        bool acceptBind = true;
+        bool answerSearches = true;
+        bool refuseSearches = false; // Answered with busy
+        // Takes every request and answers none until the next connect, like a session a NAT dropped
+        bool silent = false;
+        uint32_t connectMicros = 0;
+        uint32_t responseMicros = 0;
+        uint32_t connects = 0;
+        uint32_t binds = 0;
+        uint32_t searches = 0;
+        uint32_t abandons = 0;
+        uint32_t unbinds = 0;
+        uint32_t whoAmIs = 0;
+
+        explicit FakeLdap(FakeClock &clock) : clock(clock) {}
+
+        void addMember(const Badge &badge, std::vector<std::string> groups = {})
+        {
+            this->directory.add(std::string((const char *)badge.bytes, badge.size), "member", "ou=Members", std::move(groups));
+        }
+        void drop()
+        {
+            this->isConnected = false;
+            this->outbox.clear();
+        }
+
+        bool linkUp() override { return this->link; }
+        bool connect(const char *, uint16_t) override
+        {
+            this->clock.advanceMicros(this->connectMicros);
+            this->connects++;
+            this->silent = false;
+            this->isConnected = this->acceptConnections;
+            return this->isConnected;
+        }
+        bool connected() override { return this->isConnected; }
+        int available() override
+        {
+            if (!this->isConnected || this->outbox.empty() || this->outbox.front().readyAt > this->clock.now) {
+                return 0;
+            }
+            return (int)this->outbox.front().data.size();
+        }
+        int read(uint8_t *buf, size_t size) override
+        {
+            int len = this->available();
+            if (len <= 0) {
+                return 0;
+            }
+            auto &front = this->outbox.front().data;
+            size_t count = size < front.size() ? size : front.size();
+            memcpy(buf, front.data(), count);
+            front.erase(0, count);
+            if (front.empty()) {
+                this->outbox.pop_front();
+            }
+            return (int)count;
+        }
+        size_t write(const uint8_t *buf, size_t size) override
+        {
+            if (!this->isConnected) {
+                return 0;
+            }
+            this->inbox.append((const char *)buf, size);
+            while (true) {
+                auto request = LDAP::Response::parse(this->inbox);
+                if (!request.valid()) {
+                    break;
+                }
+                this->handle(request);
+                this->inbox.erase(0, request.size);
+            }
+            return size;
+        }
+        void stop() override
+        {
+            this->isConnected = false;
+            this->inbox.clear();
+            this->outbox.clear();
+        }
+
+    private:
+        // Answers not read yet to an abandoned request are never sent
+        void forget(uint32_t id)
+        {
+            for (auto pending = this->outbox.begin(); pending != this->outbox.end();) {
+                auto answer = LDAP::Response::parse(pending->data);
+                if (answer.valid() && answer.id == id) {
+                    pending = this->outbox.erase(pending);
+                } else {
+                    ++pending;
+                }
+            }
+        }
+
+        void handle(const LDAP::Response &request)
+        {
+            switch (request.type) {
+                case LDAP::Protocol::Type::BindRequest:
+                    this->binds++;
+                    if (!this->acceptBind) {
+                        this->respond(LDAP::Directory::refuse(request, LDAP::Protocol::ResultCode::InvalidCredentials));
+                        return;
+                    }
+                    break;
+                case LDAP::Protocol::Type::SearchRequest:
+                    this->searches++;
+                    if (!this->answerSearches) {
+                        return;
+                    }
+                    if (this->refuseSearches) {
+                        this->respond(LDAP::Directory::refuse(request, LDAP::Protocol::ResultCode::Busy));
+                        return;
+                    }
+                    break;
+                case LDAP::Protocol::Type::AbandonRequest:
+                    this->abandons++;
+                    this->forget(BER::View(0x02, request.op, request.op.size()).integer());
+                    return;
+                case LDAP::Protocol::Type::UnbindRequest:
+                    this->unbinds++;
+                    break;
+                case LDAP::Protocol::Type::ExtendedRequest:
+                    this->whoAmIs++;
+                    break;
+                default:
+                    break;
+            }
+            bool close;
+            this->respond(this->directory.handle(request, close));
+        }
+
+        void respond(const std::string &data)
+        {
+            if (!data.empty() && !this->silent) {
+                this->outbox.push_back(Pending{this->clock.now + this->responseMicros, data});
+            }
+        }
+    };
+
+    // Stand-in CLDAP responder for every host, answers from its directory. Each host name gets its own address.
+    class FakeDatagrams : public DatagramClient
+    {
+        struct Pending
+        {
+            uint64_t readyAt;
+            Peer from;
+            std::string data;
+        };
+
+        FakeClock &clock;
+        std::deque<Pending> inbox;
+        std::vector<std::string> known;
+
+    public:
+        LDAP::Directory directory;
+        uint32_t responseMicros = 0;
+        uint32_t lose = 0; // Requests dropped before any is answered
+        std::vector<std::string> hosts; // Of each request sent
+        uint16_t port = 0;
+
+        explicit FakeDatagrams(FakeClock &clock) : clock(clock) {}
+
+        void addMember(const Badge &badge)
+        {
+            this->directory.add(std::string((const char *)badge.bytes, badge.size), "member", "ou=Members");
+        }
+
+        Peer peer(const std::string &host, uint16_t port)
+        {
+            size_t index = std::find(this->known.begin(), this->known.end(), host) - this->known.begin();
+            if (index == this->known.size()) {
+                this->known.push_back(host);
+            }
+            Peer peer;
+            peer.address = 0x0a000001 + (uint32_t)index;
+            peer.port = port;
+            return peer;
+        }
+
+        // A datagram from anyone, read right away
+        void inject(const Peer &from, std::string data)
+        {
+            this->inbox.push_back(Pending{this->clock.now, from, std::move(data)});
+        }
+
+        bool send(const char *host, uint16_t port, const uint8_t *buf, size_t size, Peer &to) override
+        {
+            this->hosts.push_back(host);
+            this->port = port;
+            to = this->peer(host, port);
+            if (this->lose != 0) {
+                this->lose--;
+                return true;
+            }
+            auto answer = this->directory.datagram(std::string((const char *)buf, size));
+            if (!answer.empty()) {
+                this->inbox.push_back(Pending{this->clock.now + this->responseMicros, to, answer});
+            }
+            return true;
+        }
+        // Datagrams overtake those still on their way
+        int receive(uint8_t *buf, size_t size, Peer &from) override
+        {
+            auto ready = std::find_if(this->inbox.begin(), this->inbox.end(),
+                                      [this](const Pending &pending) { return pending.readyAt <= this->clock.now; });
+            if (ready == this->inbox.end()) {
+                return 0;
+            }
+            size_t count = size < ready->data.size() ? size : ready->data.size();
+            memcpy(buf, ready->data.data(), count);
+            from = ready->from;
+            this->inbox.erase(ready);
+            return (int)count;
+        }
+    };
+
+    struct Rig
+    {
+        FakeClock clock;
+        FakeReader reader;
+        FakeRelay relay;
+        FakeLed led;
+        FakeLdap ldap;
+        FakeStore store;
+        Controller controller;
+
+        static Config defaultConfig()
+        {
+            Config config;
+            config.addServer("ldap.test");
+            config.login = "cn=door";
+            config.password = "secret";
+            config.memberGroup = "ou=Members";
+            return config;
+        }
+
+        explicit Rig(const Config &config = defaultConfig())
+        : reader(clock), ldap(clock), controller(config, clock, reader, relay, led, ldap, store) {}
+
+        // Runs the main loop for ms of fake time, sleeping as the controller asks
+        void run(uint32_t ms)
+        {
+            uint64_t end = this->clock.now + (uint64_t)ms * 1000;
+            while (this->clock.now < end) {
+                uint32_t sleep = this->controller.loop();
+                this->clock.advanceMicros(sleep == 0 ? 1 : sleep * 1000);
+            }
+        }
+    };
+}
+
+#endif //DOORLOCK_TESTS_FAKES_HPP
@@ -0,0 +1,201 @@
+// End-to-end soak of the controller against a real LDAP server over TCP, usually
+// ptldap/server's ldap_server: swipes as fast as the controller decides and prints
+// the swipe latency percentiles and the error counters
+
+#include <chrono>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <thread>
+
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "fakes.hpp"
+
+using namespace DoorLock;
+
+// Wall clock, except that the feedback delays are skipped
+class SoakClock : public Clock
+{
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    uint64_t skipped = 0; // us
+
+    uint64_t now()
+    {
+        auto elapsed = std::chrono::steady_clock::now() - this->start;
+        return std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count() + this->skipped;
+    }
+
+public:
+    uint32_t millis() override { return (uint32_t)(this->now() / 1000); }
+    uint32_t micros() override { return (uint32_t)this->now(); }
+    void delay(uint32_t ms) override { this->skipped += (uint64_t)ms * 1000; }
+};
+
+class SoakReader : public CardReader
+{
+    std::deque<Badge> cards;
+
+public:
+    void present(const Badge &badge) { this->cards.push_back(badge); }
+    bool cardPresent() override { return !this->cards.empty(); }
+    bool readCard(Badge &badge) override
+    {
+        badge = this->cards.front();
+        this->cards.pop_front();
+        return true;
+    }
+};
+
+// Plain TCP, the board uses TLS
+class PosixNetClient : public NetClient
+{
+    int fd = -1;
+    bool open = false;
+
+public:
+    ~PosixNetClient() override { this->stop(); }
+
+    bool connect(const char *host, uint16_t port) override
+    {
+        this->stop();
+        addrinfo hints = {}, *result = nullptr;
+        hints.ai_socktype = SOCK_STREAM;
+        if (getaddrinfo(host, std::to_string(port).c_str(), &hints, &result) != 0) {
+            return false;
+        }
+        for (auto ai = result; ai && this->fd < 0; ai = ai->ai_next) {
+            this->fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+            if (this->fd >= 0 && ::connect(this->fd, ai->ai_addr, ai->ai_addrlen) < 0) {
+                close(this->fd);
+                this->fd = -1;
+            }
+        }
+        freeaddrinfo(result);
+        if (this->fd < 0) {
+            return false;
+        }
+        int yes = 1;
+        setsockopt(this->fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+        this->open = true;
+        return true;
+    }
+
+    bool connected() override
+    {
+        if (this->open && this->available() == 0) {
+            // A closed peer reads as 0 bytes without blocking
+            char probe;
+            ssize_t len = recv(this->fd, &probe, 1, MSG_PEEK | MSG_DONTWAIT);
+            this->open = len != 0 && (len > 0 || errno == EAGAIN || errno == EWOULDBLOCK);
+        }
+        return this->open;
+    }
+
+    int available() override
+    {
+        int count = 0;
+        if (this->fd < 0 || ioctl(this->fd, FIONREAD, &count) < 0) {
+            return 0;
+        }
+        return count;
+    }
+
+    int read(uint8_t *buf, size_t size) override { return (int)recv(this->fd, buf, size, MSG_DONTWAIT); }
+
+    size_t write(const uint8_t *buf, size_t size) override
+    {
+        ssize_t len = send(this->fd, buf, size, MSG_NOSIGNAL);
+        return len < 0 ? 0 : (size_t)len;
+    }
+
+    void stop() override
+    {
+        if (this->fd >= 0) {
+            close(this->fd);
+        }
+        this->fd = -1;
+        this->open = false;
+    }
+};
+
+// Same badges as ldap_server --generate
+static Badge badge(uint32_t n)
+{
+    const uint8_t bytes[] = {0x04, (uint8_t)(n >> 16), (uint8_t)(n >> 8), (uint8_t)n};
+    return Badge(bytes, sizeof(bytes));
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 3) {
+        fprintf(stderr, "usage: %s HOST PORT [SWIPES] [MEMBERS] [--mirror]\n"
+                        "  swipes badges 0..MEMBERS*5/4 of ldap_server --generate MEMBERS, a fifth are unknown\n", argv[0]);
+        return 2;
+    }
+    uint32_t swipes = argc > 3 ? (uint32_t)atoi(argv[3]) : 1000;
+    uint32_t members = argc > 4 ? (uint32_t)atoi(argv[4]) : 100;
+    bool mirror = argc > 5 && strcmp(argv[5], "--mirror") == 0;
+
+    SoakClock clock;
+    SoakReader reader;
+    FakeRelay relay;
+    FakeLed led;
+    PosixNetClient net;
+    FakeStore store;
+
+    auto config = Rig::defaultConfig();
+    config.serverCount = 0;
+    config.addServer(argv[1], (uint16_t)atoi(argv[2]));
+    config.memberGroup = "ou=Members,dc=example,dc=org";
+    // Every swipe goes online unless the mirror is asked for
+    config.memberSyncInterval = mirror ? config.memberSyncInterval : 0;
+    config.negativeCacheTtl = mirror ? config.negativeCacheTtl : 1;
+    config.ldapRetryMin = 100;
+    config.ldapRetryMax = 1000;
+    config.idlePollInterval = 1;
+    config.busyPollInterval = 1;
+    Controller controller(config, clock, reader, relay, led, net, store);
+
+    controller.begin();
+    // Connected, and synced when the mirror is used, before the clock starts
+    auto warmup = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+    while (!controller.ldapReady() || (mirror && controller.members().size() < members)) {
+        if (std::chrono::steady_clock::now() > warmup) {
+            fprintf(stderr, "server not ready after 10 s, going on\n");
+            break;
+        }
+        controller.loop();
+        std::this_thread::sleep_for(std::chrono::microseconds(100));
+    }
+    auto start = std::chrono::steady_clock::now();
+    latency().reset();
+    for (uint32_t i = 0; i < swipes; i++) {
+        auto before = controller.stats().swipes;
+        reader.present(badge(i % (members + members / 4)));
+        while (controller.stats().swipes == before || !controller.idle()) {
+            uint32_t sleep = controller.loop();
+            if (sleep != 0) {
+                std::this_thread::sleep_for(std::chrono::microseconds(100));
+            }
+        }
+    }
+    auto seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    auto &stats = controller.stats();
+    auto &swipe = latency()[Latency::Phase::Swipe];
+    printf("%u swipes in %.2f s, %.0f swipes/s\n", (unsigned)stats.swipes, seconds, stats.swipes / seconds);
+    printf("swipe latency (us): p50 %u, p95 %u, p99 %u, max %u\n",
+           (unsigned)swipe.percentile(50), (unsigned)swipe.percentile(95),
+           (unsigned)swipe.percentile(99), (unsigned)swipe.max());
+    printf("grants %u, denies %u, lookups %u, ldap errors %u, timeouts %u, reconnects %u\n",
+           (unsigned)stats.grants, (unsigned)stats.denies, (unsigned)stats.cacheMisses,
+           (unsigned)stats.ldapErrors, (unsigned)stats.timeouts, (unsigned)stats.reconnects);
+    return 0;
+}
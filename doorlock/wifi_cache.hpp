@@ -0,0 +1,75 @@
+// Last good WiFi association, kept in flash so the next boot skips the channel scan and optionally DHCP
+
+#ifndef DOORLOCK_WIFI_CACHE_HPP
+#define DOORLOCK_WIFI_CACHE_HPP
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+#include "../ptldap/string_view.hpp"
+#include "bytes.hpp"
+
+namespace DoorLock
+{
+    // Serialized layout (little endian):
+    //   magic (4) | version (1) | bssid (6) | channel (1) | ip (4) | gateway (4) | mask (4) | dns (4)
+    struct WifiCache
+    {
+        static const uint32_t Magic = 0x57574c44; // "DLWW"
+        static const uint8_t Version = 1;
+        static const size_t Size = 28;
+
+        uint8_t bssid[6] = {};
+        uint8_t channel = 0;
+        // IPv4 addresses as lwIP stores them, 0 when unknown
+        uint32_t ip = 0;
+        uint32_t gateway = 0;
+        uint32_t mask = 0;
+        uint32_t dns = 0;
+
+        bool hasAddress() const { return this->ip != 0 && this->mask != 0; }
+
+        std::string serialize() const
+        {
+            std::string data;
+            data.reserve(Size);
+            appendU32(data, Magic);
+            data += (char)Version;
+            data.append((const char *)this->bssid, sizeof(this->bssid));
+            data += (char)this->channel;
+            appendU32(data, this->ip);
+            appendU32(data, this->gateway);
+            appendU32(data, this->mask);
+            appendU32(data, this->dns);
+            return data;
+        }
+
+        bool deserialize(nonstd::string_view data)
+        {
+            size_t offset = 0;
+            if (data.size() != Size || readU32(data, offset) != Magic || (uint8_t)data[offset++] != Version) {
+                return false;
+            }
+            memcpy(this->bssid, data.data() + offset, sizeof(this->bssid));
+            offset += sizeof(this->bssid);
+            this->channel = data[offset++];
+            this->ip = readU32(data, offset);
+            this->gateway = readU32(data, offset);
+            this->mask = readU32(data, offset);
+            this->dns = readU32(data, offset);
+            // Channels 1 to 14 only
+            return this->channel >= 1 && this->channel <= 14;
+        }
+
+        bool operator==(const WifiCache &other) const
+        {
+            return memcmp(this->bssid, other.bssid, sizeof(this->bssid)) == 0 && this->channel == other.channel &&
+                   this->ip == other.ip && this->gateway == other.gateway && this->mask == other.mask &&
+                   this->dns == other.dns;
+        }
+        bool operator!=(const WifiCache &other) const { return !(*this == other); }
+    };
+}
+
+#endif //DOORLOCK_WIFI_CACHE_HPP
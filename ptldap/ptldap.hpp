@@ -1,5 +1,8 @@
 // For more inspiration, see https://github.com/wireshark/wireshark/blob/master/epan/dissectors/packet-ldap.c
 
+#ifndef PTLDAP_HPP
+#define PTLDAP_HPP
+
 #include <string>
 #include <type_traits>
 #include <utility>
@@ -8,6 +11,7 @@
 #include <memory>
 #include <iostream>
 #include <cstring>
+#include <cctype>
 
 #include "string_view.hpp"
 using namespace nonstd::literals;
@@ -25,7 +29,9 @@ namespace BER
         String = 0x04,
         Enum = 0x0a,
 
+        Sequence = 0x30,
         Attribute = 0x30,
+        Set = 0x31,
 
         // Authentications
         SimpleAuth = 0x80,
@@ -52,12 +58,102 @@ namespace BER
         DnAttributes,
     };
 
+    enum class Substring
+    {
+        Initial = 0x80,
+        Any,
+        Final,
+    };
+
+    // Zero-copy view over one encoded element, used to decode what the server sends back.
+    // encode() writes the tag and length in front of a value for every element.
+    class View
+    {
+    public:
+        uint8_t tag = 0;
+        string_view value;
+        size_t size = 0; // Tag, length and value, 0 when the data is incomplete or invalid
+
+        View() = default;
+        View(uint8_t tag, string_view value, size_t size) : tag(tag), value(value), size(size) {}
+        bool valid() const { return this->size != 0; }
+        bool is(Type type) const { return this->tag == static_cast<uint8_t>(type); }
+        uint32_t integer() const
+        {
+            uint32_t result = 0;
+            for (auto ch : this->value) {
+                result = (result << 8) | (uint8_t)ch;
+            }
+            return result;
+        }
+        static View parse(string_view data)
+        {
+            if (data.size() < 2) {
+                return View();
+            }
+
+            size_t offset = 0;
+            uint8_t tag = data[offset++];
+            size_t length = (uint8_t)data[offset++];
+
+            // Long form, the low bits are the number of length bytes that follow
+            if (length & 0x80) {
+                size_t count = length & 0x7f;
+                if (count == 0 || count > 4 || data.size() < offset + count) {
+                    return View();
+                }
+                length = 0;
+                for (size_t i = 0; i < count; i++) {
+                    length = (length << 8) | (uint8_t)data[offset++];
+                }
+            }
+
+            if (data.size() - offset < length) {
+                return View();
+            }
+            return View(tag, data.substr(offset, length), offset + length);
+        }
+        // Inverse of parse(), uses the long form for lengths of 128 and more
+        static string encode(uint8_t tag, string_view value)
+        {
+            string out = header(tag, value.size());
+            out.append(value.data(), value.size());
+            return out;
+        }
+        // Tag and length of a value of length bytes
+        static string header(uint8_t tag, size_t length)
+        {
+            string out(1, (char)tag);
+            if (length < 0x80) {
+                out += (char)length;
+                return out;
+            }
+            string bytes;
+            for (; length != 0; length >>= 8) {
+                bytes.insert(bytes.begin(), (char)(length & 0xff));
+            }
+            out += (char)(0x80 | bytes.size());
+            out += bytes;
+            return out;
+        }
+        // Encoded size of an element with a value of length bytes
+        static size_t encodedSize(size_t length)
+        {
+            size_t size = 2 + length;
+            for (size_t rest = length; length >= 0x80 && rest != 0; rest >>= 8) {
+                size++;
+            }
+            return size;
+        }
+    };
+
 
     class Element
     {
     public:
         Type type;
         explicit Element(Type type) : type(type) {}
+        virtual ~Element() = default;
         string str()
         {
             ostringstream oss;
@@ -65,6 +161,15 @@ namespace BER
             return oss.str();
         }
         virtual ostringstream &append(ostringstream &oss) = 0;
+        // Encoded size, the filters compute theirs so a parent writes its length and then appends them in place
+        virtual size_t size() { return this->str().size(); }
+
+    protected:
+        static void primitive(ostringstream &oss, uint8_t tag, string_view value)
+        {
+            oss << View::header(tag, value.size());
+            oss.write(value.data(), value.size());
+        }
     };
 
     class Bool : public Element
@@ -103,16 +208,18 @@ namespace BER
         explicit Integer(uint32_t value, Type type = Type::Integer) : Element(type), value(value) {}
         ostringstream &append(ostringstream &oss) final
         {
+            // Two's complement, so values with the high bit set need a leading zero byte
+            uint64_t wide = this->value;
             uint8_t size = 1;
-            if (value != 0) {
-                size = (int)log2(value - 1) / 8 + 1;
+            while ((wide >> (size * 8 - 1)) != 0) {
+                size++;
             }
 
             oss << (char)this->type;
             oss << (char)size;
             for(size_t i = 0; i < size; i++) {
                 auto shift = ((size-1-i)*8);
-                uint8_t byte = (value >> shift) & 0xff;
+                uint8_t byte = (wide >> shift) & 0xff;
                 oss << (uint8_t)byte;
             }
             return oss;
@@ -173,9 +280,7 @@ namespace BER
         explicit String(string value, Type type = Type::String) : Element(type), value(std::move(value)) {}
         ostringstream &append(ostringstream &oss) final
         {
-            oss << (char)this->type;
-            oss << (char)value.length();
-            oss << this->value;
+            oss << View::encode((uint8_t)this->type, this->value);
             return oss;
         }
         static pair<String*, size_t> parse(string_view data)
@@ -220,53 +325,279 @@ namespace BER
         }
     };
 
+    // The Filter choices (RFC 4511 4.5.1.7) below take ownership of the filters they are given and are
+    // appended straight into the stream of their parent, without encoding anything twice.
+
+    // [attribute][:dn][:matchingRule]:=value, the attribute or the matching rule may be left out
+    class ExtensibleMatch : public Element
+    {
+    protected:
+        string attribute;
+        string value;
+        string matchingRule;
+        bool dnAttributes;
+
+        size_t length() const
+        {
+            return (this->matchingRule.empty() ? 0 : View::encodedSize(this->matchingRule.size())) +
+                   (this->attribute.empty() ? 0 : View::encodedSize(this->attribute.size())) +
+                   View::encodedSize(this->value.size()) + (this->dnAttributes ? View::encodedSize(1) : 0);
+        }
+
+    public:
+        explicit ExtensibleMatch(string attribute, string value, string matchingRule = "", bool dnAttributes = false)
+        : Element(Type::ExtensibleMatch), attribute(std::move(attribute)), value(std::move(value)),
+          matchingRule(std::move(matchingRule)), dnAttributes(dnAttributes) {}
+        size_t size() final { return View::encodedSize(this->length()); }
+        ostringstream &append(ostringstream &oss) final
+        {
+            oss << View::header((uint8_t)this->type, this->length());
+            if (!this->matchingRule.empty()) {
+                primitive(oss, (uint8_t)MatchingRuleAssertion::MatchingRule, this->matchingRule);
+            }
+            if (!this->attribute.empty()) {
+                primitive(oss, (uint8_t)MatchingRuleAssertion::Type, this->attribute);
+            }
+            primitive(oss, (uint8_t)MatchingRuleAssertion::MatchValue, this->value);
+            if (this->dnAttributes) {
+                primitive(oss, (uint8_t)MatchingRuleAssertion::DnAttributes, "\xff");
+            }
+            return oss;
+        }
+    };
+
     // This implementation is inexact, only support simple extensibleMatch
-    class Filter : public Element
+    class Filter : public ExtensibleMatch
+    {
+    public:
+        explicit Filter(uint8_t filterTypeLen, const char *filterType, uint8_t matchValueLen, const char *matchValue)
+        : ExtensibleMatch(string(filterType, filterTypeLen), string(matchValue, matchValueLen)) {}
+        explicit Filter(string filterType, string matchValue) : ExtensibleMatch(std::move(filterType), std::move(matchValue)) {}
+    };
+
+    // attribute=value, as the server's equality index sees it. With Type::Attribute it is the bare
+    // AttributeValueAssertion of a CompareRequest.
+    class EqualityMatch : public Element
     {
     protected:
-        string filterType;
-        string matchValue;
+        string attribute;
+        string value;
+
+        size_t length() const { return View::encodedSize(this->attribute.size()) + View::encodedSize(this->value.size()); }
 
     public:
-        explicit Filter(uint8_t filterTypeLen, const char *filterType, uint8_t matchValueLen, const char *matchValue, Type type = Type::ExtensibleMatch) : Element(type),
-                                                                                                                                                           filterType(string(filterType, filterTypeLen)),
-                                                                                                                                                           matchValue(string(matchValue, matchValueLen)) {}
-        explicit Filter(string filterType, string matchValue, Type type = Type::ExtensibleMatch) : Element(type), filterType(std::move(filterType)), matchValue(std::move(matchValue)) {}
+        explicit EqualityMatch(string attribute, string value, Type type = Type::EqualityMatch) : Element(type),
+                                                                                                 attribute(std::move(attribute)),
+                                                                                                 value(std::move(value)) {}
+        size_t size() final { return View::encodedSize(this->length()); }
         ostringstream &append(ostringstream &oss) final
         {
-            auto _filterType = String(this->filterType, static_cast<Type>(MatchingRuleAssertion::Type));
-            auto _matchValue = String(this->matchValue, static_cast<Type>(MatchingRuleAssertion::MatchValue));
-            auto extensibleMatchLength = _filterType.str().length() + _matchValue.str().length();
+            // AttributeValueAssertion
+            oss << View::header((uint8_t)this->type, this->length());
+            primitive(oss, (uint8_t)Type::String, this->attribute);
+            primitive(oss, (uint8_t)Type::String, this->value);
+            return oss;
+        }
+    };
 
-            oss << (char)this->type;
-            oss << (char)extensibleMatchLength;
-            oss << _filterType.str();
-            oss << _matchValue.str();
+    // attribute>=value in the ordering of the attribute, e.g. a validity date
+    class GreaterOrEqual : public EqualityMatch
+    {
+    public:
+        explicit GreaterOrEqual(string attribute, string value)
+        : EqualityMatch(std::move(attribute), std::move(value), Type::GreaterOrEqual) {}
+    };
+
+    class LessOrEqual : public EqualityMatch
+    {
+    public:
+        explicit LessOrEqual(string attribute, string value)
+        : EqualityMatch(std::move(attribute), std::move(value), Type::LessOrEqual) {}
+    };
+
+    // attribute~=value, what approximately means is up to the server
+    class ApproxMatch : public EqualityMatch
+    {
+    public:
+        explicit ApproxMatch(string attribute, string value)
+        : EqualityMatch(std::move(attribute), std::move(value), Type::ApproxMatch) {}
+    };
+
+    // attribute=initial*any*final, the parts are added in that order and at least one is needed
+    class Substrings : public Element
+    {
+    protected:
+        string attribute;
+        vector<pair<Substring, string>> parts;
+
+        size_t partsLength() const
+        {
+            size_t length = 0;
+            for (auto &part : this->parts) {
+                length += View::encodedSize(part.second.size());
+            }
+            return length;
+        }
+        size_t length() const { return View::encodedSize(this->attribute.size()) + View::encodedSize(this->partsLength()); }
+
+    public:
+        explicit Substrings(string attribute) : Element(Type::Substrings), attribute(std::move(attribute)) {}
+        Substrings &initial(string value) { return this->add(Substring::Initial, std::move(value)); }
+        Substrings &any(string value) { return this->add(Substring::Any, std::move(value)); }
+        Substrings &final(string value) { return this->add(Substring::Final, std::move(value)); }
+        size_t size() final { return View::encodedSize(this->length()); }
+        ostringstream &append(ostringstream &oss) final
+        {
+            oss << View::header((uint8_t)this->type, this->length());
+            primitive(oss, (uint8_t)Type::String, this->attribute);
+            oss << View::header((uint8_t)Type::Sequence, this->partsLength());
+            for (auto &part : this->parts) {
+                primitive(oss, (uint8_t)part.first, part.second);
+            }
             return oss;
         }
+
+    private:
+        Substrings &add(Substring type, string value)
+        {
+            this->parts.emplace_back(type, std::move(value));
+            return *this;
+        }
     };
 
-    // This implementation is inexact
+    // SET OF Filter, base of And and Or
+    class FilterSet : public Element
+    {
+    protected:
+        vector<unique_ptr<Element>> filters;
+
+        explicit FilterSet(Type type) : Element(type) {}
+        size_t length()
+        {
+            size_t length = 0;
+            for (auto &filter : this->filters) {
+                length += filter->size();
+            }
+            return length;
+        }
+
+    public:
+        FilterSet &add(Element *filter)
+        {
+            this->filters.emplace_back(filter);
+            return *this;
+        }
+        size_t size() final { return View::encodedSize(this->length()); }
+        ostringstream &append(ostringstream &oss) final
+        {
+            oss << View::header((uint8_t)this->type, this->length());
+            for (auto &filter : this->filters) {
+                filter->append(oss);
+            }
+            return oss;
+        }
+    };
+
+    // Matches when every one of its filters does, true without any (RFC 4526)
+    class And : public FilterSet
+    {
+    public:
+        And() : FilterSet(Type::And) {}
+    };
+
+    // Matches when any of its filters does, false without any
+    class Or : public FilterSet
+    {
+    public:
+        Or() : FilterSet(Type::Or) {}
+    };
+
+    class Not : public Element
+    {
+    protected:
+        unique_ptr<Element> filter;
+
+    public:
+        explicit Not(Element *filter) : Element(Type::Not), filter(filter) {}
+        size_t size() final { return View::encodedSize(this->filter->size()); }
+        ostringstream &append(ostringstream &oss) final
+        {
+            oss << View::header((uint8_t)this->type, this->filter->size());
+            return this->filter->append(oss);
+        }
+    };
+
+    class Present : public Element
+    {
+    protected:
+        string attribute;
+
+    public:
+        // Unlike the other filter choices, present is a primitive element
+        explicit Present(string attribute) : Element(static_cast<Type>(static_cast<uint8_t>(Type::Present) & ~0x20)),
+                                             attribute(std::move(attribute)) {}
+        size_t size() final { return View::encodedSize(this->attribute.size()); }
+        ostringstream &append(ostringstream &oss) final
+        {
+            primitive(oss, (uint8_t)this->type, this->attribute);
+            return oss;
+        }
+    };
+
+    // Attribute description list, empty asks for every user attribute
     class Attribute : public Element
     {
     protected:
-        string value;
+        vector<string> values;
 
     public:
         explicit Attribute(uint8_t attributeLen, const char *attribute) : Element(Type::Attribute),
-                                                                          value(string(attribute, attributeLen)) {}
-        explicit Attribute(string value) : Element(Type::Attribute), value(value) {}
+                                                                          values{string(attribute, attributeLen)} {}
+        explicit Attribute(string value) : Element(Type::Attribute), values{std::move(value)} {}
+        explicit Attribute(vector<string> values) : Element(Type::Attribute), values(std::move(values)) {}
         ostringstream &append(ostringstream &oss) final
         {
-            auto attribute = String(this->value);
+            string attributes;
+            for (auto &value : this->values) {
+                attributes += String(value).str();
+            }
+            oss << View::encode((uint8_t)this->type, attributes);
+            return oss;
+        }
+    };
 
-            oss << (char)this->type;
-            oss << (char)attribute.str().length();
-            oss << attribute.str();
+    // Contents already encoded, for the ops that are a bare primitive value or a rendered filter template
+    class Raw : public Element
+    {
+    protected:
+        string data;
+
+    public:
+        explicit Raw(string data) : Element(Type::String), data(std::move(data)) {}
+        ostringstream &append(ostringstream &oss) final
+        {
+            oss << this->data;
             return oss;
         }
     };
 
+    // Walks the elements of a constructed value one after the other
+    class Reader
+    {
+        string_view data;
+        size_t offset = 0;
+
+    public:
+        explicit Reader(string_view data) : data(data) {}
+        bool done() const { return this->offset >= this->data.size(); }
+        View next()
+        {
+            auto view = View::parse(this->data.substr(this->offset));
+            this->offset = view.valid() ? this->offset + view.size : this->data.size();
+            return view;
+        }
+    };
+
     class ElementBuilder
     {
     public:
@@ -308,31 +639,49 @@ namespace BER
 namespace LDAP
 {
     const uint8_t Header = 0x30;
+    // Attribute list of a search that only wants to know which entries match (RFC 4511 4.5.1.8)
+    const char *const NoAttributes = "1.1";
+    // Simple Paged Results control (RFC 2696)
+    const char *const PagedResultsOid = "1.2.840.113556.1.4.319";
+    // Connectionless LDAP (RFC 1798, LDAPv3 messages as Active Directory still answers them): a SearchRequest
+    // alone in a UDP datagram, without a bind, answered by its entries and SearchResultDone in one datagram
+    const uint16_t CldapPort = 389;
+    // Tag of the optional Controls after the protocolOp of a LDAPMessage
+    const uint8_t ControlsTag = 0xa0;
+    // Content Synchronization (RFC 4533) controls and intermediate response
+    const char *const SyncRequestOid = "1.3.6.1.4.1.4203.1.9.1.1";
+    const char *const SyncStateOid = "1.3.6.1.4.1.4203.1.9.1.2";
+    const char *const SyncDoneOid = "1.3.6.1.4.1.4203.1.9.1.3";
+    const char *const SyncInfoOid = "1.3.6.1.4.1.4203.1.9.1.4";
+    // "Who am I?" extended operation (RFC 4532)
+    const char *const WhoAmIOid = "1.3.6.1.4.1.4203.1.11.3";
 
     namespace Protocol
     {
+        // [APPLICATION n] tags, the ones with a simple type are primitive
         enum class Type : uint8_t
         {
             BindRequest = 0x60,
-            BindResponse,
-            UnbindRequest,
-            SearchRequest,
-            SearchResultEntry,
-            SearchResultDone,
-            SearchResultReference,
-            ModifyRequest,
-            ModifyResponse,
-            AddRequest,
-            AddResponse,
-            DelRequest,
-            DelResponse,
-            ModifyDNRequest,
-            ModifyDNResponse,
-            CompareRequest,
-            CompareResponse,
-            AbandonRequest,
-            ExtendedRequest,
-            ExtendedResponse,
+            BindResponse = 0x61,
+            UnbindRequest = 0x42,
+            SearchRequest = 0x63,
+            SearchResultEntry = 0x64,
+            SearchResultDone = 0x65,
+            SearchResultReference = 0x73,
+            ModifyRequest = 0x66,
+            ModifyResponse = 0x67,
+            AddRequest = 0x68,
+            AddResponse = 0x69,
+            DelRequest = 0x4a,
+            DelResponse = 0x6b,
+            ModifyDNRequest = 0x6c,
+            ModifyDNResponse = 0x6d,
+            CompareRequest = 0x6e,
+            CompareResponse = 0x6f,
+            AbandonRequest = 0x50,
+            ExtendedRequest = 0x77,
+            ExtendedResponse = 0x78,
+            IntermediateResponse = 0x79,
         };
 
         enum class ResultCode : uint8_t
@@ -400,6 +749,43 @@ namespace LDAP
             };
         }
 
+        // Context tags of the fields of ExtendedRequest and ExtendedResponse
+        enum class Extended : uint8_t
+        {
+            RequestName = 0x80,
+            RequestValue = 0x81,
+            ResponseName = 0x8a,
+            ResponseValue = 0x8b
+        };
+
+        // LDAP Content Synchronization (RFC 4533)
+        namespace Sync
+        {
+            enum class Mode : uint8_t
+            {
+                RefreshOnly = 1,
+                RefreshAndPersist = 3
+            };
+
+            // syncState of an entry
+            enum class State : uint8_t
+            {
+                Present,
+                Add,
+                Modify,
+                Delete
+            };
+
+            // Choice of a syncInfo message, as its context tag
+            enum class Info : uint8_t
+            {
+                NewCookie = 0x80,
+                RefreshDelete = 0xa1,
+                RefreshPresent = 0xa2,
+                SyncIdSet = 0xa3
+            };
+        }
+
         enum class FilterType
         {
             And = 0xa0,      // SET SIZE (1..MAX) OF filter Filter,
@@ -435,11 +821,7 @@ namespace LDAP
             {
                 element->append(inside);
             }
-            ostringstream oss;
-            oss << (char)this->type;
-            oss << (char)inside.str().length();
-            oss << inside.str();
-            return oss.str();
+            return BER::View::encode((uint8_t)this->type, inside.str());
         }
         static pair<Op*, size_t> parse(string_view data) {
             size_t offset = 0;
@@ -461,23 +843,20 @@ namespace LDAP
     {
         uint8_t id;
         Op *op;
+        string controls; // Encoded Control elements
 
     public:
         Msg(uint8_t id, Op *op) : id(id), op(op) {}
+        uint8_t messageId() const { return this->id; }
+        void addControl(const string &control) { this->controls += control; }
         string str()
         {
             auto _id = BER::Integer(this->id).str();
             auto _op = this->op->str();
-            uint8_t msgSize = _id.length() + _op.length();
-
-            ostringstream oss;
-            oss << Header;
-            oss << msgSize;
-
-            oss << _id;
-
-            oss << _op;
-            return oss.str();
+            if (!this->controls.empty()) {
+                _op += BER::View::encode(ControlsTag, this->controls);
+            }
+            return BER::View::encode(Header, _id + _op);
         }
     };
 
@@ -491,7 +870,14 @@ namespace LDAP
         #endif
 
         MsgBuilder() = default;
-        static unique_ptr<Msg> build(Op *op) { return std::unique_ptr<Msg>(new Msg(id++, op)); }
+        static unique_ptr<Msg> build(Op *op)
+        {
+            // Message ID 0 is reserved for unsolicited notifications
+            if (id == 0) {
+                id++;
+            }
+            return std::unique_ptr<Msg>(new Msg(id++, op));
+        }
         static void reset_id() { id = 1; }
     };
 
@@ -504,6 +890,9 @@ namespace LDAP
 
     public:
         string str() { return this->msg->str(); }
+        uint8_t messageId() const { return this->msg->messageId(); }
+        // Sent after the protocolOp, see Control::encode()
+        void addControl(const string &control) { this->msg->addControl(control); }
     };
 
     class BindRequest : public BaseMsg
@@ -550,6 +939,73 @@ namespace LDAP
         }
     };
 
+    // Ends the session, the server closes the connection without answering
+    class UnbindRequest : public BaseMsg
+    {
+    public:
+        UnbindRequest() : BaseMsg(Protocol::Type::UnbindRequest) {}
+    };
+
+    // Asks the server to drop an operation still in progress, nothing is answered
+    class AbandonRequest : public BaseMsg
+    {
+        BER::Raw messageId;
+    public:
+        // The op is the bare MessageID, not a whole INTEGER element
+        explicit AbandonRequest(uint8_t id)
+        : BaseMsg(Protocol::Type::AbandonRequest),
+          messageId(BER::Raw(BER::Integer(id).str().substr(2)))
+        {
+            this->op.addElement(&this->messageId);
+        }
+    };
+
+    // Whether entry holds attribute=value, the server only answers compareTrue or compareFalse
+    class CompareRequest : public BaseMsg
+    {
+        BER::String entry;
+        BER::EqualityMatch ava;
+    public:
+        CompareRequest(string entry, string attribute, string value)
+        : BaseMsg(Protocol::Type::CompareRequest),
+          entry(BER::String(std::move(entry))),
+          ava(BER::EqualityMatch(std::move(attribute), std::move(value), BER::Type::Attribute))
+        {
+            this->op.addElement(&this->entry)
+                .addElement(&this->ava);
+        }
+    };
+
+    // Extended operation named by its OID, with an optional value (RFC 4511 4.12)
+    class ExtendedRequest : public BaseMsg
+    {
+        BER::String name;
+        BER::String value;
+    public:
+        explicit ExtendedRequest(string name)
+        : BaseMsg(Protocol::Type::ExtendedRequest),
+          name(BER::String(std::move(name), static_cast<BER::Type>(Protocol::Extended::RequestName))),
+          value(BER::String("", static_cast<BER::Type>(Protocol::Extended::RequestValue)))
+        {
+            this->op.addElement(&this->name);
+        }
+        ExtendedRequest(string name, string value)
+        : BaseMsg(Protocol::Type::ExtendedRequest),
+          name(BER::String(std::move(name), static_cast<BER::Type>(Protocol::Extended::RequestName))),
+          value(BER::String(std::move(value), static_cast<BER::Type>(Protocol::Extended::RequestValue)))
+        {
+            this->op.addElement(&this->name)
+                .addElement(&this->value);
+        }
+    };
+
+    // Answered with the authorization identity of the session, cheap enough to check an idle session is still there
+    class WhoAmIRequest : public ExtendedRequest
+    {
+    public:
+        WhoAmIRequest() : ExtendedRequest(WhoAmIOid) {}
+    };
+
 //     class BindResponse : public BaseMsg
 //     {
 //     public:
@@ -569,6 +1025,310 @@ namespace LDAP
 //         }
 //     };
 
+    // RFC 4515 string filter compiled once to BER, values may hold {n} placeholders filled in by render().
+    // Parameters are copied as they are, never parsed, so they cannot change the shape of the filter.
+    // Everything that does not hold a placeholder is encoded by parse(), render() copies it and only
+    // encodes the lengths around the parameters.
+    class FilterTemplate
+    {
+        struct Part
+        {
+            enum class Kind : uint8_t { Bytes, Parameter, Open, Close };
+            Kind kind;
+            uint8_t tag; // Close
+            uint8_t index; // Parameter
+            string bytes;
+        };
+
+        vector<Part> parts;
+        vector<size_t> opens; // Parts of the constructed elements being parsed
+        uint8_t count = 0;
+
+    public:
+        // The compiled filter and whether text is a valid filter
+        static pair<FilterTemplate, bool> parse(string_view text)
+        {
+            FilterTemplate compiled;
+            size_t offset = 0;
+            bool valid = compiled.filter(text, offset) && offset == text.size();
+            return pair<FilterTemplate, bool>(std::move(compiled), valid);
+        }
+
+        // Highest placeholder plus one
+        uint8_t parameters() const { return this->count; }
+
+        // Missing values are empty
+        string render(const vector<string_view> &values = {}) const
+        {
+            vector<string> nested(1);
+            for (auto &part : this->parts) {
+                switch (part.kind) {
+                    case Part::Kind::Bytes:
+                        nested.back() += part.bytes;
+                        break;
+                    case Part::Kind::Parameter:
+                        if (part.index < values.size()) {
+                            nested.back().append(values[part.index].data(), values[part.index].size());
+                        }
+                        break;
+                    case Part::Kind::Open:
+                        nested.emplace_back();
+                        break;
+                    case Part::Kind::Close: {
+                        auto inside = std::move(nested.back());
+                        nested.pop_back();
+                        nested.back() += BER::View::encode(part.tag, inside);
+                        break;
+                    }
+                }
+            }
+            return nested.front();
+        }
+
+    private:
+        static uint8_t tag(BER::Type type) { return static_cast<uint8_t>(type); }
+        static uint8_t tag(BER::MatchingRuleAssertion type) { return static_cast<uint8_t>(type); }
+        static uint8_t tag(BER::Substring type) { return static_cast<uint8_t>(type); }
+
+        void bytes(string data)
+        {
+            if (!this->parts.empty() && this->parts.back().kind == Part::Kind::Bytes) {
+                this->parts.back().bytes += data;
+            } else {
+                this->parts.push_back(Part{Part::Kind::Bytes, 0, 0, std::move(data)});
+            }
+        }
+        void open()
+        {
+            this->opens.push_back(this->parts.size());
+            this->parts.push_back(Part{Part::Kind::Open, 0, 0, ""});
+        }
+        void close(uint8_t tag)
+        {
+            auto start = this->opens.back();
+            this->opens.pop_back();
+            // Adjacent bytes are merged, so a single part left means nothing inside depends on a parameter
+            if (this->parts.size() > start + 2 || (this->parts.size() == start + 2 && this->parts.back().kind != Part::Kind::Bytes)) {
+                this->parts.push_back(Part{Part::Kind::Close, tag, 0, ""});
+                return;
+            }
+            string inside = this->parts.size() == start + 2 ? std::move(this->parts.back().bytes) : "";
+            this->parts.resize(start);
+            this->bytes(BER::View::encode(tag, inside));
+        }
+
+        static bool next(string_view text, size_t offset, char ch) { return offset < text.size() && text[offset] == ch; }
+
+        // filter = "(" filtercomp ")"
+        bool filter(string_view text, size_t &offset)
+        {
+            if (!next(text, offset++, '(') || offset >= text.size()) {
+                return false;
+            }
+            switch (text[offset]) {
+                case '&':
+                case '|': {
+                    auto type = text[offset++] == '&' ? BER::Type::And : BER::Type::Or;
+                    this->open();
+                    while (next(text, offset, '(')) {
+                        if (!this->filter(text, offset)) {
+                            return false;
+                        }
+                    }
+                    this->close(tag(type));
+                    break;
+                }
+                case '!':
+                    offset++;
+                    this->open();
+                    if (!this->filter(text, offset)) {
+                        return false;
+                    }
+                    this->close(tag(BER::Type::Not));
+                    break;
+                default:
+                    if (!this->item(text, offset)) {
+                        return false;
+                    }
+            }
+            return next(text, offset++, ')');
+        }
+
+        static string_view token(string_view text, size_t &offset)
+        {
+            size_t start = offset;
+            while (offset < text.size() && (isalnum((uint8_t)text[offset]) || strchr("-.;", text[offset]))) {
+                offset++;
+            }
+            return text.substr(start, offset - start);
+        }
+
+        // simple, present, substring or extensible item
+        bool item(string_view text, size_t &offset)
+        {
+            auto attribute = token(text, offset);
+            if (next(text, offset, ':')) {
+                return this->extensible(text, offset, attribute);
+            }
+            if (attribute.empty() || offset + 1 >= text.size()) {
+                return false;
+            }
+
+            auto type = BER::Type::EqualityMatch;
+            switch (text[offset]) {
+                case '~': type = BER::Type::ApproxMatch; break;
+                case '>': type = BER::Type::GreaterOrEqual; break;
+                case '<': type = BER::Type::LessOrEqual; break;
+                case '=': break;
+                default: return false;
+            }
+            if (type != BER::Type::EqualityMatch && text[++offset] != '=') {
+                return false;
+            }
+            offset++;
+
+            // Substrings hold an unescaped *
+            bool star = false;
+            for (size_t i = offset; i < text.size() && text[i] != ')'; i++) {
+                star |= text[i] == '*';
+                i += text[i] == '\\';
+            }
+            if (type == BER::Type::EqualityMatch && star) {
+                return this->substrings(text, offset, attribute);
+            }
+
+            this->open();
+            this->bytes(BER::View::encode(tag(BER::Type::String), attribute));
+            if (!this->value(text, offset, tag(BER::Type::String))) {
+                return false;
+            }
+            this->close(tag(type));
+            return true;
+        }
+
+        // attr "=*", or attr "=" [initial] *("*" any) "*" [final]
+        bool substrings(string_view text, size_t &offset, string_view attribute)
+        {
+            if (text.substr(offset, 2) == "*)") {
+                offset++;
+                // Primitive, unlike the other filter choices
+                this->bytes(BER::View::encode(tag(BER::Type::Present) & ~0x20, attribute));
+                return true;
+            }
+
+            this->open();
+            this->bytes(BER::View::encode(tag(BER::Type::String), attribute));
+            this->open();
+            bool first = true;
+            uint8_t pieces = 0;
+            while (true) {
+                if (!next(text, offset, '*') && !next(text, offset, ')')) {
+                    size_t end = offset;
+                    while (end < text.size() && text[end] != '*' && text[end] != ')') {
+                        end += text[end] == '\\' ? 3 : 1;
+                    }
+                    auto type = first ? BER::Substring::Initial : next(text, end, ')') ? BER::Substring::Final : BER::Substring::Any;
+                    if (!this->value(text, offset, tag(type))) {
+                        return false;
+                    }
+                    pieces++;
+                }
+                first = false;
+                if (!next(text, offset, '*')) {
+                    break;
+                }
+                offset++;
+            }
+            if (pieces == 0) {
+                return false;
+            }
+            this->close(tag(BER::Type::Sequence));
+            this->close(tag(BER::Type::Substrings));
+            return true;
+        }
+
+        // [attr] [":dn"] [":" matchingrule] ":=" assertionvalue, with the attribute or the rule
+        bool extensible(string_view text, size_t &offset, string_view attribute)
+        {
+            bool dn = false;
+            string_view rule;
+            while (next(text, offset, ':') && !next(text, offset + 1, '=')) {
+                offset++;
+                auto name = token(text, offset);
+                bool isDn = name.size() == 2 && tolower(name[0]) == 'd' && tolower(name[1]) == 'n';
+                if (isDn && !dn && rule.empty()) {
+                    dn = true;
+                } else if (!name.empty() && rule.empty()) {
+                    rule = name;
+                } else {
+                    return false;
+                }
+            }
+            if (text.substr(offset, 2) != ":=" || (attribute.empty() && rule.empty())) {
+                return false;
+            }
+            offset += 2;
+
+            this->open();
+            if (!rule.empty()) {
+                this->bytes(BER::View::encode(tag(BER::MatchingRuleAssertion::MatchingRule), rule));
+            }
+            if (!attribute.empty()) {
+                this->bytes(BER::View::encode(tag(BER::MatchingRuleAssertion::Type), attribute));
+            }
+            if (!this->value(text, offset, tag(BER::MatchingRuleAssertion::MatchValue))) {
+                return false;
+            }
+            if (dn) {
+                this->bytes(BER::View::encode(tag(BER::MatchingRuleAssertion::DnAttributes), "\xff"));
+            }
+            this->close(tag(BER::Type::ExtensibleMatch));
+            return true;
+        }
+
+        // Assertion value up to the next unescaped * or ), with \XX escapes and {n} placeholders
+        bool value(string_view text, size_t &offset, uint8_t tag)
+        {
+            this->open();
+            string literal;
+            while (offset < text.size() && text[offset] != '*' && text[offset] != ')') {
+                char ch = text[offset];
+                if (ch == '(' || ch == '\0') {
+                    return false;
+                }
+                if (ch == '\\') {
+                    if (offset + 2 >= text.size() || !isxdigit((uint8_t)text[offset + 1]) || !isxdigit((uint8_t)text[offset + 2])) {
+                        return false;
+                    }
+                    literal += (char)strtoul(string(text.substr(offset + 1, 2)).c_str(), nullptr, 16);
+                    offset += 3;
+                    continue;
+                }
+                size_t digits = offset + 1;
+                while (digits < text.size() && isdigit((uint8_t)text[digits])) {
+                    digits++;
+                }
+                if (ch == '{' && digits > offset + 1 && digits - offset <= 4 && next(text, digits, '}')) {
+                    auto index = strtoul(string(text.substr(offset + 1, digits - offset - 1)).c_str(), nullptr, 10);
+                    if (index > 0xff) {
+                        return false;
+                    }
+                    this->bytes(std::move(literal));
+                    literal.clear();
+                    this->parts.push_back(Part{Part::Kind::Parameter, 0, (uint8_t)index, ""});
+                    this->count = index + 1 > this->count ? index + 1 : this->count;
+                    offset = digits + 1;
+                    continue;
+                }
+                literal += ch;
+                offset++;
+            }
+            this->bytes(std::move(literal));
+            this->close(tag);
+            return true;
+        }
+    };
+
     class SearchRequest : public BaseMsg
     {
         BER::String baseObject;
@@ -577,8 +1337,8 @@ namespace LDAP
         BER::Integer sizeLimit;
         BER::Integer timeLimit;
         BER::Bool typesOnly;
-        BER::Filter filter;
-        BER::Attribute attribute;
+        unique_ptr<BER::Element> filter;
+        BER::Attribute attributes;
     public:
         SearchRequest(string baseObject,
                       string filterType,
@@ -587,6 +1347,32 @@ namespace LDAP
                       Protocol::SearchRequest::Scope scope = Protocol::SearchRequest::Scope::SingleLevel,
                       Protocol::SearchRequest::DerefAliases derefAliases = Protocol::SearchRequest::DerefAliases::NeverDerefAliases,
                       bool typesOnly = false)
+        : SearchRequest(std::move(baseObject),
+                        new BER::Filter(std::move(filterType), std::move(filterValue)),
+                        std::move(attribute),
+                        scope,
+                        derefAliases,
+                        typesOnly) {}
+        // Takes ownership of the filter
+        SearchRequest(string baseObject,
+                      BER::Element *filter,
+                      string attribute,
+                      Protocol::SearchRequest::Scope scope = Protocol::SearchRequest::Scope::SingleLevel,
+                      Protocol::SearchRequest::DerefAliases derefAliases = Protocol::SearchRequest::DerefAliases::NeverDerefAliases,
+                      bool typesOnly = false)
+        : SearchRequest(std::move(baseObject),
+                        filter,
+                        vector<string>{std::move(attribute)},
+                        scope,
+                        derefAliases,
+                        typesOnly) {}
+        // Takes ownership of the filter. No attributes returns all user attributes, NoAttributes none.
+        SearchRequest(string baseObject,
+                      BER::Element *filter,
+                      vector<string> attributes,
+                      Protocol::SearchRequest::Scope scope = Protocol::SearchRequest::Scope::SingleLevel,
+                      Protocol::SearchRequest::DerefAliases derefAliases = Protocol::SearchRequest::DerefAliases::NeverDerefAliases,
+                      bool typesOnly = false)
         : BaseMsg(Protocol::Type::SearchRequest),
           baseObject(BER::String(std::move(baseObject))),
           scope(BER::Enum<Protocol::SearchRequest::Scope>(scope)),
@@ -594,8 +1380,8 @@ namespace LDAP
           sizeLimit(BER::Integer(0)),
           timeLimit(BER::Integer(0)),
           typesOnly(BER::Bool(typesOnly)),
-          filter(BER::Filter(std::move(filterType), std::move(filterValue))),
-          attribute(BER::Attribute(std::move(attribute)))
+          filter(filter),
+          attributes(BER::Attribute(std::move(attributes)))
         {
             this->op
                 .addElement(&this->baseObject)
@@ -604,8 +1390,16 @@ namespace LDAP
                 .addElement(&this->sizeLimit)
                 .addElement(&this->timeLimit)
                 .addElement(&this->typesOnly)
-                .addElement(&this->filter)
-                .addElement(&this->attribute);
+                .addElement(this->filter.get())
+                .addElement(&this->attributes);
+        }
+
+        // At most sizeLimit entries and timeLimit seconds of server work, 0 leaves it to the server
+        SearchRequest &limit(uint32_t sizeLimit, uint32_t timeLimit = 0)
+        {
+            this->sizeLimit.value = sizeLimit;
+            this->timeLimit.value = timeLimit;
+            return *this;
         }
 
 //        static SearchRequest parse(string msg) {
@@ -613,4 +1407,515 @@ namespace LDAP
 //
 //        }
     };
-}
\ No newline at end of file
+
+    // One LDAPMessage received from the server, the payload is a view into the receive buffer
+    class Response
+    {
+    public:
+        uint32_t id = 0;
+        Protocol::Type type = Protocol::Type::BindResponse;
+        string_view op;       // Contents of the protocolOp
+        string_view controls; // Contents of the optional [0] Controls
+        size_t size = 0;      // Whole message, 0 while it is not fully received
+
+        bool valid() const { return this->size != 0; }
+        static Response parse(string_view data)
+        {
+            Response response;
+            auto msg = BER::View::parse(data);
+            if (!msg.valid() || msg.tag != Header) {
+                return response;
+            }
+
+            BER::Reader reader(msg.value);
+            auto id = reader.next();
+            auto op = reader.next();
+            if (!id.is(BER::Type::Integer) || !op.valid()) {
+                return response;
+            }
+            if (!reader.done()) {
+                auto controls = reader.next();
+                if (controls.tag == ControlsTag) {
+                    response.controls = controls.value;
+                }
+            }
+
+            response.id = id.integer();
+            response.type = static_cast<Protocol::Type>(op.tag);
+            response.op = op.value;
+            response.size = msg.size;
+            return response;
+        }
+        // Server side, wraps the contents of a protocolOp and the encoded controls into a LDAPMessage
+        static string encode(uint32_t id, Protocol::Type type, string_view op, string_view controls = "")
+        {
+            auto message = BER::Integer(id).str() + BER::View::encode(static_cast<uint8_t>(type), op);
+            if (!controls.empty()) {
+                message += BER::View::encode(ControlsTag, controls);
+            }
+            return BER::View::encode(Header, message);
+        }
+    };
+
+    // One Control of a message, the value is a view into the message
+    class Control
+    {
+    public:
+        string_view type; // LDAPOID
+        bool critical = false;
+        string_view value; // Contents of the controlValue, empty when absent
+
+        // First control of type in the contents of a Controls, like Response::controls
+        static pair<Control, bool> find(string_view controls, string_view type)
+        {
+            Control control;
+            BER::Reader reader(controls);
+            while (!reader.done()) {
+                auto element = reader.next();
+                BER::Reader fields(element.value);
+                auto oid = fields.next();
+                if (!element.is(BER::Type::Attribute) || !oid.is(BER::Type::String) || oid.value != type) {
+                    continue;
+                }
+                control.type = oid.value;
+                while (!fields.done()) {
+                    auto field = fields.next();
+                    if (field.is(BER::Type::Bool)) {
+                        control.critical = field.integer() != 0;
+                    } else if (field.is(BER::Type::String)) {
+                        control.value = field.value;
+                    }
+                }
+                return pair<Control, bool>(control, true);
+            }
+            return pair<Control, bool>(control, false);
+        }
+        static string encode(string_view type, string_view value, bool critical = false)
+        {
+            string control = BER::View::encode(static_cast<uint8_t>(BER::Type::String), type);
+            if (critical) {
+                control += BER::Bool(true).str();
+            }
+            control += BER::View::encode(static_cast<uint8_t>(BER::Type::String), value);
+            return BER::View::encode(static_cast<uint8_t>(BER::Type::Attribute), control);
+        }
+    };
+
+    // Simple Paged Results (RFC 2696): the server sends size entries per SearchResultDone, whose cookie is
+    // sent back with the same search for the next page. An empty cookie ends the search.
+    class PagedResults
+    {
+    public:
+        uint32_t size = 0; // Page size asked, or the server's estimate of the total in a response
+        string_view cookie;
+
+        // From the contents of the controls of a message
+        static pair<PagedResults, bool> parse(string_view controls)
+        {
+            PagedResults paged;
+            auto control = Control::find(controls, PagedResultsOid);
+            auto value = BER::View::parse(control.first.value);
+            BER::Reader reader(value.value);
+            auto size = reader.next();
+            auto cookie = reader.next();
+            if (!control.second || !value.is(BER::Type::Attribute) || !size.is(BER::Type::Integer) || !cookie.is(BER::Type::String)) {
+                return pair<PagedResults, bool>(paged, false);
+            }
+            paged.size = size.integer();
+            paged.cookie = cookie.value;
+            return pair<PagedResults, bool>(paged, true);
+        }
+        // The whole control, for addControl() or Response::encode()
+        static string encode(uint32_t size, string_view cookie)
+        {
+            auto value = BER::View::encode(static_cast<uint8_t>(BER::Type::Attribute),
+                                           BER::Integer(size).str() + BER::View::encode(static_cast<uint8_t>(BER::Type::String), cookie));
+            return Control::encode(PagedResultsOid, value);
+        }
+    };
+
+    // Content Synchronization helpers shared by the sync messages below
+    class SyncValue
+    {
+    public:
+        static string cookie(bool present, string_view cookie)
+        {
+            return present ? BER::View::encode(static_cast<uint8_t>(BER::Type::String), cookie) : string();
+        }
+        // Optional cookie then optional flag, in the contents of a SEQUENCE
+        static bool parse(string_view data, bool &hasCookie, string_view &cookie, bool &flag)
+        {
+            BER::Reader reader(data);
+            while (!reader.done()) {
+                auto field = reader.next();
+                if (field.is(BER::Type::String)) {
+                    hasCookie = true;
+                    cookie = field.value;
+                } else if (field.is(BER::Type::Bool)) {
+                    flag = field.integer() != 0;
+                } else if (!field.valid() || field.is(BER::Type::Set)) {
+                    return field.valid();
+                }
+            }
+            return true;
+        }
+    };
+
+    // syncRequest control, sent with the SearchRequest to start a content synchronization
+    class SyncRequest
+    {
+    public:
+        Protocol::Sync::Mode mode = Protocol::Sync::Mode::RefreshOnly;
+        bool hasCookie = false;
+        string_view cookie;
+        bool reloadHint = false;
+
+        // From the contents of the controls of a message
+        static pair<SyncRequest, bool> parse(string_view controls)
+        {
+            SyncRequest request;
+            auto control = Control::find(controls, SyncRequestOid);
+            auto value = BER::View::parse(control.first.value);
+            BER::Reader reader(value.value);
+            auto mode = reader.next();
+            if (!control.second || !value.is(BER::Type::Attribute) || !mode.is(BER::Type::Enum) ||
+                !SyncValue::parse(value.value.substr(mode.size), request.hasCookie, request.cookie, request.reloadHint)) {
+                return pair<SyncRequest, bool>(request, false);
+            }
+            request.mode = static_cast<Protocol::Sync::Mode>(mode.integer());
+            return pair<SyncRequest, bool>(request, true);
+        }
+        // The whole control, critical as the server must not answer a plain search instead
+        static string encode(Protocol::Sync::Mode mode, bool hasCookie = false, string_view cookie = "", bool reloadHint = false)
+        {
+            auto value = BER::Enum<Protocol::Sync::Mode>(mode).str() + SyncValue::cookie(hasCookie, cookie);
+            if (reloadHint) {
+                value += BER::Bool(true).str();
+            }
+            return Control::encode(SyncRequestOid, BER::View::encode(static_cast<uint8_t>(BER::Type::Attribute), value), true);
+        }
+    };
+
+    // syncState control of a SearchResultEntry, a delete only carries the DN and the entryUUID
+    class SyncState
+    {
+    public:
+        Protocol::Sync::State state = Protocol::Sync::State::Present;
+        string_view entryUUID;
+        bool hasCookie = false;
+        string_view cookie;
+
+        static pair<SyncState, bool> parse(string_view controls)
+        {
+            SyncState sync;
+            auto control = Control::find(controls, SyncStateOid);
+            auto value = BER::View::parse(control.first.value);
+            BER::Reader reader(value.value);
+            auto state = reader.next();
+            auto uuid = reader.next();
+            auto cookie = reader.next();
+            if (!control.second || !value.is(BER::Type::Attribute) || !state.is(BER::Type::Enum) || !uuid.is(BER::Type::String)) {
+                return pair<SyncState, bool>(sync, false);
+            }
+            sync.state = static_cast<Protocol::Sync::State>(state.integer());
+            sync.entryUUID = uuid.value;
+            if (cookie.is(BER::Type::String)) {
+                sync.hasCookie = true;
+                sync.cookie = cookie.value;
+            }
+            return pair<SyncState, bool>(sync, true);
+        }
+        static string encode(Protocol::Sync::State state, string_view entryUUID, bool hasCookie = false, string_view cookie = "")
+        {
+            auto value = BER::Enum<Protocol::Sync::State>(state).str() +
+                         BER::View::encode(static_cast<uint8_t>(BER::Type::String), entryUUID) +
+                         SyncValue::cookie(hasCookie, cookie);
+            return Control::encode(SyncStateOid, BER::View::encode(static_cast<uint8_t>(BER::Type::Attribute), value));
+        }
+    };
+
+    // syncDone control of the SearchResultDone ending a refresh
+    class SyncDone
+    {
+    public:
+        bool hasCookie = false;
+        string_view cookie;
+        bool refreshDeletes = false; // Entries missing from the refresh were deleted, else they are all present
+
+        static pair<SyncDone, bool> parse(string_view controls)
+        {
+            SyncDone done;
+            auto control = Control::find(controls, SyncDoneOid);
+            auto value = BER::View::parse(control.first.value);
+            if (!control.second || !value.is(BER::Type::Attribute) ||
+                !SyncValue::parse(value.value, done.hasCookie, done.cookie, done.refreshDeletes)) {
+                return pair<SyncDone, bool>(done, false);
+            }
+            return pair<SyncDone, bool>(done, true);
+        }
+        static string encode(bool hasCookie, string_view cookie, bool refreshDeletes = false)
+        {
+            auto value = SyncValue::cookie(hasCookie, cookie);
+            if (refreshDeletes) {
+                value += BER::Bool(true).str();
+            }
+            return Control::encode(SyncDoneOid, BER::View::encode(static_cast<uint8_t>(BER::Type::Attribute), value));
+        }
+    };
+
+    // syncInfo IntermediateResponse: a new cookie, the end of a refresh phase in persist mode,
+    // or a set of entryUUIDs that were deleted (refreshDeletes) or are still present
+    class SyncInfo
+    {
+    public:
+        Protocol::Sync::Info info = Protocol::Sync::Info::NewCookie;
+        bool hasCookie = false;
+        string_view cookie;
+        bool refreshDone = true;     // RefreshDelete and RefreshPresent
+        bool refreshDeletes = false; // SyncIdSet
+        string_view syncUUIDs;       // Contents of the SET of a SyncIdSet
+
+        // From the op of an IntermediateResponse, fails for other intermediate responses
+        static pair<SyncInfo, bool> parse(string_view op)
+        {
+            SyncInfo sync;
+            BER::Reader reader(op);
+            auto name = reader.next();
+            auto value = reader.next();
+            auto choice = BER::View::parse(value.value);
+            if (name.tag != 0x80 || name.value != SyncInfoOid || value.tag != 0x81 || !choice.valid()) {
+                return pair<SyncInfo, bool>(sync, false);
+            }
+            sync.info = static_cast<Protocol::Sync::Info>(choice.tag);
+            switch (sync.info) {
+                case Protocol::Sync::Info::NewCookie:
+                    sync.hasCookie = true;
+                    sync.cookie = choice.value;
+                    return pair<SyncInfo, bool>(sync, true);
+                case Protocol::Sync::Info::RefreshDelete:
+                case Protocol::Sync::Info::RefreshPresent:
+                    return pair<SyncInfo, bool>(sync, SyncValue::parse(choice.value, sync.hasCookie, sync.cookie, sync.refreshDone));
+                case Protocol::Sync::Info::SyncIdSet: {
+                    BER::Reader fields(choice.value);
+                    while (!fields.done()) {
+                        auto field = fields.next();
+                        if (field.is(BER::Type::Set)) {
+                            sync.syncUUIDs = field.value;
+                        }
+                    }
+                    return pair<SyncInfo, bool>(sync, SyncValue::parse(choice.value, sync.hasCookie, sync.cookie, sync.refreshDeletes));
+                }
+                default:
+                    return pair<SyncInfo, bool>(sync, false);
+            }
+        }
+
+        // Calls callback(string_view uuid) for every entryUUID of a SyncIdSet, returns how many there were
+        template <typename Callback>
+        size_t uuids(Callback callback) const
+        {
+            size_t count = 0;
+            BER::Reader reader(this->syncUUIDs);
+            while (!reader.done()) {
+                auto uuid = reader.next();
+                if (uuid.is(BER::Type::String)) {
+                    callback(uuid.value);
+                    count++;
+                }
+            }
+            return count;
+        }
+
+        // Server side, the contents of the IntermediateResponse. flag is refreshDone, or refreshDeletes for a SyncIdSet.
+        static string encode(Protocol::Sync::Info info, bool hasCookie, string_view cookie, bool flag = true,
+                             const vector<string> &syncUUIDs = {})
+        {
+            string choice;
+            if (info == Protocol::Sync::Info::NewCookie) {
+                choice = BER::View::encode(static_cast<uint8_t>(info), cookie);
+            } else {
+                auto value = SyncValue::cookie(hasCookie, cookie);
+                bool byDefault = info != Protocol::Sync::Info::SyncIdSet;
+                if (flag != byDefault) {
+                    value += BER::Bool(flag).str();
+                }
+                if (info == Protocol::Sync::Info::SyncIdSet) {
+                    string set;
+                    for (auto &uuid : syncUUIDs) {
+                        set += BER::View::encode(static_cast<uint8_t>(BER::Type::String), uuid);
+                    }
+                    value += BER::View::encode(static_cast<uint8_t>(BER::Type::Set), set);
+                }
+                choice = BER::View::encode(static_cast<uint8_t>(info), value);
+            }
+            return BER::View::encode(0x80, SyncInfoOid) + BER::View::encode(0x81, choice);
+        }
+    };
+
+    // LDAPResult, shared by BindResponse, SearchResultDone and the other responses
+    class Result
+    {
+    public:
+        Protocol::ResultCode code = Protocol::ResultCode::Other;
+        string_view matchedDN;
+        string_view diagnosticMessage;
+
+        bool success() const { return this->code == Protocol::ResultCode::Success; }
+        // A CompareResponse with an answer, matched() is then the answer
+        bool compared() const
+        {
+            return this->code == Protocol::ResultCode::CompareTrue || this->code == Protocol::ResultCode::CompareFalse;
+        }
+        bool matched() const { return this->code == Protocol::ResultCode::CompareTrue; }
+        static pair<Result, bool> parse(string_view op)
+        {
+            Result result;
+            BER::Reader reader(op);
+            auto code = reader.next();
+            auto matchedDN = reader.next();
+            auto diagnosticMessage = reader.next();
+            if (!code.is(BER::Type::Enum) || !matchedDN.valid() || !diagnosticMessage.valid()) {
+                return pair<Result, bool>(result, false);
+            }
+            result.code = static_cast<Protocol::ResultCode>(code.integer());
+            result.matchedDN = matchedDN.value;
+            result.diagnosticMessage = diagnosticMessage.value;
+            return pair<Result, bool>(result, true);
+        }
+        static string encode(Protocol::ResultCode code, string_view matchedDN = "", string_view diagnosticMessage = "")
+        {
+            return BER::View::encode(static_cast<uint8_t>(BER::Type::Enum), string(1, (char)code)) +
+                   BER::View::encode(static_cast<uint8_t>(BER::Type::String), matchedDN) +
+                   BER::View::encode(static_cast<uint8_t>(BER::Type::String), diagnosticMessage);
+        }
+    };
+
+    // LDAPResult followed by the optional responseName and responseValue
+    class ExtendedResponse
+    {
+    public:
+        Result result;
+        string_view name;
+        bool hasValue = false;
+        string_view value; // The authzId of a WhoAmI, "dn:..." or "u:...", empty when anonymous
+
+        static pair<ExtendedResponse, bool> parse(string_view op)
+        {
+            ExtendedResponse response;
+            auto result = Result::parse(op);
+            if (!result.second) {
+                return pair<ExtendedResponse, bool>(response, false);
+            }
+            response.result = result.first;
+            BER::Reader reader(op);
+            for (int i = 0; i < 3; i++) { // resultCode to diagnosticMessage
+                reader.next();
+            }
+            while (!reader.done()) {
+                auto field = reader.next();
+                if (!field.valid()) {
+                    return pair<ExtendedResponse, bool>(response, false);
+                }
+                if (field.tag == static_cast<uint8_t>(Protocol::Extended::ResponseName)) {
+                    response.name = field.value;
+                } else if (field.tag == static_cast<uint8_t>(Protocol::Extended::ResponseValue)) {
+                    response.hasValue = true;
+                    response.value = field.value;
+                }
+            }
+            return pair<ExtendedResponse, bool>(response, true);
+        }
+        static string encode(Protocol::ResultCode code, string_view name = "", bool hasValue = false, string_view value = "")
+        {
+            auto op = Result::encode(code);
+            if (!name.empty()) {
+                op += BER::View::encode(static_cast<uint8_t>(Protocol::Extended::ResponseName), name);
+            }
+            if (hasValue) {
+                op += BER::View::encode(static_cast<uint8_t>(Protocol::Extended::ResponseValue), value);
+            }
+            return op;
+        }
+    };
+
+    class SearchResultEntry
+    {
+    public:
+        string_view objectName;
+        string_view attributes; // Contents of the PartialAttributeList
+
+        static pair<SearchResultEntry, bool> parse(string_view op)
+        {
+            SearchResultEntry entry;
+            BER::Reader reader(op);
+            auto objectName = reader.next();
+            auto attributes = reader.next();
+            if (!objectName.is(BER::Type::String) || !attributes.is(BER::Type::Attribute)) {
+                return pair<SearchResultEntry, bool>(entry, false);
+            }
+            entry.objectName = objectName.value;
+            entry.attributes = attributes.value;
+            return pair<SearchResultEntry, bool>(entry, true);
+        }
+
+        // Calls callback(string_view value) for every value of the attribute, returns how many were found
+        template <typename Callback>
+        size_t values(string_view attribute, Callback callback) const
+        {
+            size_t count = 0;
+            BER::Reader attributes(this->attributes);
+            while (!attributes.done()) {
+                auto partialAttribute = attributes.next();
+                BER::Reader reader(partialAttribute.value);
+                auto type = reader.next();
+                auto vals = reader.next();
+                if (!vals.is(BER::Type::Set) || !equalsIgnoreCase(type.value, attribute)) {
+                    continue;
+                }
+                BER::Reader values(vals.value);
+                while (!values.done()) {
+                    auto value = values.next();
+                    if (value.valid()) {
+                        callback(value.value);
+                        count++;
+                    }
+                }
+            }
+            return count;
+        }
+
+        // One PartialAttribute, the attributes of encode() are these concatenated
+        static string encodeAttribute(string_view type, const vector<string> &values)
+        {
+            string set;
+            for (auto &value : values) {
+                set += BER::View::encode(static_cast<uint8_t>(BER::Type::String), value);
+            }
+            return BER::View::encode(static_cast<uint8_t>(BER::Type::Attribute),
+                                     BER::View::encode(static_cast<uint8_t>(BER::Type::String), type) +
+                                     BER::View::encode(static_cast<uint8_t>(BER::Type::Set), set));
+        }
+        static string encode(string_view objectName, string_view attributes)
+        {
+            return BER::View::encode(static_cast<uint8_t>(BER::Type::String), objectName) +
+                   BER::View::encode(static_cast<uint8_t>(BER::Type::Attribute), attributes);
+        }
+
+    private:
+        // Attribute descriptions are case insensitive
+        static bool equalsIgnoreCase(string_view a, string_view b)
+        {
+            if (a.size() != b.size()) {
+                return false;
+            }
+            for (size_t i = 0; i < a.size(); i++) {
+                if (tolower((uint8_t)a[i]) != tolower((uint8_t)b[i])) {
+                    return false;
+                }
+            }
+            return true;
+        }
+    };
+}
+
+#endif //PTLDAP_HPP
@@ -0,0 +1,477 @@
+// In-memory badge directory answering Bind, Search and Compare, the protocol half of ldap_server
+
+#ifndef PTLDAP_SERVER_DIRECTORY_HPP
+#define PTLDAP_SERVER_DIRECTORY_HPP
+
+#include <cctype>
+#include <cstdint>
+#include <cstdlib>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "../ptldap.hpp"
+
+namespace LDAP
+{
+    class Directory
+    {
+    public:
+        struct Entry
+        {
+            string dn;
+            string cn;
+            string badge; // badgenuid, raw bytes
+            vector<string> groups; // memberOf DNs
+            string uuid; // entryUUID, 16 bytes
+            // Generations it was added and last changed at, for content synchronization
+            uint32_t created = 0;
+            uint32_t changed = 0;
+        };
+
+        // Empty accepts any bind
+        string bindDN;
+        string bindPassword;
+
+        // Adds the member, or replaces the one with the same badge
+        void add(string badge, string cn, string baseDN, vector<string> groups = {})
+        {
+            Entry entry;
+            entry.dn = "cn=" + cn + "," + baseDN;
+            entry.cn = std::move(cn);
+            entry.badge = badge;
+            entry.groups = std::move(groups);
+            entry.changed = ++this->generation;
+            auto existing = this->entries.find(badge);
+            if (existing != this->entries.end()) {
+                entry.uuid = existing->second.uuid;
+                entry.created = existing->second.created;
+            } else {
+                entry.uuid = string(16, '\0');
+                for (int i = 0; i < 4; i++) {
+                    entry.uuid[15 - i] = (char)(entry.changed >> (i * 8));
+                }
+                entry.created = entry.changed;
+            }
+            this->entries[std::move(badge)] = std::move(entry);
+        }
+        void remove(const string &badge)
+        {
+            auto entry = this->entries.find(badge);
+            if (entry == this->entries.end()) {
+                return;
+            }
+            entry->second.changed = ++this->generation;
+            this->deleted.push_back(std::move(entry->second));
+            this->entries.erase(entry);
+        }
+        size_t size() const { return this->entries.size(); }
+
+        // Encoded replies to one request, close is set for an UnbindRequest
+        string handle(const Response &request, bool &close) const
+        {
+            close = false;
+            switch (request.type) {
+                case Protocol::Type::BindRequest:
+                    return Response::encode(request.id, Protocol::Type::BindResponse, Result::encode(this->bind(request.op)));
+                case Protocol::Type::SearchRequest:
+                    return this->search(request);
+                case Protocol::Type::CompareRequest:
+                    return Response::encode(request.id, Protocol::Type::CompareResponse, Result::encode(this->compare(request.op)));
+                case Protocol::Type::ExtendedRequest:
+                    return Response::encode(request.id, Protocol::Type::ExtendedResponse, this->extended(request.op));
+                case Protocol::Type::UnbindRequest:
+                    close = true;
+                    return "";
+                default:
+                    return "";
+            }
+        }
+
+        // CLDAP datagram, only an anonymous search is answered and nothing at all otherwise
+        string datagram(string_view data) const
+        {
+            auto request = Response::parse(data);
+            if (!request.valid() || request.size != data.size() || request.type != Protocol::Type::SearchRequest) {
+                return "";
+            }
+            return this->search(request);
+        }
+
+        // Reply to a request refused with code, used to inject server errors
+        static string refuse(const Response &request, Protocol::ResultCode code)
+        {
+            switch (request.type) {
+                case Protocol::Type::BindRequest:
+                    return Response::encode(request.id, Protocol::Type::BindResponse, Result::encode(code));
+                case Protocol::Type::SearchRequest:
+                    return Response::encode(request.id, Protocol::Type::SearchResultDone, Result::encode(code));
+                case Protocol::Type::CompareRequest:
+                    return Response::encode(request.id, Protocol::Type::CompareResponse, Result::encode(code));
+                case Protocol::Type::ExtendedRequest:
+                    return Response::encode(request.id, Protocol::Type::ExtendedResponse, ExtendedResponse::encode(code));
+                default:
+                    return "";
+            }
+        }
+
+        // Members file: one "<badgenuid in hex> <cn> [memberOf DN...]" per line, # starts a comment
+        bool load(const string &text, const string &baseDN)
+        {
+            istringstream lines(text);
+            string line;
+            while (getline(lines, line)) {
+                if (line.empty() || line[0] == '#') {
+                    continue;
+                }
+                istringstream fields(line);
+                string hex, cn, group;
+                fields >> hex >> cn;
+                string badge;
+                if (!fromHex(hex, badge) || cn.empty()) {
+                    return false;
+                }
+                vector<string> groups;
+                while (fields >> group) {
+                    groups.push_back(group);
+                }
+                this->add(badge, cn, baseDN, std::move(groups));
+            }
+            return true;
+        }
+
+        static bool fromHex(const string &hex, string &bytes)
+        {
+            if (hex.empty() || hex.size() % 2 != 0) {
+                return false;
+            }
+            bytes.clear();
+            for (size_t i = 0; i < hex.size(); i += 2) {
+                if (!isxdigit((uint8_t)hex[i]) || !isxdigit((uint8_t)hex[i + 1])) {
+                    return false;
+                }
+                bytes += (char)stoi(hex.substr(i, 2), nullptr, 16);
+            }
+            return true;
+        }
+
+    private:
+        map<string, Entry> entries;
+        vector<Entry> deleted; // Kept for content synchronization, changed is when
+        uint32_t generation = 0;
+
+        Protocol::ResultCode bind(string_view op) const
+        {
+            BER::Reader reader(op);
+            auto version = reader.next();
+            auto name = reader.next();
+            auto password = reader.next();
+            if (!version.is(BER::Type::Integer) || !name.is(BER::Type::String) || !password.is(BER::Type::SimpleAuth)) {
+                return Protocol::ResultCode::ProtocolError;
+            }
+            if (!this->bindDN.empty() && (name.value != this->bindDN || password.value != this->bindPassword)) {
+                return Protocol::ResultCode::InvalidCredentials;
+            }
+            return Protocol::ResultCode::Success;
+        }
+
+        Protocol::ResultCode compare(string_view op) const
+        {
+            BER::Reader reader(op);
+            auto dn = reader.next();
+            auto ava = reader.next();
+            BER::Reader assertion(ava.value);
+            auto attribute = assertion.next();
+            auto value = assertion.next();
+            if (!dn.is(BER::Type::String) || !ava.is(BER::Type::Attribute) || !attribute.valid() || !value.valid()) {
+                return Protocol::ResultCode::ProtocolError;
+            }
+            for (auto &item : this->entries) {
+                auto &entry = item.second;
+                if (lower(entry.dn) != lower(to_string(dn.value))) {
+                    continue;
+                }
+                bool supported = true;
+                bool holds = this->holds(entry, to_string(attribute.value), to_string(value.value), supported);
+                if (!supported) {
+                    return Protocol::ResultCode::UndefinedAttributeType;
+                }
+                return holds ? Protocol::ResultCode::CompareTrue : Protocol::ResultCode::CompareFalse;
+            }
+            return Protocol::ResultCode::NoSuchObject;
+        }
+
+        string search(const Response &request) const
+        {
+            BER::Reader reader(request.op);
+            auto baseObject = lower(to_string(reader.next().value));
+            bool base = reader.next().integer() == static_cast<uint32_t>(Protocol::SearchRequest::Scope::BaseObject);
+            reader.next(); // derefAliases
+            auto sizeLimit = reader.next().integer();
+            reader.next(); // timeLimit, answers are immediate
+            bool typesOnly = reader.next().integer() != 0;
+            auto filter = reader.next();
+            auto attributes = reader.next();
+
+            // Evaluated once on no entry so an unsupported filter is refused even on an empty directory
+            bool supported = true;
+            this->matches(filter, Entry(), supported);
+            if (!supported) {
+                return Response::encode(request.id, Protocol::Type::SearchResultDone,
+                                        Result::encode(Protocol::ResultCode::UnwillingToPerform, "", "unsupported filter"));
+            }
+
+            auto sync = SyncRequest::parse(request.controls);
+            if (sync.second) {
+                return this->refresh(request, filter, attributes.value, typesOnly, sync.first);
+            }
+
+            // Paged searches go on after the badge of the cookie, the last one of the previous page
+            auto paged = PagedResults::parse(request.controls);
+            auto start = this->entries.begin();
+            if (paged.second && !paged.first.cookie.empty()) {
+                start = this->entries.upper_bound(to_string(paged.first.cookie));
+            }
+
+            string out, last, cookie;
+            uint32_t found = 0;
+            for (auto item = start; item != this->entries.end() && !(paged.second && paged.first.size == 0); ++item) {
+                auto &entry = item->second;
+                if ((base && lower(entry.dn) != baseObject) || !this->matches(filter, entry, supported)) {
+                    continue;
+                }
+                if (sizeLimit != 0 && found == sizeLimit) {
+                    return out + Response::encode(request.id, Protocol::Type::SearchResultDone,
+                                                  Result::encode(Protocol::ResultCode::SizeLimitExceeded));
+                }
+                if (paged.second && found == paged.first.size) {
+                    cookie = last;
+                    break;
+                }
+                found++;
+                last = item->first;
+                out += Response::encode(request.id, Protocol::Type::SearchResultEntry, this->encodeEntry(entry, attributes.value, typesOnly));
+            }
+            return out + Response::encode(request.id, Protocol::Type::SearchResultDone, Result::encode(Protocol::ResultCode::Success),
+                                          paged.second ? PagedResults::encode(0, cookie) : "");
+        }
+
+        // refreshOnly content synchronization (RFC 4533), the cookie is the generation the client has seen.
+        // Without one every entry is sent, with one only the changes and the deletes since.
+        string refresh(const Response &request, const BER::View &filter, string_view attributes, bool typesOnly,
+                       const SyncRequest &sync) const
+        {
+            if (sync.mode != Protocol::Sync::Mode::RefreshOnly) {
+                return Response::encode(request.id, Protocol::Type::SearchResultDone,
+                                        Result::encode(Protocol::ResultCode::UnwillingToPerform, "", "refreshAndPersist is not supported"));
+            }
+            uint32_t since = sync.hasCookie ? (uint32_t)strtoul(to_string(sync.cookie).c_str(), nullptr, 10) : 0;
+            if (since > this->generation) {
+                since = 0;
+            }
+
+            string out;
+            bool supported = true;
+            auto gone = [&](const Entry &entry) {
+                out += Response::encode(request.id, Protocol::Type::SearchResultEntry, SearchResultEntry::encode(entry.dn, ""),
+                                        SyncState::encode(Protocol::Sync::State::Delete, entry.uuid));
+            };
+            for (auto &item : this->entries) {
+                auto &entry = item.second;
+                if (entry.changed <= since) {
+                    continue;
+                }
+                if (this->matches(filter, entry, supported)) {
+                    auto state = entry.created > since ? Protocol::Sync::State::Add : Protocol::Sync::State::Modify;
+                    out += Response::encode(request.id, Protocol::Type::SearchResultEntry, this->encodeEntry(entry, attributes, typesOnly),
+                                            SyncState::encode(state, entry.uuid));
+                } else if (since != 0 && entry.created <= since) {
+                    // Changed out of the filter
+                    gone(entry);
+                }
+            }
+            for (auto &entry : this->deleted) {
+                if (since != 0 && entry.changed > since && entry.created <= since) {
+                    gone(entry);
+                }
+            }
+            auto cookie = std::to_string(this->generation);
+            return out + Response::encode(request.id, Protocol::Type::SearchResultDone, Result::encode(Protocol::ResultCode::Success),
+                                          SyncDone::encode(true, cookie, since != 0));
+        }
+
+        // Every filter choice on badgenuid, cn or memberOf, but extensibleMatch only without a matching rule and
+        // approxMatch as an equality. Anything else clears supported.
+        bool matches(const BER::View &filter, const Entry &entry, bool &supported) const
+        {
+            if (filter.tag == (static_cast<uint8_t>(BER::Type::Present) & ~0x20)) {
+                return lower(to_string(filter.value)) != "memberof" || !entry.groups.empty();
+            }
+            if (filter.is(BER::Type::And) || filter.is(BER::Type::Or)) {
+                bool all = filter.is(BER::Type::And);
+                BER::Reader reader(filter.value);
+                bool match = all;
+                while (!reader.done()) {
+                    // Keeps going once decided to check the whole filter is supported
+                    bool matched = this->matches(reader.next(), entry, supported);
+                    match = all ? match && matched : match || matched;
+                }
+                return match;
+            }
+            if (filter.is(BER::Type::Not)) {
+                return !this->matches(BER::View::parse(filter.value), entry, supported);
+            }
+            if (filter.is(BER::Type::Substrings)) {
+                BER::Reader assertion(filter.value);
+                auto attribute = to_string(assertion.next().value);
+                auto parts = assertion.next().value;
+                for (auto &value : this->values(entry, attribute, supported)) {
+                    if (this->substrings(value, attribute, parts)) {
+                        return true;
+                    }
+                }
+                return false;
+            }
+            string attribute, value;
+            if (filter.is(BER::Type::ExtensibleMatch)) {
+                BER::Reader assertion(filter.value);
+                while (!assertion.done()) {
+                    auto part = assertion.next();
+                    if (part.tag == static_cast<uint8_t>(BER::MatchingRuleAssertion::Type)) {
+                        attribute = to_string(part.value);
+                    } else if (part.tag == static_cast<uint8_t>(BER::MatchingRuleAssertion::MatchValue)) {
+                        value = to_string(part.value);
+                    } else {
+                        supported = false;
+                    }
+                }
+            } else if (filter.is(BER::Type::EqualityMatch) || filter.is(BER::Type::ApproxMatch) ||
+                       filter.is(BER::Type::GreaterOrEqual) || filter.is(BER::Type::LessOrEqual)) {
+                BER::Reader assertion(filter.value);
+                attribute = to_string(assertion.next().value);
+                value = to_string(assertion.next().value);
+            } else {
+                supported = false;
+                return false;
+            }
+            value = normalized(attribute, value);
+            for (auto &held : this->values(entry, attribute, supported)) {
+                if (filter.is(BER::Type::GreaterOrEqual) ? held >= value :
+                    filter.is(BER::Type::LessOrEqual) ? held <= value : held == value) {
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        // Only WhoAmI, answered with the bind DN as if every session had bound with it
+        string extended(string_view op) const
+        {
+            BER::Reader reader(op);
+            auto name = reader.next();
+            if (name.tag != static_cast<uint8_t>(Protocol::Extended::RequestName) || name.value != string_view(WhoAmIOid)) {
+                return ExtendedResponse::encode(Protocol::ResultCode::ProtocolError);
+            }
+            return ExtendedResponse::encode(Protocol::ResultCode::Success, "", true, this->bindDN.empty() ? "" : "dn:" + this->bindDN);
+        }
+
+        // initial, any and final parts in order, of a value already normalized
+        static bool substrings(const string &value, const string &attribute, string_view parts)
+        {
+            size_t offset = 0;
+            BER::Reader reader(parts);
+            while (!reader.done()) {
+                auto part = reader.next();
+                auto piece = normalized(attribute, to_string(part.value));
+                if (part.tag == static_cast<uint8_t>(BER::Substring::Initial)) {
+                    if (value.compare(0, piece.size(), piece) != 0) {
+                        return false;
+                    }
+                    offset = piece.size();
+                } else if (part.tag == static_cast<uint8_t>(BER::Substring::Final)) {
+                    return value.size() >= offset + piece.size() &&
+                           value.compare(value.size() - piece.size(), piece.size(), piece) == 0;
+                } else {
+                    offset = value.find(piece, offset);
+                    if (offset == string::npos) {
+                        return false;
+                    }
+                    offset += piece.size();
+                }
+            }
+            return true;
+        }
+
+        // Whether entry has attribute=value, supported is cleared for attributes the directory does not know
+        bool holds(const Entry &entry, const string &attribute, const string &value, bool &supported) const
+        {
+            for (auto &held : this->values(entry, attribute, supported)) {
+                if (held == normalized(attribute, value)) {
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        vector<string> values(const Entry &entry, const string &attribute, bool &supported) const
+        {
+            auto name = lower(attribute);
+            if (name == "badgenuid") {
+                return {entry.badge};
+            }
+            if (name == "cn") {
+                return {entry.cn};
+            }
+            if (name == "memberof") {
+                vector<string> groups;
+                for (auto &group : entry.groups) {
+                    groups.push_back(normalized(attribute, group));
+                }
+                return groups;
+            }
+            supported = false;
+            return {};
+        }
+
+        // Value as compared by the directory, DNs ignore case
+        static string normalized(const string &attribute, const string &value)
+        {
+            return lower(attribute) == "memberof" ? lower(value) : value;
+        }
+
+        // Only the requested attributes, all of them when none is and none for "1.1"
+        string encodeEntry(const Entry &entry, string_view requested, bool typesOnly) const
+        {
+            bool cn = requested.empty(), badgenuid = requested.empty(), memberOf = requested.empty();
+            BER::Reader reader(requested);
+            while (!reader.done()) {
+                auto name = lower(to_string(reader.next().value));
+                cn = cn || name == "cn" || name == "*";
+                badgenuid = badgenuid || name == "badgenuid" || name == "*";
+                memberOf = memberOf || name == "memberof" || name == "*";
+            }
+            auto values = [typesOnly](const vector<string> &values) { return typesOnly ? vector<string>() : values; };
+            string attributes;
+            if (cn) {
+                attributes += SearchResultEntry::encodeAttribute("cn", values({entry.cn}));
+            }
+            if (badgenuid) {
+                attributes += SearchResultEntry::encodeAttribute("badgenuid", values({entry.badge}));
+            }
+            if (memberOf && !entry.groups.empty()) {
+                attributes += SearchResultEntry::encodeAttribute("memberOf", values(entry.groups));
+            }
+            return SearchResultEntry::encode(entry.dn, attributes);
+        }
+
+        static string lower(string text)
+        {
+            for (auto &ch : text) {
+                ch = (char)tolower((uint8_t)ch);
+            }
+            return text;
+        }
+    };
+}
+
+#endif //PTLDAP_SERVER_DIRECTORY_HPP
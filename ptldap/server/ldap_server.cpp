@@ -0,0 +1,401 @@
+// Stand-in LDAP server for end-to-end and soak tests of the door client.
+// Answers Bind and Search from an in-memory badge table, over TCP or TLS and optionally CLDAP over UDP,
+// with configurable latency, errors and disconnects. One thread per connection, one for the datagrams.
+
+#include <atomic>
+#include <chrono>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#ifdef PTLDAP_TLS
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+#endif
+
+#include "directory.hpp"
+
+struct Options
+{
+    uint16_t port = 0;
+    string baseDN = "ou=Members,dc=example,dc=org";
+    string group; // memberOf of the generated members
+    string certPath;
+    string keyPath;
+    uint32_t latencyMs = 0;
+    uint32_t jitterMs = 0;
+    double errorRate = 0;      // Refused with Busy
+    double disconnectRate = 0; // Connection closed instead of answering
+    double stallRate = 0;      // Never answered
+    uint32_t seed = 1;
+    bool udp = false; // CLDAP on the same port number
+};
+
+struct Stats
+{
+    std::atomic<uint32_t> connections{0};
+    std::atomic<uint32_t> requests{0};
+    std::atomic<uint32_t> binds{0};
+    std::atomic<uint32_t> searches{0};
+    std::atomic<uint32_t> errors{0};
+    std::atomic<uint32_t> disconnects{0};
+    std::atomic<uint32_t> stalls{0};
+    std::atomic<uint32_t> datagrams{0};
+};
+
+static Options options;
+static LDAP::Directory directory;
+static Stats stats;
+static std::atomic<bool> stopping{false};
+
+#ifdef PTLDAP_TLS
+static SSL_CTX *tls = nullptr;
+#endif
+
+// Plain or TLS stream over an accepted socket
+class Connection
+{
+    int fd;
+#ifdef PTLDAP_TLS
+    SSL *ssl = nullptr;
+#endif
+
+public:
+    explicit Connection(int fd) : fd(fd) {}
+    ~Connection()
+    {
+#ifdef PTLDAP_TLS
+        if (this->ssl) {
+            SSL_shutdown(this->ssl);
+            SSL_free(this->ssl);
+        }
+#endif
+        close(this->fd);
+    }
+
+    bool handshake()
+    {
+#ifdef PTLDAP_TLS
+        if (tls) {
+            this->ssl = SSL_new(tls);
+            SSL_set_fd(this->ssl, this->fd);
+            if (SSL_accept(this->ssl) <= 0) {
+                ERR_print_errors_fp(stderr);
+                return false;
+            }
+        }
+#endif
+        return true;
+    }
+
+    ssize_t read(char *buf, size_t size)
+    {
+#ifdef PTLDAP_TLS
+        if (this->ssl) {
+            return SSL_read(this->ssl, buf, (int)size);
+        }
+#endif
+        return recv(this->fd, buf, size, 0);
+    }
+
+    bool write(const string &data)
+    {
+        size_t sent = 0;
+        while (sent < data.size()) {
+            ssize_t len;
+#ifdef PTLDAP_TLS
+            if (this->ssl) {
+                len = SSL_write(this->ssl, data.data() + sent, (int)(data.size() - sent));
+            } else
+#endif
+            {
+                len = send(this->fd, data.data() + sent, data.size() - sent, MSG_NOSIGNAL);
+            }
+            if (len <= 0) {
+                return false;
+            }
+            sent += len;
+        }
+        return true;
+    }
+};
+
+static void serve(int fd, uint32_t seed)
+{
+    Connection connection(fd);
+    if (!connection.handshake()) {
+        return;
+    }
+
+    std::mt19937 rng(seed);
+    std::uniform_real_distribution<double> chance(0, 1);
+    std::uniform_int_distribution<uint32_t> jitter(0, options.jitterMs);
+
+    string inbox;
+    char buf[4096];
+    while (!stopping) {
+        ssize_t len = connection.read(buf, sizeof(buf));
+        if (len <= 0) {
+            return;
+        }
+        auto arrivedAt = std::chrono::steady_clock::now();
+        inbox.append(buf, len);
+
+        while (true) {
+            auto request = LDAP::Response::parse(inbox);
+            if (!request.valid()) {
+                break;
+            }
+            stats.requests++;
+            if (request.type == LDAP::Protocol::Type::BindRequest) {
+                stats.binds++;
+            } else if (request.type == LDAP::Protocol::Type::SearchRequest) {
+                stats.searches++;
+            }
+
+            bool close = false;
+            string reply;
+            double roll = chance(rng);
+            if (roll < options.disconnectRate) {
+                stats.disconnects++;
+                return;
+            } else if ((roll -= options.disconnectRate) < options.stallRate) {
+                stats.stalls++;
+            } else if ((roll -= options.stallRate) < options.errorRate) {
+                stats.errors++;
+                reply = LDAP::Directory::refuse(request, LDAP::Protocol::ResultCode::Busy);
+            } else {
+                reply = directory.handle(request, close);
+            }
+            inbox.erase(0, request.size);
+
+            std::this_thread::sleep_until(arrivedAt + std::chrono::milliseconds(options.latencyMs + (options.jitterMs ? jitter(rng) : 0)));
+            if (!reply.empty() && !connection.write(reply)) {
+                return;
+            }
+            if (close) {
+                return;
+            }
+        }
+    }
+}
+
+// CLDAP, one search per datagram. Stalls and disconnects both drop the datagram, the client sends it again.
+static void serveDatagrams(int fd, uint32_t seed)
+{
+    std::mt19937 rng(seed);
+    std::uniform_real_distribution<double> chance(0, 1);
+    std::uniform_int_distribution<uint32_t> jitter(0, options.jitterMs);
+
+    char buf[4096];
+    while (!stopping) {
+        pollfd pfd = {fd, POLLIN, 0};
+        if (poll(&pfd, 1, 1000) <= 0) {
+            continue;
+        }
+        sockaddr_in6 from = {};
+        socklen_t fromLen = sizeof(from);
+        ssize_t len = recvfrom(fd, buf, sizeof(buf), 0, (sockaddr *)&from, &fromLen);
+        if (len <= 0) {
+            continue;
+        }
+        auto arrivedAt = std::chrono::steady_clock::now();
+        stats.datagrams++;
+        auto request = LDAP::Response::parse(string_view(buf, len));
+        if (!request.valid()) {
+            continue;
+        }
+        stats.requests++;
+
+        string reply;
+        double roll = chance(rng);
+        if (roll < options.disconnectRate + options.stallRate) {
+            stats.stalls++;
+            continue;
+        } else if ((roll -= options.disconnectRate + options.stallRate) < options.errorRate) {
+            stats.errors++;
+            reply = LDAP::Directory::refuse(request, LDAP::Protocol::ResultCode::Busy);
+        } else {
+            reply = directory.datagram(string_view(buf, len));
+        }
+        if (request.type == LDAP::Protocol::Type::SearchRequest) {
+            stats.searches++;
+        }
+
+        std::this_thread::sleep_until(arrivedAt + std::chrono::milliseconds(options.latencyMs + (options.jitterMs ? jitter(rng) : 0)));
+        if (!reply.empty()) {
+            sendto(fd, reply.data(), reply.size(), 0, (sockaddr *)&from, fromLen);
+        }
+    }
+}
+
+static void printStats()
+{
+    fprintf(stderr, "connections %u, datagrams %u, requests %u, binds %u, searches %u, injected errors %u, disconnects %u, stalls %u\n",
+            stats.connections.load(), stats.datagrams.load(), stats.requests.load(), stats.binds.load(),
+            stats.searches.load(), stats.errors.load(), stats.disconnects.load(), stats.stalls.load());
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr,
+            "usage: %s [options]\n"
+            "  --port N               listen port, 3389 or 3636 with --tls\n"
+            "  --base DN              base of the entries, default %s\n"
+            "  --members FILE         \"<badgenuid hex> <cn> [memberOf DN...]\" per line\n"
+            "  --group DN             memberOf of the members added by the next --generate\n"
+            "  --generate N           add N members with badgenuid 04xxxxxx\n"
+            "  --bind DN PASSWORD     only accept this bind, any bind by default\n"
+            "  --tls CERT KEY         serve LDAPS with a PEM certificate and key\n"
+            "  --udp                  also answer CLDAP searches on the same UDP port\n"
+            "  --latency MS           delay every reply\n"
+            "  --jitter MS            add a random 0..MS to the delay\n"
+            "  --error-rate P         refuse a request with busy, 0 to 1\n"
+            "  --disconnect-rate P    close the connection instead of answering\n"
+            "  --stall-rate P         never answer a request\n"
+            "  --seed N               random seed\n",
+            name, options.baseDN.c_str());
+}
+
+static bool parseArgs(int argc, char **argv)
+{
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        auto need = [&](int count) { return i + count < argc; };
+        if (arg == "--port" && need(1)) {
+            options.port = (uint16_t)atoi(argv[++i]);
+        } else if (arg == "--base" && need(1)) {
+            options.baseDN = argv[++i];
+        } else if (arg == "--members" && need(1)) {
+            std::ifstream file(argv[++i]);
+            std::stringstream text;
+            text << file.rdbuf();
+            if (!file || !directory.load(text.str(), options.baseDN)) {
+                fprintf(stderr, "could not load %s\n", argv[i]);
+                return false;
+            }
+        } else if (arg == "--group" && need(1)) {
+            options.group = argv[++i];
+        } else if (arg == "--generate" && need(1)) {
+            uint32_t count = (uint32_t)atoi(argv[++i]);
+            for (uint32_t n = 0; n < count; n++) {
+                const char badge[] = {0x04, (char)(n >> 16), (char)(n >> 8), (char)n};
+                directory.add(string(badge, sizeof(badge)), "member" + std::to_string(n), options.baseDN,
+                              options.group.empty() ? vector<string>() : vector<string>{options.group});
+            }
+        } else if (arg == "--bind" && need(2)) {
+            directory.bindDN = argv[++i];
+            directory.bindPassword = argv[++i];
+        } else if (arg == "--tls" && need(2)) {
+            options.certPath = argv[++i];
+            options.keyPath = argv[++i];
+        } else if (arg == "--udp") {
+            options.udp = true;
+        } else if (arg == "--latency" && need(1)) {
+            options.latencyMs = (uint32_t)atoi(argv[++i]);
+        } else if (arg == "--jitter" && need(1)) {
+            options.jitterMs = (uint32_t)atoi(argv[++i]);
+        } else if (arg == "--error-rate" && need(1)) {
+            options.errorRate = atof(argv[++i]);
+        } else if (arg == "--disconnect-rate" && need(1)) {
+            options.disconnectRate = atof(argv[++i]);
+        } else if (arg == "--stall-rate" && need(1)) {
+            options.stallRate = atof(argv[++i]);
+        } else if (arg == "--seed" && need(1)) {
+            options.seed = (uint32_t)atoi(argv[++i]);
+        } else {
+            return false;
+        }
+    }
+    return true;
+}
+
+int main(int argc, char **argv)
+{
+    if (!parseArgs(argc, argv)) {
+        usage(argv[0]);
+        return 2;
+    }
+
+    if (!options.certPath.empty()) {
+#ifdef PTLDAP_TLS
+        tls = SSL_CTX_new(TLS_server_method());
+        if (!tls ||
+            SSL_CTX_use_certificate_chain_file(tls, options.certPath.c_str()) <= 0 ||
+            SSL_CTX_use_PrivateKey_file(tls, options.keyPath.c_str(), SSL_FILETYPE_PEM) <= 0) {
+            ERR_print_errors_fp(stderr);
+            return 1;
+        }
+#else
+        fprintf(stderr, "built without OpenSSL, --tls is not available\n");
+        return 1;
+#endif
+    }
+    if (options.port == 0) {
+        options.port = options.certPath.empty() ? 3389 : 3636;
+    }
+
+    int listener = socket(AF_INET6, SOCK_STREAM, 0);
+    int yes = 1, no = 0;
+    setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+    setsockopt(listener, IPPROTO_IPV6, IPV6_V6ONLY, &no, sizeof(no));
+    sockaddr_in6 address = {};
+    address.sin6_family = AF_INET6;
+    address.sin6_addr = in6addr_any;
+    address.sin6_port = htons(options.port);
+    if (bind(listener, (sockaddr *)&address, sizeof(address)) < 0 || listen(listener, 64) < 0) {
+        perror("listen");
+        return 1;
+    }
+
+    std::thread datagrams;
+    if (options.udp) {
+        int fd = socket(AF_INET6, SOCK_DGRAM, 0);
+        setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &no, sizeof(no));
+        if (bind(fd, (sockaddr *)&address, sizeof(address)) < 0) {
+            perror("udp");
+            return 1;
+        }
+        datagrams = std::thread(serveDatagrams, fd, options.seed + 0x10000);
+    }
+
+    signal(SIGINT, [](int) { stopping = true; });
+    signal(SIGTERM, [](int) { stopping = true; });
+    fprintf(stderr, "serving %u members on port %u%s%s\n", (unsigned)directory.size(), (unsigned)options.port,
+            options.certPath.empty() ? "" : " (TLS)", options.udp ? " and CLDAP" : "");
+
+    uint32_t seed = options.seed;
+    while (!stopping) {
+        pollfd pfd = {listener, POLLIN, 0};
+        if (poll(&pfd, 1, 1000) <= 0) {
+            continue;
+        }
+        int fd = accept(listener, nullptr, nullptr);
+        if (fd < 0) {
+            continue;
+        }
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+        stats.connections++;
+        std::thread(serve, fd, seed++).detach();
+    }
+
+    close(listener);
+    if (datagrams.joinable()) {
+        datagrams.join();
+    }
+    printStats();
+    return 0;
+}
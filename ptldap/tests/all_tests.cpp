@@ -4,6 +4,7 @@
 #include "tools.hpp"
 
 #include "../ptldap.hpp"
+#include "../server/directory.hpp"
 
 TEST_CASE( "Parse BER::Bool", "[BER::Bool]" ) {
     auto ber_bool_false = BER::Bool(false);
@@ -119,4 +120,727 @@ TEST_CASE( "Generate a SearchRequest", "[searchRequest]" ) {
 
     REQUIRE(msg_str.size() == expected_str.size() );
     REQUIRE(memcmp(expected_str.c_str(), msg_str.c_str(), expected_str.size()) == 0);
-}
\ No newline at end of file
+}
+
+TEST_CASE( "Generate a SearchRequest with a present filter", "[searchRequest]" ) {
+    LDAP::MsgBuilder::reset_id();
+    auto expected_str = "\x30\x36\x02\x01\x01\x63\x31\x04\x08" "ou=Users" "\x0a\x01\x01\x0a\x01\x00\x02\x01\x00\x02\x01\x00\x01\x01\x00" "\x87\x09" "badgenuid" "\x30\x0b\x04\x09" "badgenuid"s;
+    auto msg_str = LDAP::SearchRequest("ou=Users", new BER::Present("badgenuid"), "badgenuid").str();
+
+    REQUIRE( msg_str.size() == expected_str.size() );
+    REQUIRE( memcmp(expected_str.c_str(), msg_str.c_str(), expected_str.size()) == 0 );
+}
+
+TEST_CASE( "Generate a SearchRequest with an and filter", "[searchRequest]" ) {
+    LDAP::MsgBuilder::reset_id();
+    auto expected_str = "\x30\x4e\x02\x01\x01\x63\x49\x04\x08" "ou=Users" "\x0a\x01\x01\x0a\x01\x00\x02\x01\x00\x02\x01\x00\x01\x01\x00"
+                        "\xa0\x28"
+                        "\xa3\x0f\x04\x09" "badgenuid" "\x04\x02\x04\x01"
+                        "\xa3\x15\x04\x08" "memberOf" "\x04\x09" "cn=active"
+                        "\x30\x04\x04\x02" "cn"s;
+    auto filter = new BER::And();
+    filter->add(new BER::EqualityMatch("badgenuid", "\x04\x01"s)).add(new BER::EqualityMatch("memberOf", "cn=active"));
+    auto msg_str = LDAP::SearchRequest("ou=Users", filter, "cn").str();
+
+    REQUIRE( msg_str.size() == expected_str.size() );
+    REQUIRE( memcmp(expected_str.c_str(), msg_str.c_str(), expected_str.size()) == 0 );
+}
+
+TEST_CASE( "Generate a SearchRequest with limits and no attributes", "[searchRequest]" ) {
+    LDAP::MsgBuilder::reset_id();
+    auto expected_str = "\x30\x36\x02\x01\x01\x63\x31\x04\x08" "ou=Users" "\x0a\x01\x01\x0a\x01\x00\x02\x01\x01\x02\x01\x05\x01\x01\x00"
+                        "\xa3\x0f\x04\x09" "badgenuid" "\x04\x02\x04\x01"
+                        "\x30\x05\x04\x03" "1.1"s;
+    auto msg_str = LDAP::SearchRequest("ou=Users", new BER::EqualityMatch("badgenuid", "\x04\x01"s), LDAP::NoAttributes)
+            .limit(1, 5)
+            .str();
+
+    REQUIRE( msg_str.size() == expected_str.size() );
+    REQUIRE( memcmp(expected_str.c_str(), msg_str.c_str(), expected_str.size()) == 0 );
+
+    auto attributes = LDAP::SearchRequest("ou=Users", new BER::Present("cn"), vector<string>{"cn", "badgenuid"}).str();
+    REQUIRE( attributes.substr(attributes.size() - 17) == "\x30\x0f\x04\x02" "cn" "\x04\x09" "badgenuid"s );
+    auto all = LDAP::SearchRequest("ou=Users", new BER::Present("cn"), vector<string>()).str();
+    REQUIRE( all.substr(all.size() - 2) == "\x30\x00"s );
+}
+
+TEST_CASE( "Generate long form lengths in requests", "[searchRequest]" ) {
+    auto group = "cn=active," + string(200, 'x');
+    auto filter = new BER::And();
+    filter->add(new BER::Present("badgenuid")).add(new BER::EqualityMatch("memberOf", group));
+    auto msg_str = LDAP::SearchRequest("ou=Users", filter, "badgenuid").str();
+
+    REQUIRE( (uint8_t)msg_str[1] & 0x80 );
+    auto msg = LDAP::Response::parse(msg_str);
+    REQUIRE( msg.valid() );
+    REQUIRE( msg.size == msg_str.size() );
+    REQUIRE( msg.type == LDAP::Protocol::Type::SearchRequest );
+
+    BER::Reader reader(msg.op);
+    for (int i = 0; i < 6; i++) {
+        reader.next();
+    }
+    auto and_filter = reader.next();
+    REQUIRE( and_filter.is(BER::Type::And) );
+    BER::Reader filters(and_filter.value);
+    filters.next();
+    auto equality = filters.next();
+    REQUIRE( equality.is(BER::Type::EqualityMatch) );
+    BER::Reader assertion(equality.value);
+    REQUIRE( assertion.next().value == "memberOf"_sv );
+    REQUIRE( assertion.next().value == string_view(group) );
+    REQUIRE( reader.next().is(BER::Type::Attribute) );
+}
+
+TEST_CASE( "Parse BER long form lengths", "[BER::View]" ) {
+    auto payload = string(200, 'x');
+    auto data = "\x04\x81\xc8"s + payload;
+
+    auto view = BER::View::parse(data);
+    REQUIRE( view.valid() );
+    REQUIRE( view.size == data.size() );
+    REQUIRE( view.value == string_view(payload) );
+
+    REQUIRE_FALSE( BER::View::parse(data.substr(0, 100)).valid() );
+    REQUIRE_FALSE( BER::View::parse("\x04\x84\x00"s).valid() );
+}
+
+TEST_CASE( "Parse a SearchResultEntry and SearchResultDone", "[searchResult]" ) {
+    // OpenLDAP uses 4 byte long form lengths on the message
+    auto entry_str = "\x30\x84\x00\x00\x00\x2f\x02\x01\x02\x64\x2a\x04\x0b" "cn=x,ou=Foo"
+                     "\x30\x1b\x30\x19\x04\x09" "badgeNUID" "\x31\x0c\x04\x04\x01\x02\x03\x04\x04\x04\x0a\x0b\x0c\x0d"s;
+    auto done_str = "\x30\x0c\x02\x01\x02\x65\x07\x0a\x01\x00\x04\x00\x04\x00"s;
+    auto stream = entry_str + done_str;
+
+    auto entry = LDAP::Response::parse(stream);
+    REQUIRE( entry.valid() );
+    REQUIRE( entry.id == 2 );
+    REQUIRE( entry.type == LDAP::Protocol::Type::SearchResultEntry );
+    REQUIRE( entry.size == entry_str.size() );
+
+    auto parsed_entry = LDAP::SearchResultEntry::parse(entry.op);
+    REQUIRE( parsed_entry.second );
+    REQUIRE( parsed_entry.first.objectName == "cn=x,ou=Foo"_sv );
+
+    vector<string> values;
+    auto count = parsed_entry.first.values("badgenuid", [&](string_view value) { values.push_back(to_string(value)); });
+    REQUIRE( count == 2 );
+    REQUIRE( values[0] == "\x01\x02\x03\x04"s );
+    REQUIRE( values[1] == "\x0a\x0b\x0c\x0d"s );
+    REQUIRE( parsed_entry.first.values("cn", [](string_view) {}) == 0 );
+
+    auto done = LDAP::Response::parse(string_view(stream).substr(entry.size));
+    REQUIRE( done.valid() );
+    REQUIRE( done.type == LDAP::Protocol::Type::SearchResultDone );
+    auto result = LDAP::Result::parse(done.op);
+    REQUIRE( result.second );
+    REQUIRE( result.first.success() );
+
+    REQUIRE_FALSE( LDAP::Response::parse(string_view(stream).substr(0, 20)).valid() );
+}
+
+TEST_CASE( "Generate BER::Integer with the high bit set", "[BER::Integer]" ) {
+    REQUIRE( BER::Integer(0).str() == "\x02\x01\x00"s );
+    REQUIRE( BER::Integer(0x7f).str() == "\x02\x01\x7f"s );
+    REQUIRE( BER::Integer(0x80).str() == "\x02\x02\x00\x80"s );
+    REQUIRE( BER::Integer(0x1337).str() == "\x02\x02\x13\x37"s );
+    REQUIRE( BER::Integer(0xDEADBEEF).str() == "\x02\x05\x00\xde\xad\xbe\xef"s );
+}
+
+TEST_CASE( "Message IDs skip 0 when wrapping", "[MsgBuilder]" ) {
+    LDAP::MsgBuilder::id = 255;
+    auto last = LDAP::BindRequest("test_login", "test_passwd");
+    auto first = LDAP::BindRequest("test_login", "test_passwd");
+
+    REQUIRE( last.messageId() == 255 );
+    REQUIRE( first.messageId() == 1 );
+    REQUIRE( LDAP::Response::parse(last.str()).id == 255 );
+    LDAP::MsgBuilder::reset_id();
+}
+
+TEST_CASE( "Generate server responses", "[searchResult]" ) {
+    auto done = LDAP::Response::encode(2, LDAP::Protocol::Type::SearchResultDone, LDAP::Result::encode(LDAP::Protocol::ResultCode::Success));
+    REQUIRE( done == "\x30\x0c\x02\x01\x02\x65\x07\x0a\x01\x00\x04\x00\x04\x00"s );
+
+    // Large enough to need a long form length on the entry and the message
+    vector<string> values(20, "\x01\x02\x03\x04"s);
+    auto entry_str = LDAP::Response::encode(7, LDAP::Protocol::Type::SearchResultEntry,
+                                            LDAP::SearchResultEntry::encode("cn=x,ou=Foo", LDAP::SearchResultEntry::encodeAttribute("badgenuid", values)));
+    REQUIRE( (uint8_t)entry_str[1] == 0x81 );
+
+    auto entry = LDAP::Response::parse(entry_str);
+    REQUIRE( entry.valid() );
+    REQUIRE( entry.id == 7 );
+    REQUIRE( entry.size == entry_str.size() );
+    auto parsed_entry = LDAP::SearchResultEntry::parse(entry.op);
+    REQUIRE( parsed_entry.second );
+    REQUIRE( parsed_entry.first.objectName == "cn=x,ou=Foo"_sv );
+    REQUIRE( parsed_entry.first.values("badgeNUID", [](string_view) {}) == 20 );
+}
+
+TEST_CASE( "Directory answers Bind and Search", "[directory]" ) {
+    LDAP::Directory directory;
+    directory.bindDN = "cn=door";
+    directory.bindPassword = "secret";
+    REQUIRE( directory.load("# badgenuid cn\n04a15c01 alice\n04a15c02 bob\n", "ou=Members") );
+    REQUIRE_FALSE( directory.load("04a15c0 eve\n", "ou=Members") );
+    bool close;
+
+    auto bind = LDAP::BindRequest("cn=door", "wrong").str();
+    auto bind_reply = LDAP::Response::parse(directory.handle(LDAP::Response::parse(bind), close));
+    REQUIRE( bind_reply.type == LDAP::Protocol::Type::BindResponse );
+    REQUIRE( LDAP::Result::parse(bind_reply.op).first.code == LDAP::Protocol::ResultCode::InvalidCredentials );
+
+    auto search = LDAP::SearchRequest("ou=Members", "badgenuid", "\x04\xa1\x5c\x02"s, "cn");
+    auto search_reply = directory.handle(LDAP::Response::parse(search.str()), close);
+    auto entry = LDAP::Response::parse(search_reply);
+    REQUIRE( entry.type == LDAP::Protocol::Type::SearchResultEntry );
+    REQUIRE( entry.id == search.messageId() );
+    auto parsed_entry = LDAP::SearchResultEntry::parse(entry.op).first;
+    REQUIRE( parsed_entry.objectName == "cn=bob,ou=Members"_sv );
+    REQUIRE( parsed_entry.values("cn", [](string_view value) { REQUIRE( value == "bob"_sv ); }) == 1 );
+    REQUIRE( parsed_entry.values("badgenuid", [](string_view) {}) == 0 );
+    auto done = LDAP::Response::parse(string_view(search_reply).substr(entry.size));
+    REQUIRE( done.type == LDAP::Protocol::Type::SearchResultDone );
+
+    auto sync = LDAP::SearchRequest("ou=Members", new BER::Present("badgenuid"), "badgenuid");
+    auto sync_reply = directory.handle(LDAP::Response::parse(sync.str()), close);
+    size_t entries = 0;
+    for (size_t offset = 0; offset < sync_reply.size();) {
+        auto response = LDAP::Response::parse(string_view(sync_reply).substr(offset));
+        REQUIRE( response.valid() );
+        entries += response.type == LDAP::Protocol::Type::SearchResultEntry;
+        offset += response.size;
+    }
+    REQUIRE( entries == 2 );
+    REQUIRE_FALSE( close );
+}
+
+TEST_CASE( "Directory evaluates and filters on memberOf", "[directory]" ) {
+    LDAP::Directory directory;
+    REQUIRE( directory.load("04a15c01 alice cn=active,ou=Groups\n04a15c02 bob\n", "ou=Members") );
+    bool close;
+
+    auto count = [&](BER::Element *filter) {
+        auto search = LDAP::SearchRequest("ou=Members", filter, "cn");
+        auto reply = directory.handle(LDAP::Response::parse(search.str()), close);
+        size_t entries = 0;
+        for (size_t offset = 0; offset < reply.size();) {
+            auto response = LDAP::Response::parse(string_view(reply).substr(offset));
+            REQUIRE( response.valid() );
+            entries += response.type == LDAP::Protocol::Type::SearchResultEntry;
+            if (response.type == LDAP::Protocol::Type::SearchResultDone && !LDAP::Result::parse(response.op).first.success()) {
+                return -1;
+            }
+            offset += response.size;
+        }
+        return (int)entries;
+    };
+    auto active = [](string badge) {
+        auto filter = new BER::And();
+        filter->add(new BER::EqualityMatch("badgenuid", badge)).add(new BER::EqualityMatch("memberOf", "CN=active,ou=Groups"));
+        return filter;
+    };
+
+    REQUIRE( count(active("\x04\xa1\x5c\x01"s)) == 1 );
+    REQUIRE( count(active("\x04\xa1\x5c\x02"s)) == 0 );
+    REQUIRE( count(new BER::EqualityMatch("badgenuid", "\x04\xa1\x5c\x02"s)) == 1 );
+    REQUIRE( count(new BER::Present("memberOf")) == 1 );
+
+    auto unsupported = new BER::And();
+    unsupported->add(new BER::Present("badgenuid")).add(new BER::EqualityMatch("mail", "bob@example.org"));
+    REQUIRE( count(unsupported) == -1 );
+}
+
+TEST_CASE( "Directory evaluates every filter choice", "[directory]" ) {
+    LDAP::Directory directory;
+    REQUIRE( directory.load("04a15c01 alice cn=active,ou=Groups\n04a15c02 bob\n04a15c03 carol cn=staff,ou=Groups\n", "ou=Members") );
+    bool close;
+
+    auto count = [&](const char *text) {
+        auto filter = LDAP::FilterTemplate::parse(text);
+        REQUIRE( filter.second );
+        auto search = LDAP::SearchRequest("ou=Members", new BER::Raw(filter.first.render()), LDAP::NoAttributes);
+        auto reply = directory.handle(LDAP::Response::parse(search.str()), close);
+        size_t entries = 0;
+        for (size_t offset = 0; offset < reply.size();) {
+            auto response = LDAP::Response::parse(string_view(reply).substr(offset));
+            REQUIRE( response.valid() );
+            entries += response.type == LDAP::Protocol::Type::SearchResultEntry;
+            if (response.type == LDAP::Protocol::Type::SearchResultDone && !LDAP::Result::parse(response.op).first.success()) {
+                return -1;
+            }
+            offset += response.size;
+        }
+        return (int)entries;
+    };
+
+    REQUIRE( count("(|(memberOf=CN=active,ou=Groups)(memberOf=cn=staff,ou=Groups))") == 2 );
+    REQUIRE( count("(!(memberOf=*))") == 1 );
+    REQUIRE( count("(&(badgenuid=*)(!(cn=bob)))") == 2 );
+    REQUIRE( count("(cn=*o*)") == 2 );
+    REQUIRE( count("(cn=a*e)") == 1 );
+    REQUIRE( count("(cn=*l)") == 1 );
+    REQUIRE( count("(cn=al*ice)") == 1 );
+    REQUIRE( count("(cn=ali*ice)") == 0 );
+    REQUIRE( count("(memberOf=CN=*)") == 2 );
+    REQUIRE( count("(cn>=bob)") == 2 );
+    REQUIRE( count("(cn<=bob)") == 2 );
+    REQUIRE( count("(cn~=carol)") == 1 );
+    REQUIRE( count("(|)") == 0 );
+    REQUIRE( count("(|(cn=bob)(mail=x))") == -1 );
+    REQUIRE( count("(cn:caseExactMatch:=bob)") == -1 );
+}
+
+TEST_CASE( "Directory honours the size limit, typesOnly and 1.1", "[directory]" ) {
+    LDAP::Directory directory;
+    REQUIRE( directory.load("04a15c01 alice\n04a15c02 bob\n04a15c03 carol\n", "ou=Members") );
+    bool close;
+
+    auto search = LDAP::SearchRequest("ou=Members", new BER::Present("badgenuid"), LDAP::NoAttributes);
+    search.limit(2);
+    auto reply = directory.handle(LDAP::Response::parse(search.str()), close);
+    vector<LDAP::Response> responses;
+    for (size_t offset = 0; offset < reply.size(); offset += responses.back().size) {
+        responses.push_back(LDAP::Response::parse(string_view(reply).substr(offset)));
+        REQUIRE( responses.back().valid() );
+    }
+    REQUIRE( responses.size() == 3 );
+    auto entry = LDAP::SearchResultEntry::parse(responses[0].op);
+    REQUIRE( entry.second );
+    REQUIRE( entry.first.values("cn", [](string_view) {}) == 0 );
+    REQUIRE( entry.first.values("badgenuid", [](string_view) {}) == 0 );
+    REQUIRE( LDAP::Result::parse(responses[2].op).first.code == LDAP::Protocol::ResultCode::SizeLimitExceeded );
+
+    auto types = LDAP::SearchRequest("ou=Members", new BER::EqualityMatch("cn", "bob"), "cn",
+                                     LDAP::Protocol::SearchRequest::Scope::SingleLevel,
+                                     LDAP::Protocol::SearchRequest::DerefAliases::NeverDerefAliases, true);
+    auto types_str = directory.handle(LDAP::Response::parse(types.str()), close);
+    auto types_reply = LDAP::Response::parse(types_str);
+    REQUIRE( types_reply.type == LDAP::Protocol::Type::SearchResultEntry );
+    auto types_entry = LDAP::SearchResultEntry::parse(types_reply.op);
+    REQUIRE( types_entry.second );
+    REQUIRE( types_entry.first.objectName == "cn=bob,ou=Members"_sv );
+    REQUIRE( types_entry.first.values("cn", [](string_view) {}) == 0 );
+}
+
+TEST_CASE( "Generate a CompareRequest and decode its answer", "[compare]" ) {
+    LDAP::MsgBuilder::reset_id();
+    auto expected_str = "\x30\x2f\x02\x01\x01\x6e\x2a\x04\x11" "cn=bob,ou=Members"
+                        "\x30\x15\x04\x08" "memberOf" "\x04\x09" "cn=active"s;
+    auto compare = LDAP::CompareRequest("cn=bob,ou=Members", "memberOf", "cn=active");
+    auto msg_str = compare.str();
+
+    REQUIRE( msg_str.size() == expected_str.size() );
+    REQUIRE( memcmp(expected_str.c_str(), msg_str.c_str(), expected_str.size()) == 0 );
+
+    LDAP::Directory directory;
+    REQUIRE( directory.load("04a15c01 alice cn=active\n04a15c02 bob\n", "ou=Members") );
+    bool close;
+    auto answer = [&](LDAP::CompareRequest request) {
+        auto reply = directory.handle(LDAP::Response::parse(request.str()), close);
+        auto response = LDAP::Response::parse(reply);
+        REQUIRE( response.valid() );
+        REQUIRE( response.type == LDAP::Protocol::Type::CompareResponse );
+        REQUIRE( response.id == request.messageId() );
+        auto result = LDAP::Result::parse(response.op);
+        REQUIRE( result.second );
+        return result.first.code;
+    };
+
+    REQUIRE( answer(LDAP::CompareRequest("cn=alice,ou=Members", "memberOf", "CN=Active")) == LDAP::Protocol::ResultCode::CompareTrue );
+    REQUIRE( answer(LDAP::CompareRequest("cn=bob,ou=Members", "memberOf", "cn=active")) == LDAP::Protocol::ResultCode::CompareFalse );
+    REQUIRE( answer(LDAP::CompareRequest("cn=eve,ou=Members", "memberOf", "cn=active")) == LDAP::Protocol::ResultCode::NoSuchObject );
+    REQUIRE( answer(LDAP::CompareRequest("cn=bob,ou=Members", "mail", "bob@example.org")) == LDAP::Protocol::ResultCode::UndefinedAttributeType );
+
+    auto done = LDAP::Result::parse(LDAP::Result::encode(LDAP::Protocol::ResultCode::CompareTrue)).first;
+    REQUIRE( done.compared() );
+    REQUIRE( done.matched() );
+    REQUIRE_FALSE( done.success() );
+    auto busy = LDAP::Result::parse(LDAP::Result::encode(LDAP::Protocol::ResultCode::Busy)).first;
+    REQUIRE_FALSE( busy.compared() );
+}
+
+TEST_CASE( "Compile string filters", "[filterTemplate]" ) {
+    auto compile = [](const char *text) {
+        auto filter = LDAP::FilterTemplate::parse(text);
+        REQUIRE( filter.second );
+        return std::move(filter.first);
+    };
+
+    SECTION( "the same bytes as the filter elements" ) {
+        auto badgenuid = compile("(badgenuid={0})");
+        REQUIRE( badgenuid.parameters() == 1 );
+        REQUIRE( badgenuid.render({"\x04\xa1"_sv}) == BER::EqualityMatch("badgenuid", "\x04\xa1").str() );
+
+        BER::And both;
+        both.add(new BER::EqualityMatch("objectClass", "ptlMember")).add(new BER::EqualityMatch("badgenuid", "\x04\xa1"));
+        REQUIRE( compile("(&(objectClass=ptlMember)(badgenuid={0}))").render({"\x04\xa1"_sv}) == both.str() );
+
+        REQUIRE( compile("(badgenuid=*)").render() == BER::Present("badgenuid").str() );
+        REQUIRE( compile("(badgenuid:=04a1)").render() == BER::Filter("badgenuid", "04a1").str() );
+    }
+
+    SECTION( "every filter choice" ) {
+        auto choices = "\xa1\x22"
+                       "\xa2\x08\xa3\x06\x04\x01" "a" "\x04\x01" "1"
+                       "\xa5\x06\x04\x01" "b" "\x04\x01" "2"
+                       "\xa6\x06\x04\x01" "c" "\x04\x01" "3"
+                       "\xa8\x06\x04\x01" "d" "\x04\x01" "4"s;
+        REQUIRE( compile("(|(!(a=1))(b>=2)(c<=3)(d~=4))").render() == choices );
+
+        auto substrings = "\xa4\x0f\x04\x02" "cn" "\x30\x09\x80\x01" "a" "\x81\x01" "b" "\x82\x01" "c"s;
+        REQUIRE( compile("(cn=a*{0}*c)").render({"b"_sv}) == substrings );
+        REQUIRE( compile("(cn=*{0}*)").render({"b"_sv}) == "\xa4\x09\x04\x02" "cn" "\x30\x03\x81\x01" "b"s );
+
+        auto extensible = "\xa9\x14\x81\x08" "2.5.13.5" "\x82\x02" "cn" "\x83\x01" "x" "\x84\x01\xff"s;
+        REQUIRE( compile("(cn:dn:2.5.13.5:=x)").render() == extensible );
+        REQUIRE( compile("(:2.5.13.5:={0})").render({"x"_sv}) == "\xa9\x0d\x81\x08" "2.5.13.5" "\x83\x01" "x"s );
+
+        // (&) is true (RFC 4526)
+        REQUIRE( compile("(&)").render() == "\xa0\x00"s );
+    }
+
+    SECTION( "escapes and parameters are values" ) {
+        REQUIRE( compile("(cn=\\2a\\28\\29)").render() == BER::EqualityMatch("cn", "*()").str() );
+        auto cn = compile("(cn={0})");
+        REQUIRE( cn.render({"x)(cn=*"_sv}) == BER::EqualityMatch("cn", "x)(cn=*").str() );
+        REQUIRE( compile("(cn={x})").render() == BER::EqualityMatch("cn", "{x}").str() );
+
+        // Lengths around a parameter are encoded when rendering
+        std::string dn(200, 'x');
+        BER::And both;
+        both.add(new BER::EqualityMatch("badgenuid", "\x01")).add(new BER::EqualityMatch("memberOf", dn));
+        auto active = compile("(&(badgenuid={0})(memberOf={1}))");
+        REQUIRE( active.parameters() == 2 );
+        REQUIRE( active.render({"\x01"_sv, dn}) == both.str() );
+        REQUIRE( (uint8_t)active.render({"\x01"_sv, dn})[1] == 0x81 );
+    }
+
+    SECTION( "invalid filters" ) {
+        for (auto text : {"", "cn=x", "(cn=x", "(cn=x))", "(=x)", "(cn=(x)", "(cn=\\zz)", "(cn=**)",
+                          "(:=x)", "(cn:a:b:=x)", "(cn>x)", "(&(cn=x)", "(!)"}) {
+            INFO( text );
+            REQUIRE_FALSE( LDAP::FilterTemplate::parse(text).second );
+        }
+    }
+}
+
+TEST_CASE( "Generate every filter choice", "[filter]" ) {
+    auto same = [](BER::Element *filter, const char *text) {
+        std::unique_ptr<BER::Element> owned(filter);
+        auto encoded = owned->str();
+        REQUIRE( owned->size() == encoded.size() );
+        REQUIRE( encoded == LDAP::FilterTemplate::parse(text).first.render() );
+    };
+
+    same(new BER::GreaterOrEqual("validUntil", "20261018000000Z"), "(validUntil>=20261018000000Z)");
+    same(new BER::LessOrEqual("validFrom", "20261018000000Z"), "(validFrom<=20261018000000Z)");
+    same(new BER::ApproxMatch("cn", "bob"), "(cn~=bob)");
+    same(&(new BER::Substrings("cn"))->initial("a").any("b").final("c"), "(cn=a*b*c)");
+    same(&(new BER::Substrings("cn"))->any("b"), "(cn=*b*)");
+    same(new BER::ExtensibleMatch("cn", "x", "2.5.13.5", true), "(cn:dn:2.5.13.5:=x)");
+    same(new BER::ExtensibleMatch("", "x", "2.5.13.5"), "(:2.5.13.5:=x)");
+    same(new BER::Not(new BER::Present("disabled")), "(!(disabled=*))");
+    same(new BER::Or(), "(|)");
+
+    auto member = new BER::And();
+    auto groups = new BER::Or();
+    groups->add(new BER::EqualityMatch("memberOf", "cn=active")).add(new BER::EqualityMatch("memberOf", "cn=staff"));
+    member->add(new BER::EqualityMatch("badgenuid", "\x04\xa1"s))
+           .add(groups)
+           .add(new BER::Not(new BER::EqualityMatch("accountDisabled", "TRUE")))
+           .add(new BER::GreaterOrEqual("validUntil", "20261018000000Z"));
+    same(member, "(&(badgenuid=\\04\\a1)(|(memberOf=cn=active)(memberOf=cn=staff))(!(accountDisabled=TRUE))"
+                 "(validUntil>=20261018000000Z))");
+
+    // Long form lengths all the way up
+    std::string dn(300, 'x');
+    auto longer = new BER::Not(new BER::EqualityMatch("memberOf", dn));
+    same(longer, ("(!(memberOf=" + dn + "))").c_str());
+}
+
+TEST_CASE( "Generate UnbindRequest and AbandonRequest", "[unbind][abandon]" ) {
+    LDAP::MsgBuilder::reset_id();
+    auto unbind_str = LDAP::UnbindRequest().str();
+    REQUIRE( unbind_str == "\x30\x05\x02\x01\x01\x42\x00"s );
+    auto abandon_str = LDAP::AbandonRequest(7).str();
+    REQUIRE( abandon_str == "\x30\x06\x02\x01\x02\x50\x01\x07"s );
+    auto high_str = LDAP::AbandonRequest(200).str();
+    REQUIRE( high_str == "\x30\x07\x02\x01\x03\x50\x02\x00\xc8"s );
+
+    LDAP::Directory directory;
+    bool close;
+    REQUIRE( directory.handle(LDAP::Response::parse(abandon_str), close).empty() );
+    REQUIRE_FALSE( close );
+    REQUIRE( directory.handle(LDAP::Response::parse(unbind_str), close).empty() );
+    REQUIRE( close );
+}
+
+TEST_CASE( "Generate WhoAmI and parse ExtendedResponse", "[extended]" ) {
+    LDAP::MsgBuilder::reset_id();
+    auto whoami_str = LDAP::WhoAmIRequest().str();
+    REQUIRE( whoami_str == "\x30\x1e\x02\x01\x01\x77\x19\x80\x17" "1.3.6.1.4.1.4203.1.11.3"s );
+    auto valued_str = LDAP::ExtendedRequest("1.2.3", "v").str();
+    REQUIRE( valued_str == "\x30\x0f\x02\x01\x02\x77\x0a\x80\x05" "1.2.3" "\x81\x01v"s );
+
+    auto op = LDAP::ExtendedResponse::encode(LDAP::Protocol::ResultCode::Success, "1.2.3", true, "dn:cn=door");
+    auto response = LDAP::ExtendedResponse::parse(op);
+    REQUIRE( response.second );
+    REQUIRE( response.first.result.success() );
+    REQUIRE( response.first.name == "1.2.3" );
+    REQUIRE( response.first.hasValue );
+    REQUIRE( response.first.value == "dn:cn=door" );
+    auto bare = LDAP::ExtendedResponse::parse(LDAP::ExtendedResponse::encode(LDAP::Protocol::ResultCode::ProtocolError));
+    REQUIRE( bare.second );
+    REQUIRE( bare.first.result.code == LDAP::Protocol::ResultCode::ProtocolError );
+    REQUIRE( !bare.first.hasValue );
+    REQUIRE( !LDAP::ExtendedResponse::parse(op.substr(0, op.size() - 1)).second );
+
+    LDAP::Directory directory;
+    bool close;
+    auto answer = [&](const std::string &request) {
+        auto reply = directory.handle(LDAP::Response::parse(request), close);
+        auto message = LDAP::Response::parse(reply);
+        REQUIRE( message.type == LDAP::Protocol::Type::ExtendedResponse );
+        auto extended = LDAP::ExtendedResponse::parse(message.op);
+        REQUIRE( extended.second );
+        return extended.first;
+    };
+    auto anonymous = answer(whoami_str);
+    REQUIRE( anonymous.result.success() );
+    REQUIRE( anonymous.hasValue );
+    REQUIRE( anonymous.value.empty() );
+    REQUIRE( answer(valued_str).result.code == LDAP::Protocol::ResultCode::ProtocolError );
+    directory.bindDN = "cn=door";
+    REQUIRE( answer(whoami_str).value == "dn:cn=door" );
+}
+
+TEST_CASE( "Directory only returns the base entry of a base object search", "[directory]" ) {
+    LDAP::Directory directory;
+    REQUIRE( directory.load("04a15c01 alice\n04a15c02 bob\n", "ou=Members") );
+    bool close;
+    auto entries = [&](const std::string &base) {
+        auto request = LDAP::SearchRequest(base, new BER::Present("objectClass"), LDAP::NoAttributes,
+                                           LDAP::Protocol::SearchRequest::Scope::BaseObject).str();
+        auto reply = directory.handle(LDAP::Response::parse(request), close);
+        int count = 0;
+        for (auto response = LDAP::Response::parse(reply); response.valid();
+             reply.erase(0, response.size), response = LDAP::Response::parse(reply)) {
+            if (response.type == LDAP::Protocol::Type::SearchResultEntry) {
+                count++;
+            }
+        }
+        return count;
+    };
+
+    // The root DSE read the door uses to check a server still answers
+    REQUIRE( entries("") == 0 );
+    REQUIRE( entries("CN=bob,ou=Members") == 1 );
+}
+
+TEST_CASE( "Directory answers CLDAP searches in one datagram", "[directory][cldap]" ) {
+    LDAP::Directory directory;
+    REQUIRE( directory.load("04a15c01 alice\n", "ou=Members") );
+
+    auto search = LDAP::SearchRequest("ou=Members", new BER::EqualityMatch("badgenuid", "\x04\xa1\x5c\x01"s), LDAP::NoAttributes).str();
+    auto reply = directory.datagram(search);
+    auto entry = LDAP::Response::parse(reply);
+    REQUIRE( entry.type == LDAP::Protocol::Type::SearchResultEntry );
+    auto done = LDAP::Response::parse(string_view(reply).substr(entry.size));
+    REQUIRE( done.type == LDAP::Protocol::Type::SearchResultDone );
+    REQUIRE( done.id == entry.id );
+    REQUIRE( entry.size + done.size == reply.size() );
+
+    // Search only, one message per datagram
+    REQUIRE( directory.datagram(LDAP::BindRequest("cn=door", "secret").str()).empty() );
+    REQUIRE( directory.datagram(search + search).empty() );
+    REQUIRE( directory.datagram(search.substr(0, 10)).empty() );
+}
+
+TEST_CASE( "Generate and find controls", "[controls]" ) {
+    LDAP::MsgBuilder::reset_id();
+    auto search = LDAP::SearchRequest("ou=Users", new BER::Present("badgenuid"), "badgenuid");
+    search.addControl(LDAP::PagedResults::encode(100, ""));
+    auto msg_str = search.str();
+    auto control_str = "\xa0\x23\x30\x21\x04\x16" "1.2.840.113556.1.4.319" "\x04\x07\x30\x05\x02\x01\x64\x04\x00"s;
+    REQUIRE( msg_str.substr(msg_str.size() - control_str.size()) == control_str );
+
+    auto msg = LDAP::Response::parse(msg_str);
+    REQUIRE( msg.valid() );
+    REQUIRE( msg.size == msg_str.size() );
+    REQUIRE( msg.type == LDAP::Protocol::Type::SearchRequest );
+    auto paged = LDAP::PagedResults::parse(msg.controls);
+    REQUIRE( paged.second );
+    REQUIRE( paged.first.size == 100 );
+    REQUIRE( paged.first.cookie.empty() );
+
+    auto critical = LDAP::Control::encode("1.2.3", "value", true) + LDAP::PagedResults::encode(0, "\x01\x02"s);
+    auto control = LDAP::Control::find(critical, "1.2.3");
+    REQUIRE( control.second );
+    REQUIRE( control.first.critical );
+    REQUIRE( control.first.value == "value"_sv );
+    REQUIRE( LDAP::PagedResults::parse(critical).first.cookie == string_view("\x01\x02", 2) );
+    REQUIRE_FALSE( LDAP::Control::find(critical, "1.2.4").second );
+    REQUIRE_FALSE( LDAP::PagedResults::parse("").second );
+}
+
+TEST_CASE( "Directory pages search results", "[directory]" ) {
+    LDAP::Directory directory;
+    REQUIRE( directory.load("04a15c01 alice\n04a15c02 bob\n04a15c03 carol\n", "ou=Members") );
+    bool close;
+
+    string cookie;
+    vector<size_t> pages;
+    do {
+        auto search = LDAP::SearchRequest("ou=Members", new BER::Present("badgenuid"), "badgenuid");
+        search.addControl(LDAP::PagedResults::encode(2, cookie));
+        auto reply = directory.handle(LDAP::Response::parse(search.str()), close);
+        size_t entries = 0;
+        for (size_t offset = 0; offset < reply.size();) {
+            auto response = LDAP::Response::parse(string_view(reply).substr(offset));
+            REQUIRE( response.valid() );
+            entries += response.type == LDAP::Protocol::Type::SearchResultEntry;
+            if (response.type == LDAP::Protocol::Type::SearchResultDone) {
+                auto paged = LDAP::PagedResults::parse(response.controls);
+                REQUIRE( paged.second );
+                cookie = to_string(paged.first.cookie);
+            }
+            offset += response.size;
+        }
+        pages.push_back(entries);
+    } while (!cookie.empty() && pages.size() < 5);
+
+    REQUIRE( pages == vector<size_t>{2, 1} );
+}
+
+TEST_CASE( "Generate and parse content synchronization messages", "[sync]" ) {
+    auto search = LDAP::SearchRequest("ou=Members", new BER::Present("badgenuid"), "badgenuid");
+    search.addControl(LDAP::SyncRequest::encode(LDAP::Protocol::Sync::Mode::RefreshAndPersist, true, "rid=001,csn=1"));
+    auto msg_str = search.str();
+    auto msg = LDAP::Response::parse(msg_str);
+    REQUIRE( msg.valid() );
+    auto request = LDAP::SyncRequest::parse(msg.controls);
+    REQUIRE( request.second );
+    REQUIRE( request.first.mode == LDAP::Protocol::Sync::Mode::RefreshAndPersist );
+    REQUIRE( request.first.hasCookie );
+    REQUIRE( request.first.cookie == "rid=001,csn=1"_sv );
+    REQUIRE_FALSE( request.first.reloadHint );
+    REQUIRE( LDAP::Control::find(msg.controls, LDAP::SyncRequestOid).first.critical );
+
+    auto uuid = string(16, '\x2a');
+    auto state = LDAP::SyncState::parse(LDAP::SyncState::encode(LDAP::Protocol::Sync::State::Delete, uuid));
+    REQUIRE( state.second );
+    REQUIRE( state.first.state == LDAP::Protocol::Sync::State::Delete );
+    REQUIRE( state.first.entryUUID == string_view(uuid) );
+    REQUIRE_FALSE( state.first.hasCookie );
+
+    auto done = LDAP::SyncDone::parse(LDAP::SyncDone::encode(true, "42", true));
+    REQUIRE( done.second );
+    REQUIRE( done.first.cookie == "42"_sv );
+    REQUIRE( done.first.refreshDeletes );
+    REQUIRE_FALSE( LDAP::SyncDone::parse(LDAP::PagedResults::encode(0, "")).second );
+
+    // Sent as IntermediateResponse messages
+    auto parseInfo = [](const string &message) {
+        auto response = LDAP::Response::parse(message);
+        REQUIRE( response.valid() );
+        REQUIRE( response.type == LDAP::Protocol::Type::IntermediateResponse );
+        return LDAP::SyncInfo::parse(response.op);
+    };
+    auto newCookie = parseInfo(LDAP::Response::encode(3, LDAP::Protocol::Type::IntermediateResponse,
+                                                      LDAP::SyncInfo::encode(LDAP::Protocol::Sync::Info::NewCookie, true, "43")));
+    REQUIRE( newCookie.second );
+    REQUIRE( newCookie.first.info == LDAP::Protocol::Sync::Info::NewCookie );
+    REQUIRE( newCookie.first.cookie == "43"_sv );
+
+    auto present = parseInfo(LDAP::Response::encode(3, LDAP::Protocol::Type::IntermediateResponse,
+                                                    LDAP::SyncInfo::encode(LDAP::Protocol::Sync::Info::RefreshPresent, false, "", false)));
+    REQUIRE( present.second );
+    REQUIRE( present.first.info == LDAP::Protocol::Sync::Info::RefreshPresent );
+    REQUIRE_FALSE( present.first.hasCookie );
+    REQUIRE_FALSE( present.first.refreshDone );
+
+    auto deleted = parseInfo(LDAP::Response::encode(3, LDAP::Protocol::Type::IntermediateResponse,
+                                                    LDAP::SyncInfo::encode(LDAP::Protocol::Sync::Info::SyncIdSet, true, "44", true,
+                                                                           {uuid, string(16, '\x01')})));
+    REQUIRE( deleted.second );
+    REQUIRE( deleted.first.info == LDAP::Protocol::Sync::Info::SyncIdSet );
+    REQUIRE( deleted.first.cookie == "44"_sv );
+    REQUIRE( deleted.first.refreshDeletes );
+    vector<string> uuids;
+    REQUIRE( deleted.first.uuids([&](string_view value) { uuids.push_back(to_string(value)); }) == 2 );
+    REQUIRE( uuids[0] == uuid );
+
+    REQUIRE_FALSE( LDAP::SyncInfo::parse(BER::View::encode(0x80, "1.2.3") + BER::View::encode(0x81, "\x80\x00"s)).second );
+}
+
+TEST_CASE( "Directory answers refreshOnly synchronizations with deltas", "[directory][sync]" ) {
+    LDAP::Directory directory;
+    REQUIRE( directory.load("04a15c01 alice cn=active\n04a15c02 bob cn=active\n04a15c03 carol\n", "ou=Members") );
+    bool close;
+
+    struct Change
+    {
+        string dn;
+        LDAP::Protocol::Sync::State state;
+    };
+    auto refresh = [&](LDAP::Protocol::Sync::Mode mode, bool hasCookie, const string &cookie, vector<Change> &changes, LDAP::SyncDone &done) {
+        auto filter = new BER::EqualityMatch("memberOf", "cn=active");
+        auto search = LDAP::SearchRequest("ou=Members", filter, "badgenuid");
+        search.addControl(LDAP::SyncRequest::encode(mode, hasCookie, cookie));
+        auto reply = directory.handle(LDAP::Response::parse(search.str()), close);
+        LDAP::Protocol::ResultCode code = LDAP::Protocol::ResultCode::Other;
+        for (size_t offset = 0; offset < reply.size();) {
+            auto response = LDAP::Response::parse(string_view(reply).substr(offset));
+            REQUIRE( response.valid() );
+            if (response.type == LDAP::Protocol::Type::SearchResultEntry) {
+                auto state = LDAP::SyncState::parse(response.controls);
+                REQUIRE( state.second );
+                REQUIRE( state.first.entryUUID.size() == 16 );
+                changes.push_back(Change{to_string(LDAP::SearchResultEntry::parse(response.op).first.objectName), state.first.state});
+            } else if (response.type == LDAP::Protocol::Type::SearchResultDone) {
+                code = LDAP::Result::parse(response.op).first.code;
+                auto syncDone = LDAP::SyncDone::parse(response.controls);
+                if (syncDone.second) {
+                    done = syncDone.first;
+                }
+            }
+            offset += response.size;
+        }
+        return code;
+    };
+
+    vector<Change> full;
+    LDAP::SyncDone done;
+    REQUIRE( refresh(LDAP::Protocol::Sync::Mode::RefreshOnly, false, "", full, done) == LDAP::Protocol::ResultCode::Success );
+    REQUIRE( full.size() == 2 );
+    REQUIRE( full[0].state == LDAP::Protocol::Sync::State::Add );
+    REQUIRE( done.hasCookie );
+    REQUIRE_FALSE( done.refreshDeletes );
+    auto cookie = to_string(done.cookie);
+
+    vector<Change> none;
+    REQUIRE( refresh(LDAP::Protocol::Sync::Mode::RefreshOnly, true, cookie, none, done) == LDAP::Protocol::ResultCode::Success );
+    REQUIRE( none.empty() );
+
+    directory.remove("\x04\xa1\x5c\x02"s);
+    directory.add("\x04\xa1\x5c\x03"s, "carol", "ou=Members", {"cn=active"});
+    directory.add("\x04\xa1\x5c\x01"s, "alice", "ou=Members");
+    directory.add("\x04\xa1\x5c\x04"s, "dave", "ou=Members", {"cn=active"});
+    vector<Change> delta;
+    REQUIRE( refresh(LDAP::Protocol::Sync::Mode::RefreshOnly, true, cookie, delta, done) == LDAP::Protocol::ResultCode::Success );
+    REQUIRE( done.refreshDeletes );
+    REQUIRE( delta.size() == 4 );
+    REQUIRE( delta[0].dn == "cn=alice,ou=Members" );
+    REQUIRE( delta[0].state == LDAP::Protocol::Sync::State::Delete );
+    REQUIRE( delta[1].dn == "cn=carol,ou=Members" );
+    REQUIRE( delta[1].state == LDAP::Protocol::Sync::State::Modify );
+    REQUIRE( delta[2].dn == "cn=dave,ou=Members" );
+    REQUIRE( delta[2].state == LDAP::Protocol::Sync::State::Add );
+    REQUIRE( delta[3].dn == "cn=bob,ou=Members" );
+    REQUIRE( delta[3].state == LDAP::Protocol::Sync::State::Delete );
+
+    vector<Change> persist;
+    REQUIRE( refresh(LDAP::Protocol::Sync::Mode::RefreshAndPersist, false, "", persist, done) == LDAP::Protocol::ResultCode::UnwillingToPerform );
+}